@@ -0,0 +1,316 @@
+local bit = require("bit")
+local ffi = require("ffi")
+local io = require("io")
+local math = require("math")
+local os = require("os")
+local table = require("table")
+
+local class = require("class").class
+local util = require("util")
+
+local error_util = require("error_util")
+local splitAtWhitespace = util.splitAtWhitespace
+local check = error_util.check
+local checktype = error_util.checktype
+
+local assert = assert
+local ipairs = ipairs
+local pcall = pcall
+local tonumber = tonumber
+local tostring = tostring
+local type = type
+
+local C = ffi.C
+
+----------
+
+-- NOTE: this module must not require posix.lua, since it is used by extractdecls, which
+--  in turn is used to generate the declarations that posix.lua depends on.
+ffi.cdef[[
+uint64_t ljclang_hashBytes(const char *bytes, size_t length);
+int ljclang_getFileModificationTime(const char *path, int64_t *mtime);
+char *getcwd(char *buf, size_t size);
+void free(void *ptr);
+int getpid(void);
+]]
+
+local support = ffi.load("ljclang_support")
+
+local api = {}
+
+-- Returns a 64-bit hash of <str> as a string of 16 hexadecimal digits.
+function api.hashString(str)
+    checktype(str, 1, "string", 2)
+    return bit.tohex(support.ljclang_hashBytes(str, #str), 16)
+end
+
+local int64_array_t = ffi.typeof("int64_t [1]")
+
+-- Returns the modification time of <fileName> in seconds since the Epoch, or nil if it
+-- could not be obtained.
+local function getModificationTime(fileName)
+    local mtime = int64_array_t()
+    if (support.ljclang_getFileModificationTime(fileName, mtime) ~= 0) then
+        return nil
+    end
+    return tonumber(mtime[0])
+end
+
+-- Returns the low and high 32 bits of the modification time <mtime>.
+local function splitModificationTime(mtime)
+    local high = math.floor(mtime / 2^32)
+    return mtime - high * 2^32, high
+end
+
+local function getcwd()
+    local cwd = C.getcwd(nil, 0)
+    assert(cwd ~= nil, "failed getting the current working directory")
+    local str = ffi.string(cwd)
+    C.free(cwd)
+    return str
+end
+
+-- Returns the signature of a parse of <fileName> with command line <args> and translation
+-- unit options <opts> (as passed to Index:parse()) from the current working directory.
+local function getSignature(fileName, args, opts)
+    local optsStr = (opts == nil) and "" or
+        (type(opts) == "number") and tostring(opts) or table.concat(opts, ",")
+    return table.concat({ getcwd(), fileName, optsStr, table.concat(args, "\0") }, "\0\0")
+end
+
+-- Layout of a metadata file (all integers are uint32_t):
+--  "LJCA" <version> <signature length> <file count> <diag count>
+--  <signature>
+--  <length of file name i> <low 32 bits of mtime i> <high 32 bits of mtime i> for each
+--   file i
+--  <concatenated file names>
+--  <length of severity i> <length of formatted diagnostic i> for each diagnostic i
+--  <concatenated severity and formatted diagnostic of each diagnostic>
+local EntryMagic, EntryVersion = "LJCA", 1
+
+-- Returns the diagnostics and the sequence of file names of the entry in <data>, or nil if
+-- it is not for <signature> or if any of its files has been modified since it was stored.
+-- Raises an error if <data> is not a valid entry.
+local function parseEntry(data, signature)
+    check(data:sub(1, #EntryMagic) == EntryMagic, "wrong magic", 1)
+
+    local reader = util.BinaryReader(data:sub(#EntryMagic + 1))
+    local header = reader:uint32s(4)
+
+    if (header[0] ~= EntryVersion or reader:string(header[1]) ~= signature) then
+        -- NOTE: a signature mismatch means a collision of the file name hashes.
+        return nil
+    end
+
+    local fileCount, diagCount = header[2], header[3]
+    local fileRecords = reader:uint32s(3 * fileCount)
+    local fileNames = {}
+
+    for i = 0, 3 * fileCount - 1, 3 do
+        local fileName = reader:string(fileRecords[i])
+        local mtime = getModificationTime(fileName)
+        if (mtime == nil) then
+            return nil
+        end
+
+        local low, high = splitModificationTime(mtime)
+        if (low ~= fileRecords[i + 1] or high ~= fileRecords[i + 2]) then
+            return nil
+        end
+
+        fileNames[#fileNames + 1] = fileName
+    end
+
+    local diagRecords = reader:uint32s(2 * diagCount)
+    local diags = {}
+
+    for i = 0, 2 * diagCount - 1, 2 do
+        diags[#diags + 1] = {
+            reader:string(diagRecords[i]), reader:string(diagRecords[i + 1])
+        }
+    end
+
+    check(reader:isAtEnd(), "trailing data", 1)
+    return diags, fileNames
+end
+
+-- Returns the sequence of diagnostics of <tu>, each as { <severity>, <formatted text> }.
+function api.GetDiags(tu)
+    local diagSet = tu:diagnosticSet()
+    local diags = {}
+
+    for i = 1, #diagSet do
+        local d = diagSet[i]
+        diags[i] = { d:severity(), d:format() }
+    end
+
+    return diags
+end
+
+-- Writes <data> to <fileName> by way of a temporary file, so that concurrent readers never
+-- see a partial file. Returns true on success, false otherwise.
+local function writeFileAtomically(fileName, data)
+    local tempFileName = fileName..".tmp"..tostring(C.getpid())
+    local file = io.open(tempFileName, "wb")
+
+    if (file == nil) then
+        return false
+    end
+
+    local ok = file:write(data)
+    ok = file:close() and ok
+
+    if (not ok or not os.rename(tempFileName, fileName)) then
+        os.remove(tempFileName)
+        return false
+    end
+
+    return true
+end
+
+-- A cache of serialized translation units (as written by TranslationUnit:save()) in a
+-- directory, keyed by a signature of the parse and validated by the modification times of
+-- all files that the translation unit was made from. Since the diagnostics of a loaded
+-- translation unit are lost, their formatted text is cached alongside.
+--
+-- NOTE: An entry consists of the AST file and a metadata file. The AST file is written
+--  first, and each one is replaced atomically (libclang itself saves by way of a temporary
+--  file), so a reader that has validated the metadata file loads an AST that is at least
+--  as recent.
+api.ASTCache = class
+{
+    function(directory)
+        checktype(directory, 1, "string", 2)
+
+        return {
+            directory = directory,
+        }
+    end,
+
+    -- Returns a translation unit and error code for <fileName> parsed with <args> and <opts>
+    -- like index:parse() would, followed by the sequence of its diagnostics (see GetDiags())
+    -- and whether it was loaded from the cache.
+    -- If there is no fresh entry, parses and stores a new entry, unless libclang refuses to
+    -- save the translation unit (for example, after a fatal error) or a file was modified
+    -- during parsing.
+    --
+    -- On failure to parse, returns nil and the error code.
+    parse = function(self, index, fileName, args, opts)
+        local baseName, signature
+        baseName, signature, args = self:getEntryNames_(fileName, args, opts)
+
+        local diags = self:lookup_(baseName, signature)
+
+        if (diags ~= nil) then
+            local tu, errorCode = index:loadTranslationUnit(baseName..".ast")
+            if (tu ~= nil) then
+                return tu, errorCode, diags, true
+            end
+        end
+
+        local startTime = os.time()
+        local tu, errorCode = index:parse(fileName, args, opts)
+
+        if (tu == nil) then
+            return nil, errorCode
+        end
+
+        diags = api.GetDiags(tu)
+        self:store_(baseName, signature, tu, diags, startTime)
+
+        return tu, errorCode, diags, false
+    end,
+
+    -- Returns the sequence of the names of all files that the translation unit for
+    -- <fileName>, <args> and <opts> (see parse()) was made from if there is a fresh entry
+    -- for it, or nil otherwise. Its AST file is not read.
+    getFileNames = function(self, fileName, args, opts)
+        local baseName, signature = self:getEntryNames_(fileName, args, opts)
+        local _, fileNames = self:lookup_(baseName, signature)
+        return fileNames
+    end,
+
+-- private:
+    -- Returns the base name of the files of an entry and its signature, followed by <args>
+    -- as a table.
+    getEntryNames_ = function(self, fileName, args, opts)
+        checktype(fileName, 2, "string", 3)
+        check(type(args) == "string" or type(args) == "table",
+              "<args> must be a string or table", 3)
+
+        if (type(args) == "string") then
+            args = splitAtWhitespace(args)
+        end
+
+        local signature = getSignature(fileName, args, opts)
+        return self.directory.."/"..api.hashString(signature), signature, args
+    end,
+
+    lookup_ = function(self, baseName, signature)
+        local file = io.open(baseName..".astc", "rb")
+        if (file == nil) then
+            return nil
+        end
+
+        local data = file:read("*a")
+        file:close()
+
+        local ok, diags, fileNames = pcall(parseEntry, data or "", signature)
+        if (not ok) then
+            -- Treat an invalid entry like a missing one. It is overwritten on the next store.
+            return nil
+        end
+
+        return diags, fileNames
+    end,
+
+    store_ = function(self, baseName, signature, tu, diags, startTime)
+        local fileNames, fileRecords = {}, {}
+        local canStore = true
+
+        tu:inclusions(function(file)
+            local fileName = file:name()
+            local mtime = getModificationTime(fileName)
+
+            -- If a file was modified at or after the start of parsing, the translation unit
+            -- may predate its current contents.
+            if (mtime == nil or mtime >= startTime) then
+                canStore = false
+                return
+            end
+
+            local low, high = splitModificationTime(mtime)
+            fileNames[#fileNames + 1] = fileName
+            fileRecords[#fileRecords + 1] = #fileName
+            fileRecords[#fileRecords + 1] = low
+            fileRecords[#fileRecords + 1] = high
+        end)
+
+        if (not canStore or #fileNames == 0) then
+            return false
+        end
+
+        local diagRecords, diagStrings = {}, {}
+
+        for _, diag in ipairs(diags) do
+            diagRecords[#diagRecords + 1] = #diag[1]
+            diagRecords[#diagRecords + 1] = #diag[2]
+            diagStrings[#diagStrings + 1] = diag[1]
+            diagStrings[#diagStrings + 1] = diag[2]
+        end
+
+        if (tu:save(baseName..".ast") ~= "CXSaveError_None") then
+            return false
+        end
+
+        local header = { EntryVersion, #signature, #fileNames, #diags }
+        local data = EntryMagic..util.packUint32s(header)..signature..
+            util.packUint32s(fileRecords)..table.concat(fileNames)..
+            util.packUint32s(diagRecords)..table.concat(diagStrings)
+
+        return writeFileAtomically(baseName..".astc", data)
+    end,
+}
+
+-- Done!
+return api
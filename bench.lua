@@ -0,0 +1,382 @@
+#!/usr/bin/env luajit
+-- bench.lua -- Benchmarks for the LJClang binding and watch_compile_commands.
+--
+-- Run with 'make bench'. Each result comes with the wall clock time, the CPU time and the
+-- peak resident set size, so that they can be compared between versions of LJClang.
+
+local cl = require("ljclang")
+local llvm_libdir_include = require("llvm_libdir_include")[1]
+local posix = require("posix")
+
+local io = require("io")
+local os = require("os")
+local math = require("math")
+local string = require("string")
+local table = require("table")
+
+local format = string.format
+
+local arg = arg
+local assert = assert
+local collectgarbage = collectgarbage
+local ipairs = ipairs
+local print = print
+local tonumber = tonumber
+local tostring = tostring
+
+----------
+
+local function printf(fmt, ...)
+    print(format(fmt, ...))
+end
+
+local function errprint(str)
+    io.stderr:write(str.."\n")
+end
+
+local function usage(hline)
+    if (hline) then
+        errprint("ERROR: "..hline.."\n")
+    end
+    local progname = arg[0]:match("([^/]+)$")
+    errprint("Usage:\n  "..progname.." [options...]\n")
+    errprint
+[[
+Options:
+  -n <count>: Number of repetitions for the binding benchmarks. (Default: 5)
+  -t <count>: Number of translation units in the synthetic compilation database.
+     (Default: 64)
+  -c <concurrency>[,<concurrency>...]: Concurrencies at which to run
+     watch_compile_commands on it. (Default: 1,2,4)
+  -B: Skip the binding benchmarks.
+  -W: Skip the watch_compile_commands benchmarks.
+]]
+    os.exit(1)
+end
+
+local parsecmdline = require("parsecmdline_pk")
+local opt_meta = { n=true, t=true, c=true, B=false, W=false }
+
+local opts, files = parsecmdline.getopts(opt_meta, arg, usage)
+
+if (#files > 0) then
+    usage("Unexpected positional argument")
+end
+
+local function isPositiveInteger(number)
+    return (number ~= nil and number >= 1 and number == math.floor(number))
+end
+
+local function getCount(optName, default)
+    local str = opts[optName]
+    local count = (str ~= nil) and tonumber(str) or default
+
+    if (not isPositiveInteger(count)) then
+        usage("Argument to option -"..optName.." must be a positive integral number")
+    end
+
+    return count
+end
+
+local repetitionCount = getCount("n", 5)
+local tuCount = getCount("t", 64)
+local concurrencies = {}
+
+for str in (opts.c or "1,2,4"):gmatch("[^,]+") do
+    local concurrency = tonumber(str)
+    if (not isPositiveInteger(concurrency)) then
+        usage("Argument to option -c must be a comma-separated list of positive integers")
+    end
+    concurrencies[#concurrencies + 1] = concurrency
+end
+
+---------- Measurement ----------
+
+local function getMonotonicSeconds()
+    local ts = posix.clock_gettime()
+    return tonumber(ts.sec) + tonumber(ts.nsec) / 1e9
+end
+
+-- Returns the value of field <key> of /proc/self/status in KiB, or 0 if unknown.
+local function getProcStatusKb(key)
+    local f = io.open("/proc/self/status")
+    if (f == nil) then
+        return 0
+    end
+
+    local str = f:read("*a") or ""
+    f:close()
+    return tonumber(str:match("\n"..key..":%s*(%d+) kB")) or 0
+end
+
+-- Makes the peak RSS of this process (VmHWM) start over from its current RSS.
+local function resetPeakRss()
+    local f = io.open("/proc/self/clear_refs", "w")
+    if (f ~= nil) then
+        f:write("5")
+        f:close()
+    end
+end
+
+local function printHeader(title)
+    printf("\n== %s", title)
+    printf("%-44s %10s %10s %10s %14s", "", "count", "wall [ms]", "CPU [ms]",
+           "max RSS [KiB]")
+end
+
+local function printResult(name, count, wallSeconds, cpuSeconds, maxRssKb)
+    printf("%-44s %10d %10.2f %10.2f %14d", name, count,
+           1e3 * wallSeconds, 1e3 * cpuSeconds, maxRssKb)
+end
+
+-- Runs <func> <repetitionCount> times after one untimed warm-up run and prints the time
+-- per run. <func> returns the number of items that it processed, which is printed too.
+local function measure(name, func)
+    local count = func()
+    collectgarbage()
+    resetPeakRss()
+
+    local startCpu = posix.getResourceUsage(false)
+    local startWall = getMonotonicSeconds()
+
+    for _ = 1, repetitionCount do
+        func()
+    end
+
+    local wallSeconds = getMonotonicSeconds() - startWall
+    local cpuSeconds = posix.getResourceUsage(false) - startCpu
+
+    printResult(name, count, wallSeconds / repetitionCount, cpuSeconds / repetitionCount,
+                getProcStatusKb("VmHWM"))
+end
+
+-- Runs the shell command <command> in a child process and returns the wall clock time, the
+-- CPU time and the peak RSS of the largest process started by it.
+local function measureCommand(command)
+    local pipe = posix.pipe()
+    local startWall = getMonotonicSeconds()
+    local whoami, childPid = posix.fork()
+
+    if (whoami == "child") then
+        -- NOTE: Resource usage of descendants accumulates over their lifetime, so measure
+        --  from a fresh process.
+        pipe.r:close()
+        local ok = os.execute(command)
+        local cpuSeconds, maxRssKb = posix.getResourceUsage(true)
+        pipe.w:write(format("%s %.17g %d", tostring(ok == 0 or ok == true),
+                            cpuSeconds, maxRssKb))
+        os.exit(0)
+    end
+
+    pipe.w:close()
+    local result = pipe.r:read(256)
+    pipe.r:close()
+    posix.waitpid(childPid, 0)
+
+    local wallSeconds = getMonotonicSeconds() - startWall
+    local okStr, cpuStr, maxRssStr = result:match("^(%a+) (%S+) (%d+)$")
+    assert(okStr ~= nil, "unexpected result from child process")
+
+    if (okStr ~= "true") then
+        errprint("ERROR: command failed: "..command)
+        os.exit(1)
+    end
+
+    return wallSeconds, tonumber(cpuStr), tonumber(maxRssStr)
+end
+
+---------- Binding benchmarks ----------
+
+local ClangOpts = { "-std=c++17", "-isystem", llvm_libdir_include }
+
+local function getInputFileNames()
+    local fileNames = {}
+    local dir = posix.Dir("test_data")
+
+    while (true) do
+        local name = dir:read()
+        if (name == nil) then
+            break
+        elseif (name:match("%.[ch]pp$")) then
+            fileNames[#fileNames + 1] = "test_data/"..name
+        end
+    end
+
+    table.sort(fileNames)
+    fileNames[#fileNames + 1] = "dev/cxx_headers.hpp"
+    return fileNames
+end
+
+local function parse(fileName)
+    local tu, errorCode = cl.createIndex():parse(fileName, ClangOpts)
+    if (tu == nil) then
+        errprint(format("ERROR: failed parsing %s: %s", fileName, tostring(errorCode)))
+        os.exit(1)
+    end
+    return tu
+end
+
+local visitedCount
+local CountingVisitor = cl.regCursorVisitor(function()
+    visitedCount = visitedCount + 1
+    return cl.ChildVisitResult.Recurse
+end)
+
+local function countWithVisitor(cursor)
+    visitedCount = 0
+    cursor:children(CountingVisitor)
+    return visitedCount
+end
+
+local function countWithTables(cursor)
+    local count = 0
+    for _, child in ipairs(cursor:children()) do
+        count = count + 1 + countWithTables(child)
+    end
+    return count
+end
+
+local function runBindingBenchmarks()
+    for _, fileName in ipairs(getInputFileNames()) do
+        printHeader(fileName)
+
+        measure("Index:parse()", function()
+            parse(fileName)
+            return 1
+        end)
+
+        local tu = parse(fileName)
+        local tuCursor = tu:cursor()
+
+        measure("Cursor:children(<visitor>), recursive", function()
+            return countWithVisitor(tuCursor)
+        end)
+
+        measure("Cursor:children() tables, recursive", function()
+            return countWithTables(tuCursor)
+        end)
+
+        local cursorArray = tuCursor:collect()
+
+        measure("Cursor:name()", function()
+            for i = 0, #cursorArray - 1 do
+                cursorArray.cursors[i]:name()
+            end
+            return #cursorArray
+        end)
+
+        measure("Cursor:USR()", function()
+            for i = 0, #cursorArray - 1 do
+                cursorArray.cursors[i]:USR()
+            end
+            return #cursorArray
+        end)
+
+        measure("TranslationUnit:inclusions()", function()
+            local count = 0
+            tu:inclusions(function()
+                count = count + 1
+            end)
+            return count
+        end)
+    end
+end
+
+---------- watch_compile_commands benchmarks ----------
+
+local HeaderCount = 8
+
+-- Creates a compilation database of <tuCount> translation units in a new temporary
+-- directory, each of which includes some of <HeaderCount> project headers as well as
+-- standard library headers. Returns the name of the compile_commands.json file.
+local function createSyntheticDatabase()
+    local dirName = os.tmpname()
+    assert(os.remove(dirName))
+    assert(os.execute("/bin/mkdir '"..dirName.."'") == 0)
+
+    local function writeFile(name, contents)
+        local f = assert(io.open(dirName.."/"..name, "w"))
+        f:write(contents)
+        f:close()
+    end
+
+    for h = 1, HeaderCount do
+        writeFile(format("header%d.hpp", h), format([[
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+namespace bench {
+template <typename T>
+struct Container%d {
+    std::vector<T> items;
+    std::map<std::string, T> byName;
+
+    void add(const std::string &name, T value) {
+        items.push_back(value);
+        byName[name] = value;
+    }
+};
+}
+]], h))
+    end
+
+    local entries = {}
+
+    for t = 1, tuCount do
+        local fileName = format("tu%d.cpp", t)
+        local h1, h2 = (t % HeaderCount) + 1, ((3 * t) % HeaderCount) + 1
+
+        writeFile(fileName, format([[
+#include "header%d.hpp"
+#include "header%d.hpp"
+
+int function%d() {
+    bench::Container%d<int> c1;
+    bench::Container%d<double> c2;
+    c1.add("one", %d);
+    c2.add("two", %d.5);
+    return static_cast<int>(c1.items.size() + c2.byName.size());
+}
+]], h1, h2, t, h1, h2, t, t))
+
+        entries[t] = format('{ "directory": "%s", "command": "c++ -std=c++17 -c %s", '..
+                                '"file": "%s" }', dirName, fileName, fileName)
+    end
+
+    writeFile("compile_commands.json", "[\n"..table.concat(entries, ",\n").."\n]\n")
+    return dirName.."/compile_commands.json"
+end
+
+local function runWatcherBenchmarks()
+    local dbFileName = createSyntheticDatabase()
+    local commandFormat = "luajit ./watch_compile_commands.lua -x -P -c %d '"..
+        dbFileName.."' > /dev/null"
+
+    printHeader(format("watch_compile_commands -x, %d translation units", tuCount))
+
+    -- Warm-up: also fills the cache of system include directories.
+    measureCommand(format(commandFormat, 1))
+
+    for _, concurrency in ipairs(concurrencies) do
+        local wallSeconds, cpuSeconds, maxRssKb = measureCommand(
+            format(commandFormat, concurrency))
+        printResult(format("-c %d", concurrency), tuCount,
+                    wallSeconds, cpuSeconds, maxRssKb)
+    end
+
+    os.execute("/bin/rm -rf '"..dbFileName:match("^(.*)/").."'")
+end
+
+----------
+
+printf("LJClang benchmarks (libclang %s)", cl.clangVersion())
+
+if (not opts.B) then
+    runBindingBenchmarks()
+end
+
+if (not opts.W) then
+    runWatcherBenchmarks()
+end
@@ -1,6 +1,9 @@
+local bit = require("bit")
+local ffi = require("ffi")
 local io = require("io")
+local string = require("string")
+local table = require("table")
 
-local math = require("math")
 local util = require("util")
 
 local compile_commands_util = require("compile_commands_util")
@@ -8,192 +11,402 @@ local compile_commands_util = require("compile_commands_util")
 local check = require("error_util").check
 
 local assert = assert
+local error = error
+local format = string.format
 local ipairs = ipairs
-local loadstring = loadstring
-local pairs = pairs
 local pcall = pcall
-local setfenv = setfenv
+local tonumber = tonumber
 local type = type
 
 ----------
 
 local api = {}
 
-local function tweak_json_string_for_load_as_lua_table(str)
-    -- replace a lone '[]' with '{}' so that an empty compile_commands.json is handled
-    str = str:gsub("^%[%]", "{}")
-    -- replace leading/trailing matching '[ (...) ]' with '{ (...) }'
-    str = str:gsub("^%[\n", "{\n"):gsub("\n%]\n?$", "\n}")
-    -- replace any other '[]' (expected: of 'arguments' key, if present)
-    str = str:gsub(": %[\n", ": {\n"):gsub("%], *\n", "},\n")
-    -- replace '"<key>": ' by 'key= ' (expected to occur in what would now be a Lua table)
-    return "return "..str:gsub('\n( *)"([a-z]+)": ', '\n%1%2= ')
+---------- JSON tokenizer ----------
+
+local const_uint8_ptr_t = ffi.typeof("const uint8_t *")
+
+local Byte = {
+    Tab = 9, LF = 10, CR = 13, Space = 32,
+    Quote = 34, Comma = 44, Minus = 45, Colon = 58,
+    LBracket = 91, Backslash = 92, RBracket = 93,
+    LBrace = 123, RBrace = 125,
+}
+
+local SimpleEscapes = {
+    [34] = '"', [92] = '\\', [47] = '/',
+    [98] = '\b', [102] = '\f', [110] = '\n', [114] = '\r', [116] = '\t',
+}
+
+local function encodeUtf8(codePoint)
+    if (codePoint < 0x80) then
+        return string.char(codePoint)
+    elseif (codePoint < 0x800) then
+        return string.char(0xC0 + bit.rshift(codePoint, 6),
+                           0x80 + bit.band(codePoint, 0x3F))
+    elseif (codePoint < 0x10000) then
+        return string.char(0xE0 + bit.rshift(codePoint, 12),
+                           0x80 + bit.band(bit.rshift(codePoint, 6), 0x3F),
+                           0x80 + bit.band(codePoint, 0x3F))
+    else
+        return string.char(0xF0 + bit.rshift(codePoint, 18),
+                           0x80 + bit.band(bit.rshift(codePoint, 12), 0x3F),
+                           0x80 + bit.band(bit.rshift(codePoint, 6), 0x3F),
+                           0x80 + bit.band(codePoint, 0x3F))
+    end
 end
 
-local PREFIX = "ERROR: Unexpected input: parsed result "
+-- Returns an iterator over the elements of the JSON array that makes up <str>. Each
+-- element is only tokenized when it is requested and is returned as a Lua value, with JSON
+-- objects becoming tables keyed by their (string) keys and 'null' becoming nil. Malformed
+-- input raises an error.
+--
+-- NOTE: the input is scanned in place through a pointer into the Lua string. Strings
+--  created from it are interned by LuaJIT, so that the many repeated directories and
+--  arguments of a compilation database are each stored only once.
+local function iterateJsonArray(str)
+    local ptr = ffi.cast(const_uint8_ptr_t, str)
+    local length = #str
+    local pos = 0
+
+    local fail = function(what)
+        error(format("invalid JSON at byte offset %d: %s", pos, what), 0)
+    end
 
-local function validate_compile_commands_table(cmds)
-    if (type(cmds) ~= "table") then
-        return PREFIX.."is not a Lua table"
+    local peek = function()
+        while (pos < length) do
+            local c = ptr[pos]
+            if (c ~= Byte.Space and c ~= Byte.LF and c ~= Byte.CR and c ~= Byte.Tab) then
+                return c
+            end
+            pos = pos + 1
+        end
     end
 
-    local numCmds = #cmds
+    local expect = function(byte)
+        if (peek() ~= byte) then
+            fail(format("expected '%s'", string.char(byte)))
+        end
+        pos = pos + 1
+    end
 
-    for k,_ in pairs(cmds) do
-        if (type(k) ~= "number") then
-            return PREFIX.."contains non-numeric keys"
+    local readHex4 = function()
+        local hex = str:sub(pos + 1, pos + 4)
+        if (not hex:match("^%x%x%x%x$")) then
+            fail("invalid \\u escape")
         end
+        pos = pos + 4
+        return tonumber(hex, 16)
+    end
 
-        if (math.floor(k) ~= k) then
-            return PREFIX.."contains non-integral numeric keys"
+    -- Returns the string that the escape sequence starting at the current position
+    -- (which is that of the backslash) stands for, advancing past it.
+    local readEscape = function()
+        local c = (pos + 1 < length) and ptr[pos + 1] or nil
+        pos = pos + 2
+
+        if (SimpleEscapes[c] ~= nil) then
+            return SimpleEscapes[c]
+        elseif (c ~= 117) then  -- 'u'
+            fail("invalid escape sequence")
         end
 
-        if (not (k >= 1 and k <= numCmds)) then
-            return PREFIX.."contains numeric keys inconsistent with #table"
+        local codePoint = readHex4()
+
+        if (codePoint >= 0xD800 and codePoint <= 0xDBFF) then
+            -- High surrogate: must be followed by an escaped low surrogate.
+            if (str:sub(pos + 1, pos + 2) ~= "\\u") then
+                fail("unpaired surrogate")
+            end
+            pos = pos + 2
+            local lowSurrogate = readHex4()
+            if (not (lowSurrogate >= 0xDC00 and lowSurrogate <= 0xDFFF)) then
+                fail("unpaired surrogate")
+            end
+            codePoint = 0x10000 + (codePoint - 0xD800) * 0x400 + (lowSurrogate - 0xDC00)
         end
+
+        return encodeUtf8(codePoint)
     end
 
-    local hasArgs = (numCmds > 0 and cmds[1].arguments ~= nil)
-    local hasCommand = (numCmds > 0 and cmds[1].command ~= nil)
+    local readString = function()
+        expect(Byte.Quote)
 
-    if (numCmds > 0 and not hasArgs and not hasCommand) then
-        return PREFIX.."is non-empty but its first element contains neither key 'arguments' nor 'command'"
-    end
+        local startPos = pos
+        local pieces = nil
 
-    local key = hasArgs and "arguments" or "command"
-    local expectedKeyType = hasArgs and "table" or "string"
-    local expectedMissingKey = hasArgs and "command" or "arguments"
+        while (true) do
+            if (pos >= length) then
+                fail("unterminated string")
+            end
 
-    for _, cmd in ipairs(cmds) do
-        if (type(cmd) ~= "table") then
-            return PREFIX.."contains missing or non-table elements"
+            local c = ptr[pos]
+
+            if (c == Byte.Quote) then
+                local piece = ffi.string(ptr + startPos, pos - startPos)
+                pos = pos + 1
+
+                if (pieces == nil) then
+                    return piece
+                end
+
+                pieces[#pieces + 1] = piece
+                return table.concat(pieces)
+            elseif (c == Byte.Backslash) then
+                pieces = pieces or {}
+                pieces[#pieces + 1] = ffi.string(ptr + startPos, pos - startPos)
+                pieces[#pieces + 1] = readEscape()
+                startPos = pos
+            elseif (c < Byte.Space) then
+                fail("unescaped control character in string")
+            else
+                pos = pos + 1
+            end
         end
+    end
 
-        if (type(cmd.directory) ~= "string") then
-            return PREFIX.."contains an element with key 'directory' missing or not of string type"
+    local readValue  -- "forward-declare"
+
+    -- Reads the elements of an array or the members of an object up to the closing
+    -- <closeByte>, calling readElement() for each one.
+    local readSequence = function(closeByte, readElement)
+        pos = pos + 1
+
+        if (peek() == closeByte) then
+            pos = pos + 1
+            return
         end
 
-        if (type(cmd.file) ~= "string") then
-            return PREFIX.."contains an element with key 'file' missing or not of string type"
+        repeat
+            readElement()
+            local c = peek()
+            pos = pos + 1
+
+            if (c ~= Byte.Comma and c ~= closeByte) then
+                pos = pos - 1
+                fail(format("expected ',' or '%s'", string.char(closeByte)))
+            end
+        until (c == closeByte)
+    end
+
+    readValue = function()
+        local c = peek()
+
+        if (c == Byte.Quote) then
+            return readString()
+        elseif (c == Byte.LBracket) then
+            local array = {}
+            readSequence(Byte.RBracket, function()
+                array[#array + 1] = readValue()
+            end)
+            return array
+        elseif (c == Byte.LBrace) then
+            local object = {}
+            readSequence(Byte.RBrace, function()
+                local key = readString()
+                expect(Byte.Colon)
+                object[key] = readValue()
+            end)
+            return object
         end
 
-        if (type(cmd[key]) ~= expectedKeyType) then
-            return PREFIX.."contains an element with key '"..key..
-                "' missing or not of "..expectedKeyType.." type"
+        local word = str:match("^[%w%.%+%-]+", pos + 1)
+
+        if (word == "true" or word == "false" or word == "null") then
+            pos = pos + #word
+            return (word == "true") and true or (word == "false") and false or nil
+        elseif (word ~= nil and (c == Byte.Minus or (c ~= nil and c >= 48 and c <= 57))) then
+            local number = tonumber(word)
+            if (number == nil) then
+                fail("invalid number")
+            end
+            pos = pos + #word
+            return number
         end
 
-        if (cmd[expectedMissingKey] ~= nil) then
-            return PREFIX.."contains and element with key '"..expectedMissingKey..
-                "' unexpectedly present"
+        fail((c == nil) and "unexpected end of input" or "unexpected character")
+    end
+
+    expect(Byte.LBracket)
+
+    local index = 0
+    local isDone = (peek() == Byte.RBracket)
+
+    if (isDone) then
+        pos = pos + 1
+    end
+
+    return function()
+        if (isDone) then
+            if (peek() ~= nil) then
+                fail("trailing data after the top-level array")
+            end
+            return nil
         end
 
-        if (hasCommand and cmd.command:match("\\%s")) then
-            -- We will split the command by whitespace, so escaped whitespace characters
-            -- would throw us off the track. For now, bail out if we come across that case.
-            return PREFIX.."contains an element with key 'command' "..
-                "containing a backslash followed by whitespace (not implemented)"
+        local value = readValue()
+        local c = peek()
+        pos = pos + 1
+
+        if (c == Byte.RBracket) then
+            isDone = true
+        elseif (c ~= Byte.Comma) then
+            pos = pos - 1
+            fail("expected ',' or ']'")
         end
-    end
 
-    return nil, hasCommand
+        index = index + 1
+        return index, value
+    end
 end
 
--- If the entries have key 'command' (and thus do not have key 'args', since we validated
--- mutual exclusion), add key 'args'. Also make keys 'file' absolute file names by prefixing
--- them with key 'directory' whenever they are not already absolute.
-local function tweak_compile_commands_table(cmds, hasCommand)
-    assert(type(cmds) == "table")
+---------- Compile command validation ----------
 
-    if (hasCommand) then
-        for _, cmd in ipairs(cmds) do
-            local argv = util.splitAtWhitespace(cmd.command)
-            local arguments = {}
-
-            for i = 2,#argv do
-                -- Keep only the arguments, not the invoked compiler executable name.
-                assert(type(argv[i]) == "string")
-                arguments[i - 1] = argv[i]
+local PREFIX = "ERROR: Unexpected input: parsed result "
+
+-- <hasCommand>: whether the first entry has key 'command' (instead of 'arguments').
+local function validate_compile_command(cmd, hasCommand)
+    local key = hasCommand and "command" or "arguments"
+    local expectedKeyType = hasCommand and "string" or "table"
+    local expectedMissingKey = hasCommand and "arguments" or "command"
+
+    if (type(cmd) ~= "table") then
+        return PREFIX.."contains missing or non-table elements"
+    end
+
+    if (type(cmd.directory) ~= "string") then
+        return PREFIX.."contains an element with key 'directory' missing or not of string type"
+    end
+
+    if (type(cmd.file) ~= "string") then
+        return PREFIX.."contains an element with key 'file' missing or not of string type"
+    end
+
+    if (type(cmd[key]) ~= expectedKeyType) then
+        return PREFIX.."contains an element with key '"..key..
+            "' missing or not of "..expectedKeyType.." type"
+    end
+
+    if (cmd[expectedMissingKey] ~= nil) then
+        return PREFIX.."contains and element with key '"..expectedMissingKey..
+            "' unexpectedly present"
+    end
+
+    if (hasCommand and cmd.command:match("\\%s")) then
+        -- We will split the command by whitespace, so escaped whitespace characters
+        -- would throw us off the track. For now, bail out if we come across that case.
+        return PREFIX.."contains an element with key 'command' "..
+            "containing a backslash followed by whitespace (not implemented)"
+    end
+
+    if (not hasCommand) then
+        for _, arg in ipairs(cmd.arguments) do
+            if (type(arg) ~= "string") then
+                return PREFIX.."contains an element with key 'arguments' "..
+                    "containing a value not of string type"
             end
+        end
+    end
+end
 
-            cmd.arguments = arguments
-            cmd.compiler_executable = argv[1]
-            cmd.command = nil
+-- If the entry has key 'command' (and thus does not have key 'args', since we validated
+-- mutual exclusion), add key 'args'. Also make key 'file' an absolute file name by
+-- prefixing it with key 'directory' if it is not already absolute.
+local function tweak_compile_command(cmd, hasCommand)
+    if (hasCommand) then
+        local argv = util.splitAtWhitespace(cmd.command)
+        local arguments = {}
+
+        for i = 2,#argv do
+            -- Keep only the arguments, not the invoked compiler executable name.
+            assert(type(argv[i]) == "string")
+            arguments[i - 1] = argv[i]
         end
+
+        cmd.arguments = arguments
+        cmd.compiler_executable = argv[1]
+        cmd.command = nil
     else
-        for _, cmd in ipairs(cmds) do
-            local args = cmd.arguments
+        local args = cmd.arguments
 
-            cmd.compiler_executable = args[1]
+        cmd.compiler_executable = args[1]
 
-            for i = 1, #args do
-                -- Shift elements of 'args' one left.
-                args[i] = args[i+1]
-            end
+        for i = 1, #args do
+            -- Shift elements of 'args' one left.
+            args[i] = args[i+1]
         end
     end
 
-    for _, cmd in ipairs(cmds) do
-        -- The key 'file' as it appears in the compile_commands.json:
-        local compiledFileName = cmd.file
-        -- Absify it:
-        local absoluteFileName = compile_commands_util.absify(cmd.file, cmd.directory)
-        assert(type(absoluteFileName) == "string")
-        cmd.file = absoluteFileName
+    -- The key 'file' as it appears in the compile_commands.json:
+    local compiledFileName = cmd.file
+    -- Absify it:
+    local absoluteFileName = compile_commands_util.absify(cmd.file, cmd.directory)
+    assert(type(absoluteFileName) == "string")
+    cmd.file = absoluteFileName
 
-        -- And also absify it appearing in the argument list.
+    -- And also absify it appearing in the argument list.
 
-        local matchCount = 0
+    local matchCount = 0
 
-        for ai, arg in ipairs(cmd.arguments) do
-            if (arg == compiledFileName) then
-                cmd.arguments[ai] = absoluteFileName
-                matchCount = matchCount + 1
-            end
+    for ai, arg in ipairs(cmd.arguments) do
+        if (arg == compiledFileName) then
+            cmd.arguments[ai] = absoluteFileName
+            matchCount = matchCount + 1
         end
+    end
 
-        cmd.arguments, cmd.pchArguments =
-            compile_commands_util.sanitize_args(cmd.arguments, cmd.directory)
+    cmd.arguments, cmd.pchArguments =
+        compile_commands_util.sanitize_args(cmd.arguments, cmd.directory)
 
-        -- NOTE: "== 1" is overly strict. I'm just curious about the situation in the wild.
-        if (matchCount ~= 1) then
-            return nil, PREFIX.."contains an entry for which the name of "..
-                "the compiled file is not found exactly once in the compiler arguments"
-        end
+    -- NOTE: "== 1" is overly strict. I'm just curious about the situation in the wild.
+    if (matchCount ~= 1) then
+        return PREFIX.."contains an entry for which the name of "..
+            "the compiled file is not found exactly once in the compiler arguments"
+    end
 
-        for ai, arg in ipairs(cmd.arguments) do
-            if (arg == absoluteFileName) then
-                cmd.fileNameIdx = ai
-                break
-            end
+    for ai, arg in ipairs(cmd.arguments) do
+        if (arg == absoluteFileName) then
+            cmd.fileNameIdx = ai
+            break
         end
-
-        assert(cmd.fileNameIdx ~= nil)
     end
 
-    return cmds
+    assert(cmd.fileNameIdx ~= nil)
 end
 
-local function load_json_as_lua_string(str)
-    local func, errmsg = loadstring(str, "compile_commands.json as Lua table")
+-- Returns the sequence of compile commands, or nil and an error message.
+local function parse_compile_commands_string(str)
+    local cmds = {}
+    local hasCommand = nil
+
+    local ok, errmsg = pcall(function()
+        for i, cmd in iterateJsonArray(str) do
+            if (hasCommand == nil) then
+                hasCommand = (type(cmd) == "table" and cmd.arguments == nil and
+                                  cmd.command ~= nil)
+
+                if (type(cmd) == "table" and cmd.arguments == nil and cmd.command == nil) then
+                    return PREFIX.."is non-empty but its first element contains "..
+                        "neither key 'arguments' nor 'command'"
+                end
+            end
 
-    if (func == nil) then
-        return nil, errmsg
-    end
+            local cmdErrmsg = validate_compile_command(cmd, hasCommand) or
+                tweak_compile_command(cmd, hasCommand)
+            if (cmdErrmsg ~= nil) then
+                return cmdErrmsg
+            end
 
-    -- Completely empty the function's environment as an additional safety measure,
-    -- then run the chunk protected.
-    local ok, result = pcall(setfenv(func, {}))
-    if (not ok) then
-        assert(type(result) == "string")  -- error message
-        return nil, result
-    end
+            cmds[i] = cmd
+        end
+    end)
 
-    local errmsg, hasCommand = validate_compile_commands_table(result)
-    if (errmsg ~= nil) then
+    if (not ok or errmsg ~= nil) then
+        assert(type(errmsg) == "string")
         return nil, errmsg
     end
 
-    return tweak_compile_commands_table(result, hasCommand)
+    return cmds
 end
 
 -- Parses a compile_commands.json file, returning a Lua table.
@@ -229,8 +442,7 @@ function api.parse_compile_commands(compile_commands_string)
     check(type(compile_commands_string) == "string",
           "<compile_commands_string> must be a string", 2)
 
-    local str = tweak_json_string_for_load_as_lua_table(compile_commands_string)
-    return load_json_as_lua_string(str)
+    return parse_compile_commands_string(compile_commands_string)
 end
 
 function api.read_compile_commands(filename)
@@ -1,16 +1,20 @@
 local check = require("error_util").check
 local LangOptions = require("dev.PchRelevantLangOptions")
 
+local ffi = require("ffi")
 local io = require("io")
 local os = require("os")
 local math = require("math")
 local table = require("table")
 
+local posix = require("posix")
 local util = require("util")
 
 local assert = assert
 local ipairs = ipairs
+local next = next
 local pairs = pairs
+local pcall = pcall
 local tostring = tostring
 local type = type
 
@@ -262,16 +266,127 @@ end
 -- yields include errors on certain system includes. See
 -- http://clang.llvm.org/docs/LibTooling.html#builtin-includes
 
+-- Layout of the file persisting the results (all integers are uint32_t):
+--  "WCCI" <version> <modification time of the Clang binary> <entry count>
+--  <length of signature i> <length of include directories i> for each entry i
+--  <signature i> <include directories i, separated by '\0'> for each entry i
+local SysIncludesMagic, SysIncludesVersion = "WCCI", 1
+
+-- The results depend on the Clang binary, so keep one file per binary. Its modification
+-- time is stored in the file and compared on load, so that results of an earlier version
+-- of the binary installed at the same path are discarded.
+local function getSysIncludesFileName(clang, cacheDirectory)
+    -- Percent-encode '%' and '/' (and nothing else), which keeps the mapping injective.
+    local mangledName = clang:gsub("[%%/]", { ["%"] = "%25", ["/"] = "%2F" })
+    return cacheDirectory.."/sysincludes-"..mangledName..".bin"
+end
+
+-- Returns: [<signature>] = <sequence of include directories>, possibly empty.
+local function loadSysIncludes(fileName, clangMtime)
+    local results = {}
+
+    local f = io.open(fileName, "rb")
+    if (f == nil) then
+        return results
+    end
+
+    local data = f:read("*a")
+    f:close()
+
+    local parse = function()
+        check(data:sub(1, #SysIncludesMagic) == SysIncludesMagic, "wrong magic", 1)
+
+        local reader = util.BinaryReader(data:sub(#SysIncludesMagic + 1))
+        local header = reader:uint32s(3)
+
+        if (header[0] ~= SysIncludesVersion or header[1] ~= clangMtime) then
+            return
+        end
+
+        local entryCount = header[2]
+        local lengths = reader:uint32s(2 * entryCount)
+
+        for i = 0, 2 * entryCount - 1, 2 do
+            local signature = reader:string(lengths[i])
+            local dirsStr = reader:string(lengths[i + 1])
+            local includeDirs = {}
+
+            for includeDir in dirsStr:gmatch("[^%z]+") do
+                includeDirs[#includeDirs + 1] = includeDir
+            end
+
+            results[signature] = includeDirs
+        end
+
+        check(reader:isAtEnd(), "trailing data", 1)
+    end
+
+    if (not pcall(parse)) then
+        -- Treat an invalid file like a missing one. It is overwritten afterwards.
+        return {}
+    end
+
+    return results
+end
+
+-- Returns true on success, false otherwise.
+local function storeSysIncludes(fileName, clangMtime, results)
+    local signatures = {}
+    for signature, _ in pairs(results) do
+        signatures[#signatures + 1] = signature
+    end
+    table.sort(signatures)
+
+    local lengths, strings = {}, {}
+
+    for _, signature in ipairs(signatures) do
+        local dirsStr = table.concat(results[signature], '\0')
+        lengths[#lengths + 1] = #signature
+        lengths[#lengths + 1] = #dirsStr
+        strings[#strings + 1] = signature
+        strings[#strings + 1] = dirsStr
+    end
+
+    local header = { SysIncludesVersion, clangMtime, #signatures }
+    local data = SysIncludesMagic..util.packUint32s(header)..
+        util.packUint32s(lengths)..table.concat(strings)
+
+    -- NOTE: write to a temporary file first, so that concurrently running instances never
+    --  see a partially written file.
+    local tempFileName = fileName..".tmp"..tostring(ffi.C.getpid())
+    local f = io.open(tempFileName, "wb")
+
+    if (f == nil) then
+        return false
+    end
+
+    local ok = f:write(data)
+    ok = f:close() and ok
+
+    if (not ok or not os.rename(tempFileName, fileName)) then
+        os.remove(tempFileName)
+        return false
+    end
+
+    return true
+end
+
+-- Returns a function that blocks until the system include directories have been added to
+-- the compile command at the given index (or to all compile commands, if passed nil).
+-- Results from earlier invocations are taken from a file in <cacheDirectory>, so the
+-- respective compile commands are prepared immediately. For the others, Clang is run in
+-- the background with the given concurrency.
+--
+-- NOTE: the returned function must be called for each compile command before its
+--  arguments are used. Calling it with nil in the end stores the new results.
 function api.obtainSystemIncludes(clang, concurrency,
                                   compileCommands,  -- elements modified in-place
                                   cacheDirectory, F)
     local ccCount = #compileCommands
-    local localConcurrency = math.min(concurrency, ccCount)
 
     -- Second return value: argument list signature for caching results of computations on
     --  the argument list. Note that this caching only works as long as we do not process
-    --  the include dependencies. But, by the time we do, we hopefully have a way of running
-    --  this preparation concurrently with the main parsing loop.
+    --  the include dependencies.
     local getArgsAndSig = function(ccIdx)
         local cmd = compileCommands[ccIdx]
         local args = util.copySequence(cmd.arguments)
@@ -310,112 +425,183 @@ function api.obtainSystemIncludes(clang, concurrency,
         return args, ext..'\0\0'..table.concat(sigArgs, '\0')
     end
 
-    -- { [<index into compileCommands>] = Callable (blocks until process finishes) }
-    local futures = {}
-    -- { [<signature>] = false/true }
-    local seenSignature = {}
-    -- { [<signature>] = <string (output of clang command)> }
-    local resultForSignature = {}
+    -- Returns the sequence of include directories, or nil if they could not be determined.
+    local getIncludeDirs = function(output)
+        assert(type(output) == "string")
+
+        -- NOTE: this depends on the precise formatting of the '-v' output.
+        --  Further, we assume that the command line arguments are on the same line.
+        local _, endIdx = output:find(' "'..clang..'" -cc1 ', 1, true)
+
+        if (endIdx == nil) then
+            return nil
+        end
+
+        local includeDirs = {}
+        local cc1Line = output:sub(endIdx + 1):match("^([^\n]+)\n")
+
+        for includeDir in cc1Line:gmatch("-internal[-extrnc]*-isystem ([^ ]+)") do
+            includeDirs[#includeDirs + 1] = includeDir
+        end
+
+        return includeDirs
+    end
+
+    local sysIncludesFileName = getSysIncludesFileName(clang, cacheDirectory)
+    -- NOTE: if the binary cannot be stat()ed, nothing is persisted.
+    local clangMtime = posix.getModificationTime(clang)
+
+    -- { [<signature>] = <sequence of include directories> }
+    local resultForSignature = (clangMtime ~= nil) and
+        loadSysIncludes(sysIncludesFileName, clangMtime) or {}
+    -- { [<signature>] = true } for results that are to be persisted
+    local isNewSignature = {}
     -- { [<index into compileCommands>] = <signature> }
     local signatureForCcIdx = {}
+    -- { [<index into compileCommands>] = true }
+    local isPrepared = {}
+    local preparedCount = 0
+
+    -- Signatures without a result, in the order of their first compile command.
+    local pendingSigs, pendingHeadIdx = {}, 1
+    -- { [<signature>] = <index of its first compile command> }
+    local firstCcIdxForSig = {}
+    -- { [<signature>] = Callable (blocks until process finishes) }
+    local futures = {}
+    -- Signatures of spawned workers, in the order of their spawning.
+    local runningSigs = {}
 
-    local spawnWorker = function(ccIdx)
-        local args, signature = getArgsAndSig(ccIdx)
+    for ccIdx = 1, ccCount do
+        local _, signature = getArgsAndSig(ccIdx)
         signatureForCcIdx[ccIdx] = signature
 
-        if (seenSignature[signature] == nil) then
-            seenSignature[signature] = true
-            futures[ccIdx] = F.ExecuteAsync(clang, args)
-            return true
+        if (resultForSignature[signature] == nil and firstCcIdxForSig[signature] == nil) then
+            firstCcIdxForSig[signature] = ccIdx
+            pendingSigs[#pendingSigs + 1] = signature
         end
     end
 
-    local headCcIdx = 1
-    local workerCount = 0
-
     local spawnWorkers = function()
-        while (workerCount < concurrency and headCcIdx <= ccCount) do
-            if (spawnWorker(headCcIdx)) then
-                workerCount = workerCount + 1
-            end
-            headCcIdx = headCcIdx + 1
+        while (#runningSigs < concurrency and pendingHeadIdx <= #pendingSigs) do
+            local signature = pendingSigs[pendingHeadIdx]
+            local args = getArgsAndSig(firstCcIdxForSig[signature])
+            futures[signature] = F.ExecuteAsync(clang, args)
+            runningSigs[#runningSigs + 1] = signature
+            pendingHeadIdx = pendingHeadIdx + 1
         end
     end
 
-    local getResult = function(ccIdx)
-        local future = futures[ccIdx]
-        local ccSig = signatureForCcIdx[ccIdx]
+    local finishWorker = function(signature)
+        for i, sig in ipairs(runningSigs) do
+            if (sig == signature) then
+                table.remove(runningSigs, i)
+                break
+            end
+        end
 
-        assert((future ~= nil) == (resultForSignature[ccSig] == nil))
+        local result = futures[signature]()
+        futures[signature] = nil
 
-        if (future ~= nil) then
-            local result = future()
-            workerCount = workerCount - 1
+        local ccIdx = firstCcIdxForSig[signature]
 
-            if (result == nil) then
-                local argsStr = table.concat((getArgsAndSig(ccIdx)), ' ')
-                F.errorInfo("Failed running preparatory step for compile command #%d:\n%s %s",
-                          ccIdx, clang, argsStr)
-                F.errorInfo("Please make sure that the original compile command invocation succeeds.")
-                F.errorInfoAndExit("If the issue persists after that, please report it as a bug.")
-            end
+        if (result == nil) then
+            local argsStr = table.concat((getArgsAndSig(ccIdx)), ' ')
+            F.errorInfo("Failed running preparatory step for compile command #%d:\n%s %s",
+                        ccIdx, clang, argsStr)
+            F.errorInfo("Please make sure that the original compile command invocation succeeds.")
+            F.errorInfoAndExit("If the issue persists after that, please report it as a bug.")
+        end
 
-            -- Retain the requested concurrency.
-            spawnWorkers()
+        local includeDirs = getIncludeDirs(result)
 
-            -- Cache the result.
-            resultForSignature[ccSig] = result
+        if (includeDirs == nil) then
+            F.errorInfo("For command #%d (%s), did not find clang -cc1 invocation in '-v' output.",
+                        ccIdx, compileCommands[ccIdx].file:match("[^/]+$"))
+            -- NOTE: do not make this fatal. Just do not add the implicit include paths,
+            -- likely leading to errors down the road. Also, do not persist that.
+            includeDirs = {}
+        else
+            isNewSignature[signature] = true
         end
 
-        return resultForSignature[ccSig]
+        resultForSignature[signature] = includeDirs
+
+        -- Retain the requested concurrency.
+        spawnWorkers()
     end
 
-    local handleWorkerOutput = function(output, finishedCcIdx)
-        assert(type(output) == "string")
+    local prepare = function(ccIdx)
+        if (isPrepared[ccIdx]) then
+            return
+        end
 
-        local cmd = compileCommands[finishedCcIdx]
-
-        do
-            -- NOTE: this depends on the precise formatting of the '-v' output.
-            --  Further, we assume that the command line arguments are on the same line.
-            local _, endIdx = output:find(' "'..clang..'" -cc1 ', 1, true)
-
-            if (endIdx == nil) then
-                F.errorInfo("For command #%d (%s), did not find clang -cc1 invocation in '-v' output.",
-                            finishedCcIdx, cmd.file:match("[^/]+$"))
-                -- NOTE: do not make this fatal. Just do not add the implicit include paths,
-                -- likely leading to errors down the road.
-            else
-                local ccArgs = cmd.arguments
-                local cc1Line = output:sub(endIdx + 1):match("^([^\n]+)\n")
-
-                for includeDir in cc1Line:gmatch("-internal[-extrnc]*-isystem ([^ ]+)") do
-                    -- NOTE: we get 'unknown argument' if we pass '-internal-...'.
-                    ccArgs[#ccArgs + 1] = "-isystem"
-                    ccArgs[#ccArgs + 1] = includeDir
+        local signature = signatureForCcIdx[ccIdx]
+
+        while (resultForSignature[signature] == nil) do
+            -- Handle children in a FIFO fashion, unless the requested one is running.
+            finishWorker((futures[signature] ~= nil) and signature or runningSigs[1])
+        end
+
+        local ccArgs = compileCommands[ccIdx].arguments
+
+        for _, includeDir in ipairs(resultForSignature[signature]) do
+            -- NOTE: we get 'unknown argument' if we pass '-internal-...'.
+            ccArgs[#ccArgs + 1] = "-isystem"
+            ccArgs[#ccArgs + 1] = includeDir
+        end
+
+        isPrepared[ccIdx] = true
+        preparedCount = preparedCount + 1
+    end
+
+    local haveStored = false
+
+    local prepareAll = function()
+        local startTime = os.time()
+
+        for ccIdx = 1, ccCount do
+            prepare(ccIdx)
+        end
+
+        if (not haveStored and clangMtime ~= nil and next(isNewSignature) ~= nil) then
+            local toStore = {}
+            for signature, includeDirs in pairs(resultForSignature) do
+                if (isNewSignature[signature] or firstCcIdxForSig[signature] == nil) then
+                    toStore[signature] = includeDirs
                 end
             end
+
+            storeSysIncludes(sysIncludesFileName, clangMtime, toStore)
+        end
+
+        haveStored = true
+
+        local prepTime = os.difftime(os.time(), startTime)
+
+        if (prepTime >= 2) then
+            F.info("Prepared compile commands in %d seconds.", prepTime)
         end
     end
 
     ----
 
-    local startTime = os.time()
-
     -- Initial batch.
     spawnWorkers()
 
-    -- Handle children in a FIFO fashion.
-    -- TODO: if necessary (which seems unlikely), handle in a poll() way.
+    -- Attach the results known from the start.
     for ccIdx = 1, ccCount do
-        local result = getResult(ccIdx)
-        handleWorkerOutput(result, ccIdx)
+        if (resultForSignature[signatureForCcIdx[ccIdx]] ~= nil) then
+            prepare(ccIdx)
+        end
     end
 
-    local prepTime = os.difftime(os.time(), startTime)
-
-    if (prepTime >= 2) then
-        F.info("Prepared compile commands in %d seconds.", prepTime)
+    return function(ccIdx)
+        if (ccIdx == nil) then
+            prepareAll()
+        else
+            assert(ccIdx >= 1 and ccIdx <= ccCount)
+            prepare(ccIdx)
+        end
     end
 end
 
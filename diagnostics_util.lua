@@ -6,11 +6,13 @@ local format = string.format
 
 local assert = assert
 local ipairs = ipairs
+local select = select
 local type = type
 local unpack = unpack
 
 local class = require("class").class
 local error_util = require("error_util")
+local util = require("util")
 
 local check = error_util.check
 local checktype = error_util.checktype
@@ -35,97 +37,225 @@ local ColorizeErrorFunc = GetColorizeTripleFunc(Col.Red, true)
 local ColorizeWarningFunc = GetColorizeTripleFunc(Col.Purple, true)
 local ColorizeNoteFunc = GetColorizeTripleFunc(Col.Black, false)
 
-local ColorSubstitutions = {
-    { "(.*)(fatal error: )(.*)", ColorizeErrorFunc },
-    { "(.*)(error: )(.*)", ColorizeErrorFunc },
-    { "(.*)(warning: )(.*)", ColorizeWarningFunc },
-    { "(.*)(note: )(.*)", ColorizeNoteFunc },
-}
-
 -----===== Diagnostic formatting =====-----
 
 local function getIndented(indentation, str)
     return format("%s%s", string.rep(" ", indentation), str)
 end
 
+-- KEEPINSYNC with 'clang.DiagnosticSeverity'.
+local SeverityCodes = { ignored=0, note=1, warning=2, error=3, fatal=4 }
+local SeverityNames = { [0]="ignored", "note", "warning", "error", "fatal" }
+
+-- As output by clang_formatDiagnostic().
+local SeverityTexts = {
+    ignored="ignored", note="note", warning="warning", error="error", fatal="fatal error"
+}
+
+local SeverityColorizeFuncs = {
+    note=ColorizeNoteFunc, warning=ColorizeWarningFunc,
+    error=ColorizeErrorFunc, fatal=ColorizeErrorFunc,
+}
+
+-- Kinds of the entries that a formatted diagnostic is made up of. Each entry makes up one
+-- line when the diagnostic is formatted.
+local EntryKind = {
+    -- A line of text, given verbatim.
+    Text = 0,
+    -- A diagnostic. The line is formatted like clang_formatDiagnostic() does with the default
+    -- display options, with the category appended (only with zero indentation).
+    Diag = 1,
+    -- An "in file included from" diagnostic that precedes another one. Disregarded for the
+    -- purpose of detecting repeated diagnostics.
+    IncludedFrom = 2,
+}
+
+-- An entry is a table with the following members:
+--  kind, indentation, text: always present. For Diag and IncludedFrom, <text> is the
+--   spelling of the diagnostic.
+--  severity, fileName, line, column, option, category, fixIts: with Diag, each optional.
+--   <fixIts> is as returned by the Diagnostic:fixIts() of ljclang.
+local function FormatEntry(entry, useColors)
+    local kind = entry.kind
+
+    if (kind == EntryKind.Text) then
+        return getIndented(entry.indentation, entry.text)
+    elseif (kind == EntryKind.IncludedFrom) then
+        return getIndented(entry.indentation, "In"..entry.text:sub(3))
+    end
+
+    local location = (entry.fileName ~= nil) and
+        format("%s:%d:%d: ", entry.fileName, entry.line, entry.column) or ""
+    local tag = SeverityTexts[entry.severity]..": "
+    local message = entry.text..((entry.option ~= nil) and " ["..entry.option.."]" or "")
+    local colorizeFunc = useColors and SeverityColorizeFuncs[entry.severity] or nil
+
+    local text = (colorizeFunc ~= nil) and colorizeFunc(location, tag, message) or
+        location..tag..message
+    local category = (entry.category ~= nil) and " ["..entry.category.."]" or ""
+
+    return getIndented(entry.indentation, text..category)
+end
+
+-- A diagnostic together with its child diagnostics, kept in structured form. Its text is
+-- only formatted when requested.
 local FormattedDiag = class
 {
     function(useColors, severity)
         checktype(useColors, 1, "boolean", 2)
         checktype(severity, 2, "string", 2)
 
-        -- self: sequence table of lines constituting the diagnostic
         return {
             usingColors = useColors,
             severity = severity,
+            entries = {},  -- sequence of entries (see FormatEntry())
         }
     end,
 
     addIndentedLine = function(self, indentation, str)
-        self[#self + 1] = getIndented(indentation, str)
+        self:addEntry_{ kind=EntryKind.Text, indentation=indentation, text=str }
     end,
 
     getSeverity = function(self)
         return self.severity
     end,
 
+    -- Returns a sequence of the fix-its of all diagnostics making up this one.
+    getFixIts = function(self)
+        local fixIts = {}
+
+        for _, entry in ipairs(self.entries) do
+            for _, fixIt in ipairs(entry.fixIts or {}) do
+                fixIts[#fixIts + 1] = fixIt
+            end
+        end
+
+        return fixIts
+    end,
+
+    -- Returns a string that is equal for two formatted diagnostics if and only if they are
+    -- equal disregarding "in file included from" lines, so that a diagnostic in a header is
+    -- considered the same irrespective of how the header was included.
+    getKey = function(self)
+        local parts = {}
+
+        for _, e in ipairs(self.entries) do
+            if (e.kind ~= EntryKind.IncludedFrom) then
+                parts[#parts + 1] = table.concat({
+                    e.kind, e.indentation, e.text, e.severity or "", e.fileName or "",
+                    e.line or 0, e.column or 0, e.option or "", e.category or ""
+                }, '\0')
+            end
+        end
+
+        return table.concat(parts, '\1')
+    end,
+
     getString = function(self, keepColorsIfPresent)
         checktype(keepColorsIfPresent, 1, "boolean", 2)
 
-        local str = table.concat(self, '\n')
+        local lines = {}
+
+        for i, entry in ipairs(self.entries) do
+            lines[i] = FormatEntry(entry, self.usingColors)
+        end
+
+        local str = table.concat(lines, '\n')
 
         return
             (not self.usingColors) and str or
             keepColorsIfPresent and Col.colorize(str) or
             Col.strip(str)
     end,
-}
 
--- Special separation characters that are disjoint with our encoding of color codes.
--- (See terminal_colors.lua)
-local Sep = {
-    Diag = {
-        Value = '\0',
-        Pattern = '%z',
-    },
-    -- Octet values that cannot be part of a well-formed UTF-8-encoded string.
-    -- (See ISO/IEC 10646:2017 section 9.2)
-    Line = '\xFE',
-    EmptyInfo = '\xFD',
+-- private:
+    addEntry_ = function(self, entry)
+        self.entries[#self.entries + 1] = entry
+    end,
 }
 
-local SpecialCharsPattern = "[%z\xFE\xFD]"
 local DiagInfoSeverity = "ignored"
 
-local function patternFor(sep)
-    return "([^"..sep.."]+)"..sep
-end
+-- Binary serialization layout (all integers are uint32_t):
+--  <record count> <entry count> <fix-it count> <string count>
+--   <whether the last record is the info>
+--  <severity code> <entry count> for each record
+--  <kind> <indentation> <severity code> <text id> <file name id> <line> <column>
+--   <option id> <category id> <fix-it count> for each entry of all records
+--  <replacement id> <file name id> <start line> <start column> <end line> <end column>
+--   for each fix-it of all entries
+--  <length of string i> for each string i
+--  <concatenated strings>
+-- Each distinct string is stored once. A string id is its index in the sequence of strings,
+-- or zero for an absent member.
+local EntryFieldCount = 10
+local FixItFieldCount = 6
 
 local function FormattedDiagSet_Serialize(self)
-    local tab = {}
+    local records, entryFields, fixItFields = {}, {}, {}
+    local strings, stringIds = {}, {}
 
-    for _, diag in ipairs(self.diags) do
-        local innerTab = { diag.severity }
+    local getId = function(str)
+        if (str == nil) then
+            return 0
+        end
+
+        local id = stringIds[str]
+
+        if (id == nil) then
+            id = #strings + 1
+            strings[id] = str
+            stringIds[str] = id
+        end
+
+        return id
+    end
 
-        for _, line in ipairs(diag) do
-            assert(not line:find(SpecialCharsPattern))
-            innerTab[#innerTab + 1] = line
+    local append = function(tab, ...)
+        for i = 1, select('#', ...) do
+            tab[#tab + 1] = select(i, ...)
         end
+    end
+
+    local addRecord = function(diag)
+        append(records, SeverityCodes[diag.severity], #diag.entries)
 
-        tab[#tab + 1] = table.concat(innerTab, Sep.Line)..Sep.Line
+        for _, e in ipairs(diag.entries) do
+            local fixIts = e.fixIts or {}
+
+            append(entryFields, e.kind, e.indentation, SeverityCodes[e.severity or "ignored"],
+                   getId(e.text), getId(e.fileName), e.line or 0, e.column or 0,
+                   getId(e.option), getId(e.category), #fixIts)
+
+            for _, f in ipairs(fixIts) do
+                append(fixItFields, getId(f.replacement), getId(f.fileName),
+                       f.startLine or 0, f.startColumn or 0, f.endLine or 0, f.endColumn or 0)
+            end
+        end
     end
 
-    local L = Sep.Line
-    local info = self.info ~= nil and self.info[1] or Sep.EmptyInfo
+    for _, diag in ipairs(self.diags) do
+        addRecord(diag)
+    end
 
     if (self.info ~= nil) then
-        assert(#self.info == 1)
-        assert(not self.info[1]:find(SpecialCharsPattern))
+        assert(#self.info.entries == 1)
+        addRecord(self.info)
     end
 
-    tab[#tab + 1] = DiagInfoSeverity..Sep.Line..info..Sep.Line
+    local stringLengths = {}
+    for i, str in ipairs(strings) do
+        stringLengths[i] = #str
+    end
 
-    return table.concat(tab, Sep.Diag.Value)..Sep.Diag.Value
+    local header = {
+        #records / 2, #entryFields / EntryFieldCount, #fixItFields / FixItFieldCount,
+        #strings, (self.info ~= nil) and 1 or 0
+    }
+
+    return util.packUint32s(header)..util.packUint32s(records)..
+        util.packUint32s(entryFields)..util.packUint32s(fixItFields)..
+        util.packUint32s(stringLengths)..table.concat(strings)
 end
 
 local FormattedDiagSet  -- "forward-declare"
@@ -135,32 +265,94 @@ function api.FormattedDiagSet_Deserialize(diagsStr, useColors)
     checktype(diagsStr, 1, "string", 2)
     checktype(useColors, 2, "boolean", 2)
 
-    local fDiagSet = FormattedDiagSet(useColors)
+    local reader = util.BinaryReader(diagsStr)
+    local header = reader:uint32s(5)
+    local recordCount, entryCount, fixItCount, stringCount =
+        header[0], header[1], header[2], header[3]
+    local haveInfo = (header[4] ~= 0)
 
-    for diagStr in diagsStr:gmatch(patternFor(Sep.Diag.Pattern)) do
-        local fDiag
-        for line in diagStr:gmatch(patternFor(Sep.Line)) do
-            if (fDiag == nil) then
-                fDiag = FormattedDiag(useColors, line)
-            else
-                fDiag[#fDiag + 1] = line
-            end
-        end
-        assert(fDiag ~= nil)
-        fDiagSet.diags[#fDiagSet.diags + 1] = fDiag
+    local records = reader:uint32s(2 * recordCount)
+    local entryFields = reader:uint32s(EntryFieldCount * entryCount)
+    local fixItFields = reader:uint32s(FixItFieldCount * fixItCount)
+    local stringLengths = reader:uint32s(stringCount)
+
+    local strings = {}
+    for i = 1, stringCount do
+        strings[i] = reader:string(stringLengths[i - 1])
+    end
+
+    check(reader:isAtEnd(), InvalidStringMsg, 2)
+    check(not haveInfo or recordCount >= 1, InvalidStringMsg, 2)
+
+    local getString = function(id)
+        -- NOTE: an invalid id yields nil, which is caught for the mandatory members below.
+        return (id ~= 0) and strings[id] or nil
     end
 
-    local lastDiag = fDiagSet.diags[#fDiagSet.diags]
-    fDiagSet.info = (lastDiag[1] ~= Sep.EmptyInfo) and lastDiag or nil
-    fDiagSet.diags[#fDiagSet.diags] = nil
+    local nonzero = function(number)
+        return (number ~= 0) and number or nil
+    end
 
-    if (fDiagSet.info ~= nil) then
-        local good = (#fDiagSet.info == 1 and not fDiagSet.info[1]:find(Sep.EmptyInfo))
-        check(good, InvalidStringMsg..", or INTERNAL ERROR", 2)
-    else
-        -- TODO: also have a check?
+    local fDiagSet = FormattedDiagSet(useColors)
+    local entryIdx, fixItIdx = 0, 0
+
+    for i = 0, recordCount - 1 do
+        local severity = SeverityNames[records[2*i]]
+        local recordEntryCount = records[2*i + 1]
+        check(severity ~= nil and entryIdx + recordEntryCount <= entryCount,
+              InvalidStringMsg, 2)
+
+        local fDiag = FormattedDiag(useColors, severity)
+
+        for _ = 1, recordEntryCount do
+            local f = entryFields + EntryFieldCount * entryIdx
+            local kind, entryFixItCount = f[0], f[9]
+            local entry = {
+                kind = kind, indentation = f[1], text = getString(f[3]),
+            }
+
+            check((kind == EntryKind.Text or kind == EntryKind.Diag or
+                       kind == EntryKind.IncludedFrom) and entry.text ~= nil and
+                      fixItIdx + entryFixItCount <= fixItCount, InvalidStringMsg, 2)
+
+            if (kind == EntryKind.Diag) then
+                entry.severity = SeverityNames[f[2]]
+                entry.fileName = getString(f[4])
+                entry.line, entry.column = nonzero(f[5]), nonzero(f[6])
+                entry.option, entry.category = getString(f[7]), getString(f[8])
+                check(entry.severity ~= nil, InvalidStringMsg, 2)
+
+                if (entryFixItCount > 0) then
+                    local fixIts = {}
+
+                    for j = 1, entryFixItCount do
+                        local x = fixItFields + FixItFieldCount * fixItIdx
+                        fixIts[j] = {
+                            replacement = getString(x[0]) or "", fileName = getString(x[1]),
+                            startLine = x[2], startColumn = x[3],
+                            endLine = x[4], endColumn = x[5],
+                        }
+                        fixItIdx = fixItIdx + 1
+                    end
+
+                    entry.fixIts = fixIts
+                end
+            end
+
+            fDiag:addEntry_(entry)
+            entryIdx = entryIdx + 1
+        end
+
+        if (haveInfo and i == recordCount - 1) then
+            check(severity == DiagInfoSeverity and recordEntryCount == 1, InvalidStringMsg, 2)
+            fDiagSet.info = fDiag
+        else
+            fDiagSet.diags[#fDiagSet.diags + 1] = fDiag
+        end
     end
 
+    check(entryIdx == entryCount and fixItIdx == fixItCount, InvalidStringMsg, 2)
+
     return fDiagSet
 end
 
@@ -218,39 +410,34 @@ FormattedDiagSet = class
     serialize = FormattedDiagSet_Serialize,
 }
 
-local function FormatDiagnostic(diag, useColors, indentation,
-                                --[[out--]] fDiag)
-    local text = diag:format()
-    local printCategory = (indentation == 0)
-
-    if (useColors) then
-        for i = 1, #ColorSubstitutions do
-            local matchCount
-            local subst = ColorSubstitutions[i]
-            text, matchCount = text:gsub(subst[1], subst[2])
-
-            if (matchCount > 0) then
-                break
-            end
-        end
-    end
-
+local function AddDiagEntry(diag, indentation,
+                            --[[out--]] fDiag)
+    local fileName, line, column = diag:spellingLocation()
+    local option = diag:option()
     local category = diag:category()
-
-    local textWithMaybeCategory =
-        text .. ((printCategory and #category > 0) and " ["..category.."]" or "")
-    fDiag:addIndentedLine(indentation, textWithMaybeCategory)
+    local fixIts = diag:fixIts()
+
+    fDiag:addEntry_{
+        kind = EntryKind.Diag,
+        indentation = indentation,
+        text = diag:spelling(),
+        severity = diag:severity(),
+        fileName = fileName, line = line, column = column,
+        option = (#option > 0) and option or nil,
+        category = (indentation == 0 and #category > 0) and category or nil,
+        fixIts = (#fixIts > 0) and fixIts or nil,
+    }
 end
 
 -----
 
-local function PrintPrefixDiagnostics(diags, indentation,
-                                      --[[out--]] fDiag)
+local function AddPrefixDiagnostics(diags, indentation,
+                                    --[[out--]] fDiag)
     for i = 1, #diags do
         local text = diags[i]:spelling()
 
         if (text:match("^in file included from ")) then
-            fDiag:addIndentedLine(indentation, "In"..text:sub(3))
+            fDiag:addEntry_{ kind=EntryKind.IncludedFrom, indentation=indentation, text=text }
         else
             return i
         end
@@ -278,11 +465,11 @@ local function PrintDiagsImpl(diags, useColors, allDiags,
 
         local childDiags = diag:childDiagnostics()
 
-        local innerStartIndex = PrintPrefixDiagnostics(childDiags, indentation, fDiag)
-        FormatDiagnostic(diag, useColors, indentation, fDiag)
+        local innerStartIndex = AddPrefixDiagnostics(childDiags, indentation, fDiag)
+        AddDiagEntry(diag, indentation, fDiag)
 
         -- Recurse. We expect only at most two levels in total (but do not check for that).
-        PrintDiagsImpl(diag:childDiagnostics(), useColors, allDiags,
+        PrintDiagsImpl(childDiags, useColors, allDiags,
                        innerStartIndex, indentation + 2, fDiag)
 
         local isFatal = (diag:severity() == "fatal")
@@ -24,6 +24,7 @@ local print = print
 local setfenv = setfenv
 local tonumber = tonumber
 local type = type
+local unpack = unpack
 
 local format = string.format
 
@@ -91,6 +92,15 @@ Options:
        Example:
          "return f('%s = %s%s,', k, k:find('KEY_') and '65536+' or '', v)"
        Incompatible with -C, -R or -f.
+  -i <file2.h> [-i <file3.h>] ...: further input files, each parsed as a separate
+     translation unit with the same Clang command line args. Their output follows the one
+     for <file.h>, in the order given. A declaration reached from more than one input file
+     (for example, one in a commonly included system header) is output only once.
+     Incompatible with -R.
+  -j <jobs>: number of worker processes parsing the input files in parallel. (Default: 1)
+  -k <directory>: cache the parsed translation units in <directory>. A cached translation
+     unit is loaded instead of parsing the input file again as long as none of the files
+     it was made from has been modified since.
   -Q: be quiet
   -w: extract what? Can be
        E+M, EnumConstantDecl (default), MacroDefinition, TypedefDecl, FunctionDecl
@@ -120,7 +130,7 @@ local parsecmdline = require("parsecmdline_pk")
 
 -- Meta-information about options, see parsecmdline_pk.
 local opt_meta = { e=true, p=1, A=1, x=1, s=true, C=false, R=false, Q=false,
-                   ['1']=true, ['2']=true, w=true, f=true, m=true, a=1 }
+                   ['1']=true, ['2']=true, w=true, f=true, m=true, a=1, i=1, j=true, k=true }
 
 local opts, args = parsecmdline.getopts(opt_meta, arg, usage)
 
@@ -137,6 +147,9 @@ local what = opts.w or "EnumConstantDecl"
 local fmtfuncCode = opts.f
 local moduleName = opts.m
 local moduleArgs = opts.a
+local inputFileNames = { args[1], unpack(opts.i) }
+local jobCount = tonumber(opts.j or "1")
+local astCacheDirectory = opts.k
 
 local extractEnum = (moduleName == nil and what == "EnumConstantDecl" or what == EnumOrMacro)
 local extractMacro = (what:find("^Macro") or what == EnumOrMacro)
@@ -148,10 +161,13 @@ if (#args == 0) then
     usage()
 elseif (not IsValidWhat[what]) then
     usage("Invalid argument to '-w'.")
+elseif (jobCount == nil or jobCount < 1 or jobCount ~= math.floor(jobCount)) then
+    usage("Argument to '-j' must be a positive integral number.")
 end
 
 -- Late load to allow printing the help text with a plain invocation.
 local cl = require("ljclang")
+local ast_cache = require("ast_cache")
 
 if (IsMakingApp) then
     -- KEEPINSYNC: make sure that there are no require() calls below us!
@@ -166,6 +182,10 @@ if (not (extractEnum or extractMacro) and (printConstInt or reverse)) then
     usage("Options -C and -R only available for enum or macro extraction.")
 end
 
+if (reverse and #inputFileNames > 1) then
+    usage("Option -R is incompatible with -i.")
+end
+
 local fmtfunc
 local moduleFunc
 
@@ -173,13 +193,20 @@ local matchCount = 0
 local filterPatternMatchCount = {}
 local currentFilterPatternIdx
 
-local function printfMatch(fmt, ...)
-    printf(fmt, ...)
-    matchCount = matchCount + 1
+-- In a worker process (see RunWorker()): sequence of the matches of its input file, each
+-- being { <cursor key>, <filter pattern index or 0>, <printed line> }.
+local workerMatches
+local currentCursor
 
-    local fpi = currentFilterPatternIdx
-    -- NOTE: this assumes that modules will not print at load time:
-    assert((fpi ~= nil) == (#filterPatterns > 0))
+-- Returns a string identifying the declaration of <cur> across translation units, or the
+-- empty string if it has no location.
+local function getCursorKey(cur)
+    local fileName, offset = cur:location('offset')
+    return (fileName ~= nil) and format("%s:%d", fileName, offset) or ""
+end
+
+local function countMatch(fpi)
+    matchCount = matchCount + 1
 
     if (fpi ~= nil) then
         assert(fpi <= #filterPatterns)
@@ -188,6 +215,21 @@ local function printfMatch(fmt, ...)
     end
 end
 
+local function printfMatch(fmt, ...)
+    local fpi = currentFilterPatternIdx
+    -- NOTE: this assumes that modules will not print at load time:
+    assert((fpi ~= nil) == (#filterPatterns > 0))
+
+    if (workerMatches ~= nil) then
+        workerMatches[#workerMatches + 1] = {
+            getCursorKey(currentCursor), fpi or 0, format(fmt, ...)
+        }
+    else
+        printf(fmt, ...)
+        countMatch(fpi)
+    end
+end
+
 if (fmtfuncCode and moduleName) then
     usage("Options -f and -m are mutually exclusive.")
 elseif (fmtfuncCode) then
@@ -245,8 +287,7 @@ end
 
 local tuOptions = (extractMacro or moduleFunc) and {"DetailedPreprocessingRecord"} or nil
 
-local filename = args[1]
-do
+for _, filename in ipairs(inputFileNames) do
     local f, msg = io.open(filename)
     if (f == nil) then
         errprintf("ERROR: Failed opening %s", msg)
@@ -262,25 +303,43 @@ end
 hacks.addSystemInclude(args, "c")
 
 local index = cl.createIndex(true, false)
-local tu, errorCode = index:parse("", args, tuOptions)
+local astCache = (astCacheDirectory ~= nil) and ast_cache.ASTCache(astCacheDirectory) or nil
+
+-- Parses <filename> with the Clang command line args given to us (in place of <file.h>),
+-- or loads it from the AST cache (-k).
+-- Passes each of its diagnostics to <writeDiag>, unless we are quiet.
+-- Returns the translation unit and whether there were errors.
+local function parseInput(filename, writeDiag)
+    args[1] = filename
+    local tu, errorCode, diags
+
+    if (astCache ~= nil) then
+        tu, errorCode, diags = astCache:parse(index, "", args, tuOptions)
+    else
+        tu, errorCode = index:parse("", args, tuOptions)
+    end
 
-if (tu == nil) then
-    errprintf("ERROR: Failed parsing %s (%s)", filename, errorCode)
-    os.exit(1)
-end
+    if (tu == nil) then
+        errprintf("ERROR: Failed parsing %s (%s)", filename, errorCode)
+        os.exit(1)
+    end
 
-local haveErrors = false
+    local haveErrors = false
 
-if (not quiet) then
-    local diags = tu:diagnosticSet()
+    if (not quiet) then
+        -- NOTE: a translation unit loaded from the AST cache has lost its diagnostics, so
+        --  take them from the cache.
+        diags = diags or ast_cache.GetDiags(tu)
 
-    for i=1,#diags do
-        local d = diags[i]
-        local severity = d:severity()
-        haveErrors = haveErrors or (severity == "error" or severity == "fatal")
+        for _, diag in ipairs(diags) do
+            local severity = diag[1]
+            haveErrors = haveErrors or (severity == "error" or severity == "fatal")
 
-        io.stderr:write(d:format().."\n")
+            writeDiag(diag[2].."\n")
+        end
     end
+
+    return tu, haveErrors
 end
 
 -- Mapping of enum value to its name for -R.
@@ -345,92 +404,315 @@ local function matchesFilterPattern(name)
     return false
 end
 
-local visitor = cl.regCursorVisitor(
-function(cur, parent)
-    if (extractEnum) then
-        if (cur:haskind("EnumDecl")) then
-            if (enumNameFilterPattern ~= nil and not cur:name():find(enumNameFilterPattern)) then
-                return 'CXChildVisit_Continue'
+-- Handle a cursor of the kind <kind>, which is "*anything*" with -m.
+local function handleCursor(cur, kind)
+    local isUserDefined = (moduleFunc ~= nil)
+    currentCursor = cur
+
+    local name = cur:displayName()
+
+    if (#filterPatterns == 0 or matchesFilterPattern(name)) then
+        if (not checkexclude(name)) then
+            local ourname = stripPattern and name:gsub(stripPattern, "") or name
+
+            if (isUserDefined) then
+                moduleFunc(cur, moduleArgs)
+            elseif (extractEnum or extractMacro) then
+                local isEnum = (kind == "EnumConstantDecl")
+                local val = isEnum and cur:enumval() or getDefStr(cur)
+
+                -- Notes:
+                --  - tonumber(val) == nil can only happen with #defines that are not
+                --    like a literal number.
+                --  - We only use tonumber() for the check here. To convert, we output
+                --    the token as it appears in the source code. This way, numbers
+                --    written in octal are correctly preserved.
+                if (isEnum or tonumber(val) ~= nil) then
+                    if (fmtfunc) then
+                        local str = fmtfunc(ourname, val,
+                                            currentEnumName,
+                                            currentEnumIntTypeName,
+                                            currentEnumPrefixLength)
+                        printfMatch("%s", str)
+                    elseif (reverse) then
+                        if (enumname[val]) then
+                            printf("Error: enumeration value %d not unique: %s and %s",
+                                   val, enumname[val], ourname)
+                            os.exit(2)
+                        end
+                        enumname[val] = ourname
+                        enumseq[#enumseq+1] = val
+                    elseif (printConstInt) then
+                        printfMatch("static const int %s = %s;", ourname, val)
+                    else
+                        printfMatch("%s = %s,", ourname, val)
+                    end
+                end
+            elseif (what=="FunctionDecl") then
+                -- Function declaration
+                local rettype = cur:resultType()
+                if (not checkexclude(rettype:name())) then
+                    printfMatch("%s %s;", rettype, ourname)
+                end
+            elseif (what=="TypedefDecl") then
+                -- Type definition
+                local utype = cur:typedefType()
+                if (not checkexclude(utype:name())) then
+                    printfMatch("typedef %s %s;", utype, ourname)
+                end
             else
-                currentEnumName = cur:name()
-                currentEnumIntTypeName = cur:enumIntegerType():name()
-                currentEnumPrefixLength = getCommonPrefixLengthOfEnums(cur)
-                return 'CXChildVisit_Recurse'
+                -- Anything else
+                printfMatch("%s", ourname)
             end
         end
     end
+end
 
-    local isUserDefined = (moduleFunc ~= nil)
-    local kind = isUserDefined and "*anything*" or wantedCursorKind(cur)
-
-    if (kind ~= nil) then
-        local name = cur:displayName()
-
-        if (#filterPatterns == 0 or matchesFilterPattern(name)) then
-            if (not checkexclude(name)) then
-                local ourname = stripPattern and name:gsub(stripPattern, "") or name
-
-                if (isUserDefined) then
-                    moduleFunc(cur, moduleArgs)
-                elseif (extractEnum or extractMacro) then
-                    local isEnum = (kind == "EnumConstantDecl")
-                    local val = isEnum and cur:enumval() or getDefStr(cur)
-
-                    -- Notes:
-                    --  - tonumber(val) == nil can only happen with #defines that are not
-                    --    like a literal number.
-                    --  - We only use tonumber() for the check here. To convert, we output
-                    --    the token as it appears in the source code. This way, numbers
-                    --    written in octal are correctly preserved.
-                    if (isEnum or tonumber(val) ~= nil) then
-                        if (fmtfunc) then
-                            local str = fmtfunc(ourname, val,
-                                                currentEnumName,
-                                                currentEnumIntTypeName,
-                                                currentEnumPrefixLength)
-                            printfMatch("%s", str)
-                        elseif (reverse) then
-                            if (enumname[val]) then
-                                printf("Error: enumeration value %d not unique: %s and %s",
-                                       val, enumname[val], ourname)
-                                os.exit(2)
-                            end
-                            enumname[val] = ourname
-                            enumseq[#enumseq+1] = val
-                        elseif (printConstInt) then
-                            printfMatch("static const int %s = %s;", ourname, val)
-                        else
-                            printfMatch("%s = %s,", ourname, val)
-                        end
-                    end
-                elseif (what=="FunctionDecl") then
-                    -- Function declaration
-                    local rettype = cur:resultType()
-                    if (not checkexclude(rettype:name())) then
-                        printfMatch("%s %s;", rettype, ourname)
-                    end
-                elseif (what=="TypedefDecl") then
-                    -- Type definition
-                    local utype = cur:typedefType()
-                    if (not checkexclude(utype:name())) then
-                        printfMatch("typedef %s %s;", utype, ourname)
-                    end
-                else
-                    -- Anything else
-                    printfMatch("%s", ourname)
+local function getWantedKinds()
+    local kinds = (what == EnumOrMacro) and { "EnumConstantDecl", "MacroDefinition" } or { what }
+    if (extractEnum) then
+        kinds[#kinds + 1] = "EnumDecl"
+    end
+    return kinds
+end
+
+-- Handle the direct children of the translation unit cursor that have a wanted kind and,
+-- when extracting enums, the enum constants of the top-level enums passing the -e filter.
+--
+-- NOTE: the kind and depth filtering happens on the C side, so that the vast majority of
+-- cursors (e.g. those making up function bodies) are never seen from Lua.
+local function handleTopLevelCursors(tuCursor)
+    local candidates = tuCursor:find(getWantedKinds(), nil, extractEnum and 2 or 1)
+    -- Set of indexes into 'candidates' of the enums whose constants we want.
+    local isSelectedEnumIdx = {}
+
+    for i = 0, #candidates - 1 do
+        local cur = candidates.cursors[i]
+
+        if (candidates.depths[i] == 1) then
+            if (extractEnum and cur:haskind("EnumDecl")) then
+                if (enumNameFilterPattern == nil or cur:name():find(enumNameFilterPattern)) then
+                    currentEnumName = cur:name()
+                    currentEnumIntTypeName = cur:enumIntegerType():name()
+                    currentEnumPrefixLength = getCommonPrefixLengthOfEnums(cur)
+                    isSelectedEnumIdx[i] = true
                 end
+            else
+                handleCursor(cur, wantedCursorKind(cur))
             end
+        elseif (isSelectedEnumIdx[candidates.parentIndexes[i]]) then
+            handleCursor(cur, wantedCursorKind(cur))
         end
     end
+end
 
-    return isUserDefined and 'CXChildVisit_Recurse' or 'CXChildVisit_Continue'
+-- With -m, the user-provided function is passed every cursor of the translation unit.
+local moduleVisitor = cl.regCursorVisitor(
+function(cur, parent)
+    handleCursor(cur, "*anything*")
+    return 'CXChildVisit_Recurse'
 end)
 
-if (prefixString) then
-    print(prefixString)
+local function extractFrom(tu)
+    if (moduleFunc ~= nil) then
+        tu:cursor():children(moduleVisitor)
+    else
+        handleTopLevelCursors(tu:cursor())
+    end
+end
+
+---------- Parallel extraction (option -i) ----------
+
+-- NOTE: posix.lua cannot be used here since it depends on declarations extracted by us.
+ffi.cdef[[
+int fork(void);
+int pipe(int pipefd[2]);
+ptrdiff_t read(int fd, void *buf, size_t count);
+ptrdiff_t write(int fd, const void *buf, size_t count);
+int close(int fd);
+int waitpid(int pid, int *wstatus, int options);
+void _exit(int status);
+]]
+
+local C = ffi.C
+
+-- Layout (all integers are uint32_t):
+--  <have errors?> <diags length> <match count>
+--  <key length i> <line length i> <filter pattern index i> for each match i
+--  <diags> <concatenated key and line of each match>
+local function serializeResults(haveErrors, diagsStr, matches)
+    local records, strings = {}, { diagsStr }
+
+    for _, match in ipairs(matches) do
+        records[#records + 1] = #match[1]
+        records[#records + 1] = #match[3]
+        records[#records + 1] = match[2]
+        strings[#strings + 1] = match[1]
+        strings[#strings + 1] = match[3]
+    end
+
+    return util.packUint32s({ haveErrors and 1 or 0, #diagsStr, #matches })..
+        util.packUint32s(records)..table.concat(strings)
 end
 
-tu:cursor():children(visitor)
+local function deserializeResults(data)
+    local reader = util.BinaryReader(data)
+    local header = reader:uint32s(3)
+    local count = header[2]
+    local records = reader:uint32s(3 * count)
+    local diagsStr = reader:string(header[1])
+    local matches = {}
+
+    for i = 0, 3 * count - 1, 3 do
+        local key = reader:string(records[i])
+        matches[#matches + 1] = { key, records[i + 2], reader:string(records[i + 1]) }
+    end
+
+    assert(reader:isAtEnd())
+    return (header[0] ~= 0), diagsStr, matches
+end
+
+local function writeAll(fd, data)
+    local ptr = ffi.cast("const char *", data)
+    local pos = 0
+
+    while (pos < #data) do
+        local written = tonumber(C.write(fd, ptr + pos, #data - pos))
+        if (written <= 0) then
+            return false
+        end
+        pos = pos + written
+    end
+
+    return true
+end
+
+local function readAll(fd)
+    local BufSize = 65536
+    local buf = ffi.new("char [?]", BufSize)
+    local parts = {}
+
+    while (true) do
+        local bytesRead = tonumber(C.read(fd, buf, BufSize))
+        assert(bytesRead >= 0, "failed reading from worker process")
+        if (bytesRead == 0) then
+            return table.concat(parts)
+        end
+        parts[#parts + 1] = ffi.string(buf, bytesRead)
+    end
+end
+
+-- Forks a worker process that extracts from the input file <filename>. Returns a function
+-- that blocks until the worker has finished and returns its results like
+-- deserializeResults().
+local function RunWorker(filename)
+    local fds = ffi.new("int [2]")
+    assert(C.pipe(fds) == 0, "failed creating pipe")
+
+    -- Do not have buffered output appear twice.
+    io.stdout:flush()
+    io.stderr:flush()
+
+    local pid = C.fork()
+    assert(pid >= 0, "failed forking worker process")
+
+    if (pid == 0) then
+        C.close(fds[0])
+
+        local diagStrings = {}
+        workerMatches = {}
+
+        local tu, haveErrors = parseInput(filename, function(str)
+            diagStrings[#diagStrings + 1] = str
+        end)
+        extractFrom(tu)
+
+        local data = serializeResults(haveErrors, table.concat(diagStrings), workerMatches)
+        C._exit(writeAll(fds[1], data) and 0 or 1)
+    end
+
+    C.close(fds[1])
+
+    return function()
+        local data = readAll(fds[0])
+        C.close(fds[0])
+
+        local status = ffi.new("int [1]")
+        assert(C.waitpid(pid, status, 0) == pid)
+
+        if (status[0] ~= 0) then
+            -- NOTE: the worker has reported the error itself.
+            os.exit(1)
+        end
+
+        return deserializeResults(data)
+    end
+end
+
+-- Extracts from each input file in a worker process, running up to <jobCount> of them at
+-- a time. The results are output in the order of the input files, so that the output does
+-- not depend on the number of jobs. A declaration already output for a previous input file
+-- is skipped. Returns whether there were errors.
+local function RunWorkers()
+    local waitFuncs = {}
+    local nextIdx = 1
+    local haveErrors = false
+    -- Set of keys (see getCursorKey()) of the declarations output for previous input files.
+    local isKeyOutput = {}
+
+    for i = 1, #inputFileNames do
+        while (nextIdx <= #inputFileNames and nextIdx - i < jobCount) do
+            waitFuncs[nextIdx] = RunWorker(inputFileNames[nextIdx])
+            nextIdx = nextIdx + 1
+        end
+
+        local inputHasErrors, diagsStr, matches = waitFuncs[i]()
+        waitFuncs[i] = nil
+        haveErrors = haveErrors or inputHasErrors
+        io.stderr:write(diagsStr)
+
+        local newKeys = {}
+
+        for _, match in ipairs(matches) do
+            local key, fpi, line = match[1], match[2], match[3]
+
+            if (key == "" or not isKeyOutput[key]) then
+                print(line)
+                countMatch((fpi ~= 0) and fpi or nil)
+                newKeys[#newKeys + 1] = key
+            end
+        end
+
+        for _, key in ipairs(newKeys) do
+            isKeyOutput[key] = true
+        end
+    end
+
+    return haveErrors
+end
+
+----------
+
+local haveErrors
+
+if (#inputFileNames == 1) then
+    local tu
+    tu, haveErrors = parseInput(inputFileNames[1], function(str)
+        io.stderr:write(str)
+    end)
+
+    if (prefixString) then
+        print(prefixString)
+    end
+
+    extractFrom(tu)
+else
+    if (prefixString) then
+        print(prefixString)
+    end
+
+    haveErrors = RunWorkers()
+end
 
 if (reverse) then
     for i=1,#enumseq do
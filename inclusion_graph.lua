@@ -1,6 +1,9 @@
+local bit = require("bit")
+local ffi = require("ffi")
 
 local error_util = require("error_util")
 local class = require("class").class
+local util = require("util")
 local math = require("math")
 local string = require("string")
 local table = require("table")
@@ -10,6 +13,7 @@ local checktype = error_util.checktype
 
 local assert = assert
 local ipairs = ipairs
+local type = type
 
 ----------
 
@@ -89,52 +93,350 @@ end
 
 -- Public API
 
-local function SerializeGraph(self)
-    local tab = {}
+-- Binary serialization layout (all integers are uint32_t):
+--  <kind> <file count> <edge count>
+--  if <kind> is SerializedNames:
+--   <length of file name i> for each file i
+--  if <kind> is SerializedIds:
+--   <id of file i in the passed SharedStringTable> for each file i
+--  <index of file a> <index of file b> for each edge a -> b (with zero-based indexes)
+--  if <kind> is SerializedNames:
+--   <concatenated file names>
+local SerializedNames, SerializedIds = 0, 1
+
+-- Returns the sequence of ids of the graph's file names, or nil if <stringTable> is full.
+local function getFileIds(self, stringTable)
+    local fileIds = {}
+
+    for i, filename in self:iFileNames() do
+        local id = stringTable:intern(filename)
+        if (id == nil) then
+            return nil
+        end
+        fileIds[i] = id
+    end
+
+    return fileIds
+end
+
+local function SerializeGraph(self, stringTable)
+    local fileIds = (stringTable ~= nil) and getFileIds(self, stringTable) or nil
+    local indexOf = {}
+    local header = { fileIds and SerializedIds or SerializedNames, self:getNodeCount(), 0 }
+    local edges = {}
+    local fileNames = {}
+
+    for i, filename in self:iFileNames() do
+        indexOf[filename] = i - 1
+        header[#header + 1] = fileIds and fileIds[i] or #filename
+        fileNames[i] = filename
+    end
 
     for _, filename in self:iFileNames() do
         for _, otherFileName in self:getNode(filename):iEdges() do
-            -- TODO: could store 'filename' only once and have a count of edges.
-
-            assert(not (filename:find('%z') or otherFileName:find('%z')))
-            tab[#tab + 1] = filename..'\0'..otherFileName
+            edges[#edges + 1] = indexOf[filename]
+            edges[#edges + 1] = indexOf[otherFileName]
         end
     end
 
-    return table.concat(tab, '\0\0')..'\0\0'
+    header[3] = #edges / 2
+
+    return util.packUint32s(header)..util.packUint32s(edges)..
+        (fileIds and "" or table.concat(fileNames))
 end
 
 local InclusionGraph  -- "forward-declare"
 local InvalidStringMsg = "passed string that is not a graph serialization"
 
-api.Deserialize = function(graphStr)
+-- <stringTable>: the SharedStringTable passed to serialize(), if any.
+api.Deserialize = function(graphStr, stringTable)
     checktype(graphStr, 1, "string", 2)
-    check(#graphStr >= 2, "argument #1 must have length of at least two")
-    check(graphStr:sub(-2) == "\0\0", InvalidStringMsg, 2)
+
+    local reader = util.BinaryReader(graphStr)
+    local kind = reader:uint32()
+    check(kind == SerializedNames or kind == SerializedIds, InvalidStringMsg, 2)
+    check(kind == SerializedNames or stringTable ~= nil,
+          "must pass the string table for a graph serialized with it", 2)
+
+    local fileCount = reader:uint32()
+    local edgeCount = reader:uint32()
+    local nameLengthsOrIds = reader:uint32s(fileCount)
+    local edges = reader:uint32s(2 * edgeCount)
+
+    local fileNames = {}
+    for i = 0, fileCount - 1 do
+        fileNames[i] = (kind == SerializedIds) and
+            stringTable:getString(nameLengthsOrIds[i]) or
+            reader:string(nameLengthsOrIds[i])
+    end
+
+    check(reader:isAtEnd(), InvalidStringMsg, 2)
 
     local graph = InclusionGraph()
 
-    for filename, otherFileName in graphStr:gmatch("([^%z]+)%z([^%z]+)") do
+    for i = 0, 2 * edgeCount - 1, 2 do
+        local filename, otherFileName = fileNames[edges[i]], fileNames[edges[i + 1]]
+        check(filename ~= nil and otherFileName ~= nil, InvalidStringMsg, 2)
         graph:addInclusion(filename, otherFileName)
     end
 
-    local totalEdgeCount = 0
-    local doubleZeroCount = 0
+    return graph
+end
+
+local uint32_array_t = ffi.typeof("uint32_t [?]")
+
+-- Read-only counterpart of Node for a FrozenInclusionGraph.
+local FrozenNode = class
+{
+    function(graph, nodeIdx)
+        return {
+            graph = graph,
+            nodeIdx = nodeIdx,
+        }
+    end,
+
+    getKey = function(self)
+        return self.graph:getFileName_(self.nodeIdx)
+    end,
+
+    getEdgeCount = function(self)
+        local edgeStart = self.graph.edgeStart
+        return edgeStart[self.nodeIdx + 1] - edgeStart[self.nodeIdx]
+    end,
+
+    iEdges = function(self)
+        local graph = self.graph
+        local startIdx = graph.edgeStart[self.nodeIdx]
+        local edgeCount = self:getEdgeCount()
+
+        return function(_, i)
+            if (i < edgeCount) then
+                return i + 1, graph:getFileName_(graph.edgeTargets[startIdx + i])
+            end
+        end, nil, 0
+    end,
+}
+
+-- An immutable inclusion graph in compressed sparse row form, with files identified by
+-- their id in a SharedStringTable. The edges from the node with zero-based index i point
+-- to the nodes edgeTargets[edgeStart[i]], ..., edgeTargets[edgeStart[i + 1] - 1].
+--
+-- Provides the read-only part of the InclusionGraph interface.
+local FrozenInclusionGraph = class
+{
+    function(stringTable, nodeCount, fileIds, edgeStart, edgeTargets)
+        return {
+            stringTable = stringTable,
+            nodeCount = nodeCount,
+            fileIds = fileIds,  -- uint32_t [nodeCount]
+            edgeStart = edgeStart,  -- uint32_t [nodeCount + 1]
+            edgeTargets = edgeTargets,  -- uint32_t [<edge count>]
+
+            -- [<file id>] = <node index>, created on demand.
+            nodeIdxOfId_ = nil,
+        }
+    end,
+
+    getNodeCount = function(self)
+        return self.nodeCount
+    end,
+
+    getNode = function(self, filename)
+        checktype(filename, 1, "string", 2)
 
-    for _, filename in graph:iFileNames() do
-        totalEdgeCount = totalEdgeCount + graph:getNode(filename):getEdgeCount()
+        local id = self.stringTable:getId(filename)
+        local nodeIdx = (id ~= nil) and self:getNodeIdxOfId_()[id] or nil
+        return (nodeIdx ~= nil) and FrozenNode(self, nodeIdx) or nil
+    end,
+
+    iFileIds = function(self)
+        local fileIds, nodeCount = self.fileIds, self.nodeCount
+
+        return function(_, i)
+            if (i < nodeCount) then
+                return i + 1, fileIds[i]
+            end
+        end, nil, 0
+    end,
+
+    iFileNames = function(self)
+        local nodeCount = self.nodeCount
+
+        return function(_, i)
+            if (i < nodeCount) then
+                return i + 1, self:getFileName_(i)
+            end
+        end, nil, 0
+    end,
+
+    -- Same as InclusionGraph:serialize().
+    serialize = SerializeGraph,
+
+-- private:
+    getFileName_ = function(self, nodeIdx)
+        return self.stringTable:getString(self.fileIds[nodeIdx])
+    end,
+
+    getNodeIdxOfId_ = function(self)
+        if (self.nodeIdxOfId_ == nil) then
+            local nodeIdxOfId = {}
+            for i = 0, self.nodeCount - 1 do
+                nodeIdxOfId[self.fileIds[i]] = i
+            end
+            self.nodeIdxOfId_ = nodeIdxOfId
+        end
+
+        return self.nodeIdxOfId_
+    end,
+}
+
+-- Like Deserialize(), but creates a FrozenInclusionGraph. File names serialized as such
+-- are added to <stringTable>.
+--
+-- <idTable>: optional; the table that the ids of a graph serialized with ids refer to, if
+--  it is not <stringTable>. The file names are then added to <stringTable>, too.
+api.DeserializeFrozen = function(graphStr, stringTable, idTable)
+    checktype(graphStr, 1, "string", 2)
+    checktype(stringTable, 2, "table", 2)
+    check(idTable == nil or type(idTable) == "table", "argument #3 must be nil or a table", 2)
+
+    if (idTable == stringTable) then
+        idTable = nil
     end
 
-    for _ in graphStr:gmatch("%z%z") do
-        doubleZeroCount = doubleZeroCount + 1
+    local reader = util.BinaryReader(graphStr)
+    local kind = reader:uint32()
+    check(kind == SerializedNames or kind == SerializedIds, InvalidStringMsg, 2)
+
+    local fileCount = reader:uint32()
+    local edgeCount = reader:uint32()
+    local nameLengthsOrIds = reader:uint32s(fileCount)
+    local edges = reader:uint32s(2 * edgeCount)
+
+    local fileIds = uint32_array_t(fileCount)
+    for i = 0, fileCount - 1 do
+        if (kind == SerializedIds and idTable == nil) then
+            fileIds[i] = nameLengthsOrIds[i]
+        else
+            local id = stringTable:intern((kind == SerializedIds) and
+                                          idTable:getString(nameLengthsOrIds[i]) or
+                                          reader:string(nameLengthsOrIds[i]))
+            check(id ~= nil, "string table is full", 2)
+            fileIds[i] = id
+        end
     end
 
-    check(totalEdgeCount == doubleZeroCount - ((totalEdgeCount == 0) and 1 or 0),
-          InvalidStringMsg..", or INTERNAL ERROR", 2)
+    check(reader:isAtEnd(), InvalidStringMsg, 2)
 
-    return graph
+    -- Sort the edges by their source node (counting sort).
+    local edgeStart = uint32_array_t(fileCount + 1)
+    for i = 0, 2 * edgeCount - 1, 2 do
+        check(edges[i] < fileCount and edges[i + 1] < fileCount, InvalidStringMsg, 2)
+        edgeStart[edges[i] + 1] = edgeStart[edges[i] + 1] + 1
+    end
+    for i = 1, fileCount do
+        edgeStart[i] = edgeStart[i] + edgeStart[i - 1]
+    end
+
+    local edgeTargets = uint32_array_t(edgeCount)
+    local fillIdx = uint32_array_t(fileCount + 1)
+    ffi.copy(fillIdx, edgeStart, ffi.sizeof(fillIdx))
+
+    for i = 0, 2 * edgeCount - 1, 2 do
+        local a = edges[i]
+        edgeTargets[fillIdx[a]] = edges[i + 1]
+        fillIdx[a] = fillIdx[a] + 1
+    end
+
+    return FrozenInclusionGraph(stringTable, fileCount, fileIds, edgeStart, edgeTargets)
 end
 
+-- For each file, the set of compile commands whose FrozenInclusionGraph contains it, kept
+-- as a bitset (bit <ccIdx - 1>) indexed by file id. Updated one compile command at a time
+-- with setGraph().
+api.ReverseDependencyIndex = class
+{
+    function(ccCount)
+        checktype(ccCount, 1, "number", 2)
+
+        return {
+            ccCount = ccCount,
+            wordCount = math.ceil(ccCount / 32),
+            -- [<file id>] = uint32_t [wordCount]
+            bitsets = {},
+            -- [<ccIdx>] = FrozenInclusionGraph
+            graphs = {},
+        }
+    end,
+
+    -- Replaces the graph of compile command <ccIdx> (if any) with <graph>, which may be
+    -- nil.
+    setGraph = function(self, ccIdx, graph)
+        checktype(ccIdx, 1, "number", 2)
+        check(ccIdx >= 1 and ccIdx <= self.ccCount,
+              "argument #1 must be a valid compile command index", 2)
+        check(graph == nil or type(graph) == "table",
+              "argument #2 must be nil or a FrozenInclusionGraph", 2)
+
+        local wordIdx = math.floor((ccIdx - 1) / 32)
+        local mask = bit.lshift(1, (ccIdx - 1) % 32)
+        local oldGraph = self.graphs[ccIdx]
+
+        if (oldGraph ~= nil) then
+            for _, id in oldGraph:iFileIds() do
+                local bitset = self.bitsets[id]
+                bitset[wordIdx] = bit.band(bitset[wordIdx], bit.bnot(mask))
+            end
+        end
+
+        if (graph ~= nil) then
+            for _, id in graph:iFileIds() do
+                local bitset = self.bitsets[id]
+                if (bitset == nil) then
+                    bitset = uint32_array_t(self.wordCount)
+                    self.bitsets[id] = bitset
+                end
+                bitset[wordIdx] = bit.bor(bitset[wordIdx], mask)
+            end
+        end
+
+        self.graphs[ccIdx] = graph
+    end,
+
+    -- Returns the ascending sequence of the indexes of the compile commands whose graph
+    -- contains any of the files with ids in the sequence <fileIds>.
+    getCcIdxs = function(self, fileIds)
+        checktype(fileIds, 1, "table", 2)
+
+        local wordCount = self.wordCount
+        local words = uint32_array_t(wordCount)
+
+        for _, id in ipairs(fileIds) do
+            local bitset = self.bitsets[id]
+            if (bitset ~= nil) then
+                for w = 0, wordCount - 1 do
+                    words[w] = bit.bor(words[w], bitset[w])
+                end
+            end
+        end
+
+        local ccIdxs = {}
+
+        for w = 0, wordCount - 1 do
+            local word = words[w]
+            if (word ~= 0) then
+                for b = 0, 31 do
+                    if (bit.band(word, bit.lshift(1, b)) ~= 0) then
+                        ccIdxs[#ccIdxs + 1] = 32*w + b + 1
+                    end
+                end
+            end
+        end
+
+        return ccIdxs
+    end,
+}
+
 InclusionGraph = class
 {
     function()
@@ -178,6 +480,8 @@ InclusionGraph = class
         end
     end,
 
+    -- <stringTable>: optional SharedStringTable. If passed, file names are serialized as
+    --  their ids in it (unless it is full).
     serialize = SerializeGraph,
 
     printAsGraphvizDot = function(self, title, reverse, commonPrefix, edgeCountLimit, printf)
@@ -83,6 +83,13 @@ api.init = class
         return wd
     end,
 
+    -- Returns whether there are events to be read, waiting up to <timeoutMs> milliseconds
+    -- for one to arrive.
+    hasEvents = function(self, timeoutMs)
+        check(type(timeoutMs) == "number", "<timeoutMs> must be a number", 2)
+        return (#posix.poll({ events=posix.POLL.IN, self:getRawFd() }, timeoutMs) > 0)
+    end,
+
     waitForEvents = function(self)
         local events, bytesRead = self.fd:readInto(EventBatch(), true)
         assert(bytesRead % sizeof_inotify_event_t == 0)
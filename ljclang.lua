@@ -6,6 +6,7 @@
 
 local assert = assert
 local error = error
+local ipairs = ipairs
 local pairs = pairs
 local require = require
 local select = select
@@ -21,6 +22,7 @@ local C = ffi.C
 
 local bit = require("bit")
 local io = require("io")
+local math = require("math")
 
 local function lib(basename)
     return (ffi.os=="Windows" and "lib" or "")..basename
@@ -94,6 +96,23 @@ ffi.cdef[[
 int ljclang_visitChildrenWith(CXCursor parent, LJCX_CursorVisitor visitor);
 ]]
 
+ffi.cdef([[
+typedef struct {
+    $ *cursors;
+    int *parentIndexes;
+    int *depths;
+    int count;
+    int capacity;
+} LJCX_CursorArray;
+
+int ljclang_findCursors(CXCursor root,
+                        const unsigned char *kindBitmap, unsigned kindBitmapSize,
+                        const char *name, int maxDepth, LJCX_CursorArray *array);
+int ljclang_collectChildren(CXCursor parent, LJCX_CursorArray *array,
+                            const unsigned char *kindBitmap, unsigned kindBitmapSize);
+void ljclang_freeCursorArray(LJCX_CursorArray *array);
+]], Cursor_t)
+
 -------------------------------------------------------------------------
 -------------------------------- CXString -------------------------------
 -------------------------------------------------------------------------
@@ -114,6 +133,50 @@ function api.clangVersion()
     return getString(clang.clang_getClangVersion())
 end
 
+---------- String memoization (see TranslationUnit_t:memoizeStrings()) ----------
+
+-- [<address of a CXTranslationUnit>] = { [<what>] = { [<key>] = <string> } }
+local StringMemos = {}
+-- Number of entries in 'StringMemos', so that the common case of no memoization is cheap.
+local StringMemoCount = 0
+
+local uintptr_t = ffi.typeof("uintptr_t")
+local const_uint8_ptr_t = ffi.typeof("const uint8_t *")
+
+local function getAddress(ptr)
+    return tonumber(ffi.cast(uintptr_t, ptr))
+end
+
+local function newStringMemo()
+    return { name = {}, displayName = {}, USR = {}, realPathName = {} }
+end
+
+-- Returns the table memoizing strings of the kind <what> for the translation unit <cxtu>, or
+-- nil if there is none.
+local function getStringMemo(cxtu, what)
+    if (StringMemoCount == 0 or cxtu == nil) then
+        return nil
+    end
+
+    local memo = StringMemos[getAddress(cxtu)]
+    return (memo ~= nil) and memo[what] or nil
+end
+
+-- Returns getString(<getCXString>(<obj>)), memoized for <key> in <memo> if it is non-nil.
+local function getMemoizedString(memo, key, getCXString, obj)
+    local str = (memo ~= nil) and memo[key] or nil
+
+    if (str == nil) then
+        str = getString(getCXString(obj))
+
+        if (memo ~= nil and str ~= nil) then
+            memo[key] = str
+        end
+    end
+
+    return str
+end
+
 do
     local libclangLLVMVersion = api.clangVersion()
     if (not libclangLLVMVersion:find(supportLLVMVersion, 1, true)) then
@@ -291,6 +354,12 @@ CXIdxObjectWrapper = class
             return (value ~= 0)
         elseif (type(value) == "number") then
             return value
+        elseif (key == "file") then
+            -- CXFile member of CXIdxIncludedFileInfo or CXIdxImportedASTFileInfo.
+            -- NOTE: dummy parent, like for 'enteredMainFile': there is no translation
+            --  unit, so only the name-related methods of the File can be used. (Passing
+            --  'self' would make them look up members of the C struct.)
+            return (value ~= nil) and File(value, {}) or nil
         end
 
         -- Try members of struct type.
@@ -554,7 +623,8 @@ local SL = {
         local cxfilear = SingleCXFileArray()
         local lco = LineColOfs()
         clangFunction(self._loc, cxfilear, lco.ar, lco.ar+1, lco.ar+2)
-        return File(cxfilear[0], self), lco
+        -- NOTE: there is no file for locations in e.g. the predefines buffer.
+        return (cxfilear[0] ~= nil) and File(cxfilear[0], self) or nil, lco
     end,
 
     getSiteOnlyLineCol = function(self, clangFunction)
@@ -656,6 +726,22 @@ local SeverityEnumToString = {
     [tonumber(C.CXDiagnostic_Fatal)] = "fatal",
 }
 
+local SingleCXSourceRangeArray = ffi.typeof("CXSourceRange [1]")
+
+-- Returns the file name, line and column of the spelling location <cxsrcloc>, or nil if it
+-- has no file.
+local function getSpellingLocation(cxsrcloc)
+    local cxfilear = SingleCXFileArray()
+    local lco = LineColOfs()
+    clang.clang_getSpellingLocation(cxsrcloc, cxfilear, lco.ar, lco.ar+1, lco.ar+2)
+
+    if (cxfilear[0] == nil) then
+        return nil
+    end
+
+    return getString(clang.clang_getFileName(cxfilear[0])), lco.line, lco.column
+end
+
 function api.defaultDiagnosticDisplayOptions()
     return clang.clang_defaultDiagnosticDisplayOptions()
 end
@@ -713,8 +799,39 @@ local Diagnostic = class
         return getString(clang.clang_getDiagnosticCategoryText(self._diag))
     end,
 
+    -- Returns the name of the file, the line and the column of the spelling location of the
+    -- diagnostic (as used by format()), or nil if it has no file.
+    spellingLocation = function(self)
+        local cxsrcloc = clang.clang_getDiagnosticLocation(self._diag)
+        return getSpellingLocation(cxsrcloc)
+    end,
+
+    -- Returns a sequence of the fix-its of the diagnostic, each a table with members
+    -- 'replacement' (the text to replace the range with), 'fileName', 'startLine',
+    -- 'startColumn', 'endLine' and 'endColumn' (the latter two past the end of the range).
+    fixIts = function(self)
+        local fixIts = {}
+        local cxsrcrange = SingleCXSourceRangeArray()
+
+        for i = 1, clang.clang_getDiagnosticNumFixIts(self._diag) do
+            local cxstr = clang.clang_getDiagnosticFixIt(self._diag, i-1, cxsrcrange)
+            local fileName, startLine, startColumn = getSpellingLocation(
+                clang.clang_getRangeStart(cxsrcrange[0]))
+            local _, endLine, endColumn = getSpellingLocation(
+                clang.clang_getRangeEnd(cxsrcrange[0]))
+
+            fixIts[i] = {
+                replacement = getString(cxstr),
+                fileName = fileName,
+                startLine = startLine, startColumn = startColumn,
+                endLine = endLine, endColumn = endColumn,
+            }
+        end
+
+        return fixIts
+    end,
+
     -- TODO: ranges()?
-    -- TODO: fixIts()?
 }
 
 -------------------------------------------------------------------------
@@ -789,7 +906,10 @@ File = class
     end,
 
     realPathName = function(self)
-        return getString(clang.clang_File_tryGetRealPathName(self._cxfile))
+        -- NOTE: the parent may also be a SourceLocation, in which case there is no memo.
+        local memo = getStringMemo(self._parent._tu, "realPathName")
+        local key = (memo ~= nil) and getAddress(self._cxfile) or nil
+        return getMemoizedString(memo, key, clang.clang_File_tryGetRealPathName, self._cxfile)
     end,
 
     time = function(self)
@@ -857,9 +977,42 @@ TranslationUnit_t = class
         return {
             _tu = ffi.gc(cxtu, needsDisposal and clang.clang_disposeTranslationUnit or nil),
             _parent = parent,
+            _needsDisposal = needsDisposal,
         }
     end,
 
+    -- #### `translationUnit:memoizeStrings()`
+    --
+    -- Makes `cursor:name()`, `cursor:displayName()` and `cursor:USR()` for cursors of
+    -- the translation unit, as well as `file:realPathName()` for files obtained from
+    -- it, remember their results. Repeated queries for the same cursor (as identified
+    -- by its raw `CXCursor` data) or file then no longer go through libclang. This is
+    -- worthwhile for tools that query the same cursors or files many times.
+    --
+    -- The memoized strings are discarded when the translation unit is reparsed and
+    -- when it is garbage-collected. Returns the translation unit itself.
+    memoizeStrings = function(self)
+        check_tu_valid(self)
+        check(self._needsDisposal, "<self> must be an owning translation unit", 2)
+
+        local address = getAddress(self._tu)
+
+        if (StringMemos[address] == nil) then
+            StringMemos[address] = newStringMemo()
+            StringMemoCount = StringMemoCount + 1
+
+            -- NOTE: the memo must go away no later than the CXTranslationUnit, since a
+            --  later one may be allocated at the same address.
+            ffi.gc(self._tu, function(cxtu)
+                StringMemos[address] = nil
+                StringMemoCount = StringMemoCount - 1
+                clang.clang_disposeTranslationUnit(cxtu)
+            end)
+        end
+
+        return self
+    end,
+
     save = function(self, filename)
         check_tu_valid(self)
         check(type(filename) == "string", "<filename> must be a string", 2)
@@ -869,6 +1022,34 @@ TranslationUnit_t = class
         return res
     end,
 
+    -- Reparse the translation unit with the current contents of the files on disk, using
+    -- clang_defaultReparseOptions(). If the translation unit was parsed with the option
+    -- "PrecompiledPreamble", the preamble is reused if it is still valid.
+    --
+    -- Returns the translation unit itself on success. On failure, returns nil and an error
+    -- code (comparable against values in 'clang.ErrorCode'). In that case, libclang only
+    -- permits disposal, so the translation unit must not be used any more.
+    reparse = function(self)
+        check_tu_valid(self)
+
+        local cxtu = self._tu
+        local errorCode = clang.clang_reparseTranslationUnit(
+            cxtu, 0, nil, clang.clang_defaultReparseOptions(cxtu))
+
+        local address = getAddress(cxtu)
+        if (StringMemos[address] ~= nil) then
+            -- The cursors and files that the memoized strings are keyed by are invalid now.
+            StringMemos[address] = newStringMemo()
+        end
+
+        if (errorCode ~= 0) then
+            self._tu = nil
+            return nil, errorCode
+        end
+
+        return self, errorCode
+    end,
+
     cursor = function(self)
         check_tu_valid(self)
         local cxcur = clang.clang_getTranslationUnitCursor(self._tu)
@@ -984,6 +1165,17 @@ api.regCursorVisitor = wrapCursorVisitor
 
 local Cursor_ptr_t = ffi.typeof("$ *", Cursor_t)
 
+-- Returns the string obtained by passing the CXCursor of <cur> to <getCXString>, memoized
+-- with kind <what> if its translation unit has memoizeStrings() enabled.
+local function getCursorString(cur, what, getCXString)
+    -- NOTE: the third data pointer of a CXCursor is its translation unit (see
+    --  cxcursor::getCursorTU() in the libclang sources).
+    local memo = getStringMemo(cur._cur.data[2], what)
+    local key = (memo ~= nil) and
+        ffi.string(ffi.cast(const_uint8_ptr_t, cur), ffi.sizeof(CXCursor)) or nil
+    return getMemoizedString(memo, key, getCXString, cur._cur)
+end
+
 -- #### `permanentCursor = clang.Cursor(cursor)`
 --
 -- Creates a permanent cursor from one received by the visitor callback.
@@ -1002,6 +1194,63 @@ function(cur)
     return 'CXChildVisit_Continue'
 end)
 
+local CursorArray_t = class
+{
+    ffi.typeof("LJCX_CursorArray"),
+
+    __len = function(self)
+        return self.count
+    end,
+}
+
+local uint8_array_t = ffi.typeof("unsigned char [?]")
+
+-- Create a bitmap of cursor kinds for ljclang_collectChildren() from a sequence of
+-- cursor kind names.
+local function GetKindBitmap(kinds)
+    local kindNums = {}
+    local maxKindNum = 0
+
+    for i = 1, #kinds do
+        check(type(kinds[i]) == "string", "<kinds> must contain only strings", 3)
+        local kindNum = tonumber(C["CXCursor_"..kinds[i]])
+        kindNums[i] = kindNum
+        maxKindNum = math.max(maxKindNum, kindNum)
+    end
+
+    local size = math.floor(maxKindNum / 8) + 1
+    local bitmap = uint8_array_t(size)
+
+    for _, kindNum in ipairs(kindNums) do
+        local byteIdx = math.floor(kindNum / 8)
+        bitmap[byteIdx] = bit.bor(bitmap[byteIdx], bit.lshift(1, kindNum % 8))
+    end
+
+    return bitmap, size
+end
+
+local function FindCursors(cur, kinds, name, maxDepth)
+    check(kinds == nil or type(kinds) == "table", "<kinds> must be nil or a table", 3)
+    check(name == nil or type(name) == "string", "<name> must be nil or a string", 3)
+    check(maxDepth == nil or (type(maxDepth) == "number" and maxDepth >= 1),
+          "<maxDepth> must be nil or a number greater or equal to 1", 3)
+
+    local bitmap, bitmapSize = nil, 0
+    if (kinds ~= nil) then
+        bitmap, bitmapSize = GetKindBitmap(kinds)
+    end
+
+    local array = ffi.gc(CursorArray_t(), support.ljclang_freeCursorArray)
+    local ret = support.ljclang_findCursors(cur._cur, bitmap, bitmapSize,
+                                            name, maxDepth or 0, array)
+
+    if (ret ~= 0) then
+        error("out of memory collecting cursors")
+    end
+
+    return array
+end
+
 ----------------------------------------------------------------------------
 
 class
@@ -1049,6 +1298,38 @@ class
         end
     end,
 
+    -- #### `cursorArray = cursor:collect([kinds])`
+    --
+    -- Collects all descendants of `cursor` into a flat array in preorder. The
+    -- traversal happens entirely on the C side, so unlike with `cursor:children()`,
+    -- no Lua callback is invoked per visited node.
+    --
+    -- If the sequence `kinds` of cursor kind names (as returned by `cursor:kind()`)
+    -- is passed, only cursors of one of these kinds are stored. The whole subtree is
+    -- traversed nevertheless.
+    --
+    -- The returned object has the following members, each indexed by a zero-based
+    -- `i` smaller than `#cursorArray`:
+    --
+    --  * `cursors[i]`: the cursor. It remains valid only as long as `cursorArray`
+    --    is reachable and must be copied with `clang.Cursor_t(cursor)` otherwise.
+    --  * `parentIndexes[i]`: the index of the nearest stored ancestor or -1.
+    --  * `depths[i]`: the depth relative to `cursor`, 1 for its direct children.
+    collect = function(self, kinds)
+        return FindCursors(self, kinds, nil, nil)
+    end,
+
+    -- #### `cursorArray = cursor:find(kinds, name [, maxDepth])`
+    --
+    -- Like `cursor:collect(kinds)`, but stores only cursors whose spelling (as
+    -- returned by `cursor:name()`) is equal to `name`, unless it is `nil`. The
+    -- comparison happens on the C side, so no Lua strings are created for the
+    -- cursors that are rejected. If `maxDepth` is given, the traversal descends at
+    -- most that many levels below `cursor`.
+    find = function(self, kinds, name, maxDepth)
+        return FindCursors(self, kinds, name, maxDepth)
+    end,
+
     parent = function(self)
         return getCursor(clang.clang_getCursorSemanticParent(self._cur))
     end,
@@ -1056,15 +1337,15 @@ class
     __tostring = "name",
 
     name = function(self)
-        return getString(clang.clang_getCursorSpelling(self._cur))
+        return getCursorString(self, "name", clang.clang_getCursorSpelling)
     end,
 
     displayName = function(self)
-        return getString(clang.clang_getCursorDisplayName(self._cur))
+        return getCursorString(self, "displayName", clang.clang_getCursorDisplayName)
     end,
 
     USR = function(self)
-        return getString(clang.clang_getCursorUSR(self._cur))
+        return getCursorString(self, "USR", clang.clang_getCursorUSR)
     end,
 
     kind = function(self)
@@ -1142,6 +1423,11 @@ class
         end
     end,
 
+    isFromMainFile = function(self)
+        local cxloc = clang.clang_getCursorLocation(self._cur)
+        return (clang.clang_Location_isFromMainFile(cxloc) ~= 0)
+    end,
+
     referenced = function(self)
         return getCursor(clang.clang_getCursorReferenced(self._cur))
     end,
@@ -2,8 +2,20 @@
 // Copyright (C) 2013-2020 Philipp Kutin
 // See LICENSE for license information.
 
+// For stat() and getrusage().
+#define _POSIX_C_SOURCE 200809L
+
 #include <clang-c/Index.h>
 
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 // Returns the LLVM version obtained with "<llvm-config> --version" when
 // building us.
 const char *ljclang_getLLVMVersion()
@@ -27,3 +39,403 @@ int ljclang_visitChildrenWith(CXCursor parent, LJCX_CursorVisitor visitor)
     const unsigned wasBroken = clang_visitChildren(parent, ourCursorVisitor, &visitor);
     return (wasBroken ? 1 : 0);
 }
+
+// Preorder flattening of an AST subtree, see ljclang_findCursors().
+typedef struct {
+    CXCursor *cursors;
+    // Index of the nearest stored ancestor, or -1 if there is none.
+    int *parentIndexes;
+    // Depth relative to the root of the traversal, 1 for its direct children.
+    int *depths;
+    int count;
+    int capacity;
+} LJCX_CursorArray;
+
+typedef struct {
+    LJCX_CursorArray *array;
+    const unsigned char *kindBitmap;
+    unsigned kindBitmapSize;
+    const char *name;
+    int maxDepth;
+    int parentIndex;
+    int depth;
+    int failed;
+} CollectState;
+
+static int growCursorArray(LJCX_CursorArray *array)
+{
+    const int newCapacity = (array->capacity == 0) ? 256 : 2 * array->capacity;
+
+    CXCursor *cursors = realloc(array->cursors, newCapacity * sizeof(CXCursor));
+    if (cursors == NULL)
+        return 1;
+    array->cursors = cursors;
+
+    int *parentIndexes = realloc(array->parentIndexes, newCapacity * sizeof(int));
+    if (parentIndexes == NULL)
+        return 1;
+    array->parentIndexes = parentIndexes;
+
+    int *depths = realloc(array->depths, newCapacity * sizeof(int));
+    if (depths == NULL)
+        return 1;
+    array->depths = depths;
+
+    array->capacity = newCapacity;
+    return 0;
+}
+
+static int isKindSelected(const CollectState *state, enum CXCursorKind kind)
+{
+    if (state->kindBitmap == NULL)
+        return 1;
+
+    const unsigned byteIdx = (unsigned)kind / 8;
+    return (byteIdx < state->kindBitmapSize &&
+            (state->kindBitmap[byteIdx] & (1u << ((unsigned)kind % 8))) != 0);
+}
+
+static int isNameMatching(const CollectState *state, CXCursor cursor)
+{
+    if (state->name == NULL)
+        return 1;
+
+    CXString spelling = clang_getCursorSpelling(cursor);
+    const char *str = clang_getCString(spelling);
+    const int matches = (str != NULL && strcmp(str, state->name) == 0);
+    clang_disposeString(spelling);
+    return matches;
+}
+
+static enum CXChildVisitResult
+collectVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data)
+{
+    CollectState *state = (CollectState *)(client_data);
+    LJCX_CursorArray *array = state->array;
+    int index = state->parentIndex;
+
+    (void)parent;
+
+    // NOTE: check the kind first so that we obtain the spelling only for candidates.
+    if (isKindSelected(state, clang_getCursorKind(cursor)) && isNameMatching(state, cursor)) {
+        if (array->count == array->capacity && growCursorArray(array) != 0) {
+            state->failed = 1;
+            return CXChildVisit_Break;
+        }
+
+        index = array->count++;
+        array->cursors[index] = cursor;
+        array->parentIndexes[index] = state->parentIndex;
+        array->depths[index] = state->depth;
+    }
+
+    if (state->maxDepth > 0 && state->depth >= state->maxDepth)
+        return CXChildVisit_Continue;
+
+    // Recurse ourselves instead of returning CXChildVisit_Recurse so that the parent
+    // index and depth are tracked without having to compare cursors.
+    CollectState childState = *state;
+    childState.parentIndex = index;
+    childState.depth = state->depth + 1;
+
+    clang_visitChildren(cursor, collectVisitor, &childState);
+
+    if (childState.failed) {
+        state->failed = 1;
+        return CXChildVisit_Break;
+    }
+
+    return CXChildVisit_Continue;
+}
+
+// Appends the descendants of 'root' to 'array' in preorder, growing it as necessary.
+// Only cursors passing all of the following (optional) filters are stored:
+//  - If 'kindBitmap' is non-NULL, the cursor's kind K must have bit (K % 8) of byte
+//    (K / 8) set.
+//  - If 'name' is non-NULL, the cursor's spelling must be equal to it.
+// The traversal does not descend deeper than 'maxDepth' levels if it is positive, but the
+// filters do not prune it otherwise.
+// Returns 0 on success and -1 on allocation failure.
+int ljclang_findCursors(CXCursor root,
+                        const unsigned char *kindBitmap, unsigned kindBitmapSize,
+                        const char *name, int maxDepth, LJCX_CursorArray *array)
+{
+    CollectState state = { array, kindBitmap, kindBitmapSize, name, maxDepth, -1, 1, 0 };
+    clang_visitChildren(root, collectVisitor, &state);
+    return state.failed ? -1 : 0;
+}
+
+int ljclang_collectChildren(CXCursor parent, LJCX_CursorArray *array,
+                            const unsigned char *kindBitmap, unsigned kindBitmapSize)
+{
+    return ljclang_findCursors(parent, kindBitmap, kindBitmapSize, NULL, 0, array);
+}
+
+void ljclang_freeCursorArray(LJCX_CursorArray *array)
+{
+    free(array->cursors);
+    free(array->parentIndexes);
+    free(array->depths);
+
+    array->cursors = NULL;
+    array->parentIndexes = NULL;
+    array->depths = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
+// Process-shared table of interned strings, see shared_string_table.lua.
+//
+// The table resides in a single memory block, laid out as follows:
+//  LJCX_StringTable header
+//  uint32_t slots[slotCount]: open-addressing hash table, 0 or the id of a string
+//  LJCX_StringTableEntry entries[maxStringCount]: indexed by (string id - 1)
+//  char arena[arenaSize]: the string data (not zero-terminated)
+//
+// Insertion is lock-free: the string data and its entry are written before the new id is
+// published in a hash table slot with a compare-and-swap. A process that loses the race
+// for a slot to an equal string returns the id of that string, leaving its own entry
+// unused. Strings are never removed.
+typedef struct {
+    uint32_t maxStringCount;
+    uint32_t slotCount;  // power of two, at least twice 'maxStringCount'
+    uint32_t arenaSize;
+    uint32_t arenaUsed;
+    uint32_t entryCount;
+} LJCX_StringTable;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t hash;
+} LJCX_StringTableEntry;
+
+static uint32_t getSlotCount(uint32_t maxStringCount)
+{
+    uint32_t slotCount = 1;
+    while (slotCount < 2 * (uint64_t)maxStringCount)
+        slotCount *= 2;
+    return slotCount;
+}
+
+static uint32_t *getSlots(LJCX_StringTable *table)
+{
+    return (uint32_t *)(table + 1);
+}
+
+static LJCX_StringTableEntry *getEntries(LJCX_StringTable *table)
+{
+    return (LJCX_StringTableEntry *)(getSlots(table) + table->slotCount);
+}
+
+static char *getArena(LJCX_StringTable *table)
+{
+    return (char *)(getEntries(table) + table->maxStringCount);
+}
+
+// 32-bit FNV-1a.
+static uint32_t hashString(const char *str, uint32_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Atomically reserves 'amount' units of the resource counted by '*counter', never letting
+// it exceed 'limit'. Returns 0 and the old counter value in '*start' on success.
+static int reserve(uint32_t *counter, uint32_t amount, uint32_t limit, uint32_t *start)
+{
+    uint32_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+    do {
+        if (amount > limit - old)
+            return 1;
+    } while (!__atomic_compare_exchange_n(counter, &old, old + amount, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *start = old;
+    return 0;
+}
+
+// Returns the id of a new (not yet published) entry for the string, or 0 if the table
+// is full.
+static uint32_t addEntry(LJCX_StringTable *table,
+                         const char *str, uint32_t length, uint32_t hash)
+{
+    uint32_t offset, entryIdx;
+
+    if (reserve(&table->arenaUsed, length, table->arenaSize, &offset) ||
+            reserve(&table->entryCount, 1, table->maxStringCount, &entryIdx))
+        return 0;
+
+    memcpy(getArena(table) + offset, str, length);
+
+    LJCX_StringTableEntry *entry = &getEntries(table)[entryIdx];
+    entry->offset = offset;
+    entry->length = length;
+    entry->hash = hash;
+
+    return entryIdx + 1;
+}
+
+static int entryMatches(LJCX_StringTable *table, uint32_t id,
+                        const char *str, uint32_t length, uint32_t hash)
+{
+    const LJCX_StringTableEntry *entry = &getEntries(table)[id - 1];
+    return entry->hash == hash && entry->length == length &&
+        memcmp(getArena(table) + entry->offset, str, length) == 0;
+}
+
+size_t ljclang_getStringTableSize(uint32_t maxStringCount, uint32_t arenaSize)
+{
+    return sizeof(LJCX_StringTable) +
+        getSlotCount(maxStringCount) * sizeof(uint32_t) +
+        maxStringCount * sizeof(LJCX_StringTableEntry) +
+        arenaSize;
+}
+
+// 'mem' must point to ljclang_getStringTableSize() zeroed bytes.
+void ljclang_initStringTable(void *mem, uint32_t maxStringCount, uint32_t arenaSize)
+{
+    LJCX_StringTable *table = (LJCX_StringTable *)mem;
+    table->maxStringCount = maxStringCount;
+    table->slotCount = getSlotCount(maxStringCount);
+    table->arenaSize = arenaSize;
+}
+
+static uint32_t findOrInternString(LJCX_StringTable *table,
+                                   const char *str, uint32_t length, int insert)
+{
+    uint32_t *slots = getSlots(table);
+    const uint32_t mask = table->slotCount - 1;
+    const uint32_t hash = hashString(str, length);
+    uint32_t newId = 0;
+
+    // Since the table is at most half full, there is always an empty slot.
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        uint32_t id = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+
+        if (id == 0) {
+            if (!insert)
+                return 0;
+
+            if (newId == 0 && (newId = addEntry(table, str, length, hash)) == 0)
+                return 0;
+
+            if (__atomic_compare_exchange_n(&slots[i], &id, newId, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return newId;
+
+            // Another process published a string in this slot first, 'id' is now its id.
+        }
+
+        if (entryMatches(table, id, str, length, hash))
+            return id;
+    }
+}
+
+// Returns the id (a positive integer) of the given string, adding it to the table if it
+// is not present yet. Returns 0 if the table is full.
+uint32_t ljclang_internString(void *mem, const char *str, uint32_t length)
+{
+    return findOrInternString((LJCX_StringTable *)mem, str, length, 1);
+}
+
+// Returns the id of the given string, or 0 if it is not in the table.
+uint32_t ljclang_findString(void *mem, const char *str, uint32_t length)
+{
+    return findOrInternString((LJCX_StringTable *)mem, str, length, 0);
+}
+
+// Returns a pointer to the string data for 'id' and stores its length in '*length', or
+// returns NULL if 'id' is out of range. The id must have been obtained from
+// ljclang_internString() (possibly in another process).
+const char *ljclang_getInternedString(void *mem, uint32_t id, uint32_t *length)
+{
+    LJCX_StringTable *table = (LJCX_StringTable *)mem;
+
+    if (id == 0 || id > __atomic_load_n(&table->entryCount, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    const LJCX_StringTableEntry *entry = &getEntries(table)[id - 1];
+    *length = entry->length;
+    return getArena(table) + entry->offset;
+}
+
+// Stores the modification time of the file <path> in seconds since the Epoch into
+// <*mtime>. Returns 0 on success and -1 on failure (for example, when the file does not
+// exist).
+int ljclang_getFileModificationTime(const char *path, int64_t *mtime)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return -1;
+
+    *mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+// Stores the CPU time (user plus system, in seconds) and the peak resident set size (in
+// KiB) of this process into <*cpuSeconds> and <*maxRssKb>. If <children> is non-zero,
+// stores those of its terminated and waited-for descendants instead, where the peak RSS
+// is that of the largest one. Returns 0 on success and -1 on failure.
+int ljclang_getResourceUsage(int children, double *cpuSeconds, int64_t *maxRssKb)
+{
+    struct rusage usage;
+
+    if (getrusage(children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage) != 0)
+        return -1;
+
+    *cpuSeconds = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+        (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+    // NOTE: on Linux, ru_maxrss is in kilobytes.
+    *maxRssKb = (int64_t)usage.ru_maxrss;
+    return 0;
+}
+
+// 64-bit FNV-1a, continuing from <hash>. Not meant to be collision-resistant against
+// deliberate attacks.
+static uint64_t hashBytes64(uint64_t hash, const unsigned char *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+#define FNV64_OFFSET_BASIS UINT64_C(14695981039346656037)
+
+uint64_t ljclang_hashBytes(const char *bytes, size_t length)
+{
+    return hashBytes64(FNV64_OFFSET_BASIS, (const unsigned char *)bytes, length);
+}
+
+// Stores the hash of the contents of the file <path> into <*hash>. Returns 0 on success
+// and -1 on failure.
+int ljclang_hashFile(const char *path, uint64_t *hash)
+{
+    unsigned char buf[65536];
+    uint64_t h = FNV64_OFFSET_BASIS;
+    size_t readCount;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+
+    while ((readCount = fread(buf, 1, sizeof(buf), f)) > 0)
+        h = hashBytes64(h, buf, readCount);
+
+    const int hadError = ferror(f);
+    fclose(f);
+
+    if (hadError)
+        return -1;
+
+    *hash = h;
+    return 0;
+}
@@ -14,9 +14,12 @@ local ffi = require("ffi")
 local C = ffi.C
 
 local cl = require("ljclang")
+local ASTCache = require("ast_cache").ASTCache
 local class = require("class").class
+local posix = require("posix")
+local util = require("util")
 
-local compile_commands_util = require("compile_commands_util")
+local compile_commands_reader = require("compile_commands_reader")
 local diagnostics_util = require("diagnostics_util")
 
 local abs = math.abs
@@ -26,6 +29,7 @@ local arg = arg
 local assert = assert
 local ipairs = ipairs
 local print = print
+local tonumber = tonumber
 local type = type
 
 ffi.cdef[[
@@ -78,6 +82,18 @@ local function usage(hline)
 Options:
   -d /path/to/compile_commands.json: use compilation database
   -O '<clang_options...>': pass options to Clang, split at whitespace
+  -c <concurrency>: number of files to parse in parallel, or 'auto' for one per CPU.
+     The results for each file are printed as soon as it has been searched, so with a
+     concurrency greater than one, their order may vary.
+     (Default: auto with -d, 1 otherwise)
+  -k <directory>: cache the parsed translation units in <directory>, loading them from
+     there on later runs as long as none of the files they were made from has changed.
+     Once the file defining <typeName> is known, files whose cached translation unit
+     does not include it are skipped.
+  -w: once the file defining <typeName> is known, ask a running wcc-server (through
+     wcc-client) which compile commands include it, and skip the other files. The server
+     must watch the same compilation database and is only trusted when it has processed
+     all of its compile commands and is not processing any of them again.
   --no-color: Turn off match and diagnostic highlighting
   -n: only parse and potentially print diagnostics
   -q: be quiet (don't print diagnostics)
@@ -98,7 +114,7 @@ end
 local parsecmdline = require("parsecmdline_pk")
 local opt_meta = {
     [0] = -1,
-    d=true, O=true, q=false, n=false,
+    d=true, O=true, c=true, k=true, q=false, n=false, w=false,
     ["-no-color"]=false
 }
 
@@ -106,10 +122,23 @@ local opts, files = parsecmdline.getopts(opt_meta, arg, usage)
 
 local compDbName = opts.d
 local clangOpts = opts.O
+local concurrencyOpt = opts.c or (compDbName ~= nil and "auto" or "1")
+local astCacheDirectory = opts.k
+local askWatcher = opts.w
 local quiet = opts.q
 local dryrun = opts.n
 local useColors = not opts["-no-color"]
 
+local concurrency
+
+if (concurrencyOpt == "auto") then
+    concurrency = math.max(1, cl.hardwareConcurrency())
+elseif (concurrencyOpt:match("^[1-9][0-9]*$")) then
+    concurrency = tonumber(concurrencyOpt)
+else
+    usage("Argument to option -c must be 'auto' or a positive integral number")
+end
+
 local queryStr = files[0]
 files[0] = nil
 
@@ -132,39 +161,32 @@ local typeName, memberName = parseQueryString(queryStr)
 local g_structDecl
 local g_cursorKind
 
-local V = cl.ChildVisitResult
--- Visitor for finding the named structure declaration.
-local GetTypeVisitor = cl.regCursorVisitor(
-function(cur, parent)
-    local curKind = cur:kind()
-
-    if (curKind == "ClassDecl" or curKind == "StructDecl") then
-        if (cur:name() == typeName) then
-            g_structDecl = cl.Cursor(cur)
-            g_cursorKind = curKind
-            return V.Break
-        end
-    elseif (curKind == "TypedefDecl") then
-        local typ = cur:typedefType()
-        local structDecl = typ:declaration()
-        if (structDecl:haskind("StructDecl")) then
---            printf("typedef struct %s %s", structDecl:name(), cur:name())
-            if (cur:name() == typeName) then
-                g_structDecl = structDecl
-                g_cursorKind = "StructDecl"
-                return V.Break
-            end
-        end
-    end
-
+-- Find the named structure declaration, returning it and its cursor kind.
+local function FindStructDecl(tuCursor)
     -- The structure declaration might not be found on the top level for C++
-    -- code, 'Recurse' instead of 'Continue'.
+    -- code, so search the whole AST instead of only the direct children.
     --
     -- NOTE: Of course, mgrep does not have any notable C++ naming support, but
     -- one might use it to search code originally written as C which then had
     -- C++ "added in".
-    return V.Recurse
-end)
+    local candidates = tuCursor:find({"ClassDecl", "StructDecl", "TypedefDecl"}, typeName)
+
+    for i = 0, #candidates - 1 do
+        local cur = candidates.cursors[i]
+        local curKind = cur:kind()
+
+        if (curKind == "ClassDecl" or curKind == "StructDecl") then
+            return cl.Cursor_t(cur), curKind
+        else
+            assert(curKind == "TypedefDecl")
+            local structDecl = cur:typedefType():declaration()
+            if (structDecl:haskind("StructDecl")) then
+--                printf("typedef struct %s %s", structDecl:name(), cur:name())
+                return structDecl, "StructDecl"
+            end
+        end
+    end
+end
 
 --------------------
 
@@ -207,58 +229,55 @@ local function clearResults()
     g_fileColumnPairs = {}
 end
 
--- Visitor for looking for the wanted member accesses.
-local SearchVisitor = cl.regCursorVisitor(
-function(cur, parent)
-    if (cur:haskind("MemberRefExpr")) then
-        local membname = cur:name()
-        if (membname == memberName) then
-            local def = cur:definition():parent()
-            if (def:haskind(g_cursorKind) and def == g_structDecl) then
-                local fn, line, col, lineEnd, colEnd = cur:location()
-                local oneline = (line == lineEnd)
-
-                local idx = g_fileIdx[fn] or #g_fileLines+1
-                if (g_fileLines[idx] == nil) then
-                    -- encountering file name for the first time
-                    g_fileIdx[fn] = idx
-                    g_fileName[idx] = fn
-                    g_fileLines[idx] = {}
-                    g_fileColumnPairs[idx] = {}
-                end
+-- Search for the wanted member accesses.
+local function SearchMemberAccesses(tuCursor)
+    local memberRefs = tuCursor:find({"MemberRefExpr"}, memberName)
+
+    for i = 0, #memberRefs - 1 do
+        local cur = memberRefs.cursors[i]
+        local def = cur:definition():parent()
+        if (def:haskind(g_cursorKind) and def == g_structDecl) then
+            local fn, line, col, lineEnd, colEnd = cur:location()
+            local oneline = (line == lineEnd)
+
+            local idx = g_fileIdx[fn] or #g_fileLines+1
+            if (g_fileLines[idx] == nil) then
+                -- encountering file name for the first time
+                g_fileIdx[fn] = idx
+                g_fileName[idx] = fn
+                g_fileLines[idx] = {}
+                g_fileColumnPairs[idx] = {}
+            end
 
-                local lines = g_fileLines[idx]
-                local haveLine =
-                    lines[#lines] ~= nil
-                    and (abs(lines[#lines]) == line)
+            local lines = g_fileLines[idx]
+            local haveLine =
+                lines[#lines] ~= nil
+                and (abs(lines[#lines]) == line)
 
-                local lidx = haveLine and #lines or #lines+1
+            local lidx = haveLine and #lines or #lines+1
 
-                if (not haveLine) then
-                    lines[lidx] = oneline and line or -line
-                end
+            if (not haveLine) then
+                lines[lidx] = oneline and line or -line
+            end
 
-                local colNumPairs = g_fileColumnPairs[idx]
-                if (colNumPairs[lidx] == nil) then
-                    colNumPairs[lidx] = {}
-                end
+            local colNumPairs = g_fileColumnPairs[idx]
+            if (colNumPairs[lidx] == nil) then
+                colNumPairs[lidx] = {}
+            end
 
-                local pairs = colNumPairs[lidx]
-                if (oneline) then
-                    -- The following 'if' check is to prevent adding the same
-                    -- column pair twice, e.g. when a macro contains multiple
-                    -- references to the searched-for member.
-                    if (pairs[#pairs-1] ~= col) then
-                        pairs[#pairs+1] = col
-                        pairs[#pairs+1] = colEnd
-                    end
+            local pairs = colNumPairs[lidx]
+            if (oneline) then
+                -- The following 'if' check is to prevent adding the same
+                -- column pair twice, e.g. when a macro contains multiple
+                -- references to the searched-for member.
+                if (pairs[#pairs-1] ~= col) then
+                    pairs[#pairs+1] = col
+                    pairs[#pairs+1] = colEnd
                 end
             end
         end
     end
-
-    return V.Recurse
-end)
+end
 
 local function colorizeResult(str, colBegEnds)
     local a=1
@@ -280,7 +299,8 @@ end
 
 local curDir = getcwd()
 
-local function printResults()
+-- Passes the formatted results to <write>, one line at a time.
+local function printResults(write)
     for fi = 1,#g_fileName do
         local fn = g_fileName[fi]
 
@@ -299,7 +319,7 @@ local function printResults()
             if (useColors) then
                 str = colorizeResult(str, pairs[li])
             end
-            printf("%s:%d: %s", fn, line, str)
+            write(format("%s:%d: %s\n", fn, line, str))
         end
     end
 end
@@ -317,68 +337,65 @@ if (useCompDb) then
         usage("When using compilation database, must pass no file names")
     end
 
-    local compDbPos = compDbName:find("[\\/]compile_commands.json$")
-    if (compDbPos == nil) then
-        usage("File name of compilation database must be compile_commands.json")
-    end
-
-    local compDbDir = compDbName:sub(1, compDbPos)
-    -- TODO: port to compile_commands_reader
-    local db = cl.CompilationDatabase(compDbDir)
+    -- NOTE: the arguments are sanitized (see compile_commands_util.sanitize_args()).
+    local cmds, errorMsg = compile_commands_reader.read_compile_commands(compDbName)
 
-    if (db == nil) then
-        abort("Fatal: Could not load compilation database")
+    if (cmds == nil) then
+        abort("Fatal: Could not load compilation database: "..errorMsg)
+    elseif (#cmds == 0) then
+        abort("Fatal: Compilation database contains no entries")
     end
 
-    local cmds = db:getAllCompileCommands()
-
-    if (#cmds == 0) then
-        -- NOTE: We get a CompilationDatabase even if
-        -- clang_CompilationDatabase_fromDirectory() failed (as evidenced by
-        -- error output from "LIBCLANG TOOLING").
-        abort("Fatal: Compilation database contains no entries, or an error occurred")
-    end
+    local suffixArgs = (clangOpts ~= nil) and cl.splitAtWhitespace(clangOpts) or {}
 
     for ci, cmd in ipairs(cmds) do
-        local args = compile_commands_util.sanitize_args(cmd:getArgs(), cmd:getDirectory())
-
-        if (clangOpts ~= nil) then
-            local suffixArgs = cl.splitAtWhitespace(clangOpts)
-            for ai=1,#suffixArgs do
-                args[#args+1] = suffixArgs[ai]
-            end
+        local args = cmd.arguments
+        for ai=1,#suffixArgs do
+            args[#args+1] = suffixArgs[ai]
         end
-        compArgs[ci] = args
-    end
 
-    for i=1,#cmds do
-        -- Fake presence of files for compilation database mode for the later loop.
-        files[i] = "/dev/null"  -- XXX: Windows
+        compArgs[ci] = args
+        files[ci] = cmd.file
     end
 end
 
-local foundStruct = false
+local ParseOptions = {"KeepGoing"}
 
-for fi=1,#files do
-    local fn = files[fi]
+local index = cl.createIndex(true, false)
+local astCache = (astCacheDirectory ~= nil) and ASTCache(astCacheDirectory) or nil
 
-    local index = cl.createIndex(true, false)
-    local opts = useCompDb and compArgs[fi] or clangOpts or {}
+-- Returns the source file name and the command line to parse file #<fi> with.
+local function GetParseArgs(fi)
+    return useCompDb and "" or files[fi], useCompDb and compArgs[fi] or clangOpts or {}
+end
+
+-- Parses file #<fi> and searches it for the member accesses. Returns the formatted results,
+-- whether the declaration of <typeName> was found and the name of the file that defines it,
+-- if the translation unit has its definition.
+local function SearchFile(fi)
+    local fn = files[fi]
 
     do
         local f, msg = io.open(fn)
         if (f == nil) then
             errprintf("ERROR: Failed opening %s", msg)
-            goto nextfile
+            return "", false
         end
         f:close()
     end
 
-    local tu, errorCode = index:parse(useCompDb and "" or fn, opts, {"KeepGoing"})
+    local srcFileName, args = GetParseArgs(fi)
+    local tu, errorCode
+
+    if (astCache ~= nil) then
+        tu, errorCode = astCache:parse(index, srcFileName, args, ParseOptions)
+    else
+        tu, errorCode = index:parse(srcFileName, args, ParseOptions)
+    end
 
     if (tu == nil) then
         errprintf("ERROR: Failed parsing %s: %s", fn, errorCode)
-        goto nextfile
+        return "", false
     end
 
     if (not quiet) then
@@ -387,21 +404,267 @@ for fi=1,#files do
         diagnostics_util.GetDiags(tu:diagnosticSet(), useColors, false)
     end
 
-    if (not dryrun) then
-        local tuCursor = tu:cursor()
-        tuCursor:children(GetTypeVisitor)
-
-        if (g_structDecl ~= nil) then
-            tuCursor:children(SearchVisitor)
-            printResults()
-            clearResults()
-            g_structDecl = nil
-            g_cursorKind = nil
-            foundStruct = true
+    if (dryrun) then
+        return "", false
+    end
+
+    local tuCursor = tu:cursor()
+    g_structDecl, g_cursorKind = FindStructDecl(tuCursor)
+
+    if (g_structDecl == nil) then
+        return "", false
+    end
+
+    SearchMemberAccesses(tuCursor)
+
+    local results = {}
+    printResults(function(str)
+        results[#results+1] = str
+    end)
+
+    -- NOTE: a translation unit that only has a forward declaration of <typeName> does not
+    --  tell which file defines it.
+    local definition = g_structDecl:definition()
+    local definingFileName = (definition ~= nil) and definition:location() or nil
+
+    clearResults()
+    g_structDecl = nil
+    g_cursorKind = nil
+
+    return table.concat(results), true, definingFileName
+end
+
+---------- Skipping files that cannot reference <typeName> ----------
+
+local g_realNames = {}  -- [fileName] = real name, or false if it could not be determined
+
+local function getRealName(fileName)
+    local realName = g_realNames[fileName]
+    if (realName == nil) then
+        realName = posix.realpath(fileName) or false
+        g_realNames[fileName] = realName
+    end
+    return realName or fileName
+end
+
+-- The real name of the file defining <typeName>, once a file has been searched that has it.
+local g_definingFileName
+-- With -w: set of the real names of the files of the compile commands which include it
+-- according to the watcher, or false if the watcher could not tell.
+local g_includingFiles = false
+
+-- Asks a running wcc-server for the files of the compile commands that include <fileName>.
+-- Returns them as a set of real names, or nil if it cannot tell.
+local function QueryWatcher(fileName)
+    if (fileName:match("[%s%c']")) then
+        -- NOTE: wcc-client rejects arguments with whitespace or control characters.
+        return nil
+    end
+
+    local pipe = io.popen(format("wcc-client -b fileinfo including-tu-count '%s' @@ "..
+                                     "fileinfo including-tu-files '%s' 2> /dev/null",
+                                 fileName, fileName))
+    if (pipe == nil) then
+        return nil
+    end
+
+    local output = pipe:read("*a") or ""
+    pipe:close()
+
+    -- NOTE [STRING_VALIDATION]: like in ljclang-wcc-flycheck.el. A '+' after the count
+    --  means that not all compile commands have been processed yet, and a '?' that some
+    --  are being processed again. In either case, the graph may be incomplete or stale.
+    local countStr, suffix, fileNamesStr = output:match("^(%d+)([%+%?]?)!?\n(.*)$")
+    if (countStr == nil or suffix ~= "") then
+        return nil
+    end
+
+    local includingFiles = {}
+    local fileCount = 0
+
+    for includingFileName in fileNamesStr:gmatch("[^\n]+") do
+        if (includingFileName:sub(1,1) ~= "/") then
+            -- An error message in place of the file names.
+            return nil
+        end
+
+        includingFiles[getRealName(includingFileName)] = true
+        fileCount = fileCount + 1
+    end
+
+    -- NOTE: the count is that of the compile commands, while the file names are unique.
+    --  Several compile commands may compile the same file.
+    local ccCount = tonumber(countStr)
+    local isConsistent = (fileCount <= ccCount and (fileCount > 0) == (ccCount > 0))
+
+    return isConsistent and includingFiles or nil
+end
+
+local function NoteDefiningFile(fileName)
+    if (g_definingFileName ~= nil or fileName == nil) then
+        return
+    end
+
+    g_definingFileName = getRealName(fileName)
+
+    if (askWatcher) then
+        g_includingFiles = QueryWatcher(g_definingFileName) or false
+
+        if (not g_includingFiles and not quiet) then
+            errprintf("WARNING: wcc-server could not tell which compile commands include %s.",
+                      g_definingFileName)
+        end
+    end
+end
+
+-- Can file #<fi> be skipped because it is known not to include the file defining
+-- <typeName>?
+local function CanSkip(fi)
+    if (g_definingFileName == nil) then
+        return false
+    elseif (g_includingFiles) then
+        return not g_includingFiles[getRealName(files[fi])]
+    elseif (astCache ~= nil) then
+        local srcFileName, args = GetParseArgs(fi)
+        local fileNames = astCache:getFileNames(srcFileName, args, ParseOptions)
+
+        if (fileNames ~= nil) then
+            for _, fileName in ipairs(fileNames) do
+                if (getRealName(fileName) == g_definingFileName) then
+                    return false
+                end
+            end
+
+            return true
+        end
+    end
+
+    return false
+end
+
+---------- Searching the files in parallel ----------
+
+local ChunkSize = 65536
+
+-- Layout (all integers are uint32_t):
+--  <whether the declaration was found> <length of defining file name>
+--  <defining file name> <formatted results>
+local function SerializeResults(results, found, definingFileName)
+    definingFileName = definingFileName or ""
+    return util.packUint32s({ found and 1 or 0, #definingFileName })..
+        definingFileName..results
+end
+
+local function DeserializeResults(data)
+    local reader = util.BinaryReader(data)
+    local found, length = reader:uint32(), reader:uint32()
+    local definingFileName = reader:string(length)
+    local results = reader:string(#data - 8 - length)
+
+    return results, (found == 1), (length > 0) and definingFileName or nil
+end
+
+-- Forks a worker process that searches file #<fi> and sends back the results.
+-- Returns the worker as { pid=<pid>, fd=<read end of its pipe>, chunks={} }.
+local function SpawnWorker(fi)
+    local pipe = posix.pipe()
+
+    -- Do not have buffered output appear twice.
+    io.stdout:flush()
+    io.stderr:flush()
+
+    local whoami, pid = posix.fork()
+
+    if (whoami == "child") then
+        pipe.r:close()
+
+        local data = SerializeResults(SearchFile(fi))
+        local pos = 1
+
+        while (pos <= #data) do
+            pos = pos + tonumber(pipe.w:write(data:sub(pos)))
         end
+
+        os.exit(0)
+    end
+
+    pipe.w:close()
+    return { pid=pid, fd=pipe.r, chunks={} }
+end
+
+local foundStruct = false
+
+local function HandleResults(results, found, definingFileName)
+    io.stdout:write(results)
+
+    if (found) then
+        foundStruct = true
+        NoteDefiningFile(definingFileName)
     end
+end
 
-    ::nextfile::
+-- Searches the files in up to <concurrency> worker processes at a time, printing the
+-- results for each one as soon as it is done. Files that have not been handed to a worker
+-- by the time the file defining <typeName> is known are candidates for skipping.
+local function RunWorkers()
+    local workers = {}  -- [<fd>] = <worker>
+    local pollSpec = { events=posix.POLL.IN }
+    local nextFi = 1
+
+    while (true) do
+        while (#pollSpec < concurrency and nextFi <= #files) do
+            if (not CanSkip(nextFi)) then
+                local worker = SpawnWorker(nextFi)
+                worker.fi = nextFi
+                workers[worker.fd.fd] = worker
+                pollSpec[#pollSpec+1] = worker.fd.fd
+            end
+            nextFi = nextFi + 1
+        end
+
+        if (#pollSpec == 0) then
+            break
+        end
+
+        for _, event in ipairs(posix.poll(pollSpec)) do
+            local fd = tonumber(event.fd)
+            local worker = workers[fd]
+            local chunk = worker.fd:read(ChunkSize)
+
+            if (#chunk > 0) then
+                worker.chunks[#worker.chunks+1] = chunk
+            else
+                -- End of file: the worker is done.
+                worker.fd:close()
+                workers[fd] = nil
+
+                for i = 1, #pollSpec do
+                    if (pollSpec[i] == fd) then
+                        table.remove(pollSpec, i)
+                        break
+                    end
+                end
+
+                local status = posix.waitpid(worker.pid, 0)
+
+                if (status ~= "exited") then
+                    errprintf("ERROR: Failed searching %s", files[worker.fi])
+                else
+                    HandleResults(DeserializeResults(table.concat(worker.chunks)))
+                end
+            end
+        end
+    end
+end
+
+if (concurrency == 1) then
+    for fi=1,#files do
+        if (not CanSkip(fi)) then
+            HandleResults(SearchFile(fi))
+        end
+    end
+else
+    RunWorkers()
 end
 
 if (not foundStruct) then
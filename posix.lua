@@ -49,6 +49,7 @@ long sysconf(int name);
 pid_t fork(void);
 pid_t getpid(void);
 pid_t waitpid(pid_t pid, int *stat_loc, int options);
+int kill(pid_t pid, int sig);
 uid_t geteuid(void);
 int execv(const char *path, char *const argv[]);
 int pipe(int pipefd[2]);
@@ -162,6 +163,8 @@ local SIG = decls.SIG
 
 local external_SIG = {
     INT = SIG.INT,
+    STOP = SIG.STOP,
+    CONT = SIG.CONT,
     -- NOTE: that SIG_DFL == NULL has been checked in posix_decls.lua
     DFL = ffi.new("sighandler_t"),
 }
@@ -255,6 +258,7 @@ end
 local uint8_ptr_t = ffi.typeof("uint8_t *")
 local uint8_array_t = ffi.typeof("uint8_t [?]")
 local Allow_EAGAIN = { [decls.E.AGAIN] = true }
+local Allow_EAGAIN_EPIPE = { [decls.E.AGAIN] = true, [decls.E.PIPE] = true }
 local Allow_EPIPE = { [decls.E.PIPE] = true }
 
 api.STDOUT_FILENO = 1
@@ -374,6 +378,19 @@ api.Fd = class
         return (errno == nil) and bytesWritten or nil
     end,
 
+    -- Writes as much of the string <str> as possible without blocking (the file descriptor
+    -- must have been opened with O.NONBLOCK). Returns the number of bytes written, which
+    -- may be zero, or nil if there is no one to read it.
+    writeNonblocking = function(self, str)
+        checktype(str, 1, "string", 2)
+        check(#str > 0, "argument must have non-zero length", 2)
+        local bytesWritten, errno =
+            callAllowing(Allow_EAGAIN_EPIPE, "write", self.fd, str, #str)
+        assert(bytesWritten <= #str)
+        return (errno == nil) and tonumber(bytesWritten) or
+            (errno == decls.E.AGAIN) and 0 or nil
+    end,
+
     -- Redirect 'fd' to us.
     capture = function(self, fd)
         checktype(fd, 1, "number", 2)
@@ -456,29 +473,43 @@ local function sysconf(name)
     return ret
 end
 
-api.poll = function(tab, timeoutMs)
-    checktype(tab, 1, "table", 2)
-    check(#tab > 0, "passed table must not be empty", 2)
-    check(timeoutMs == nil or type(timeoutMs) == "number",
-          "argument #2 must be nil or a number", 2)
+local function checkPollSpec(tab, level)
+    if (#tab == 0) then
+        return
+    end
 
     local homogenousEventSet = (tab.events ~= nil) and tab.events or nil
     assert(homogenousEventSet ~= nil, "must provide <tab>.events: "..
                "inhomogenous event specification not implemented")
 
-    local pollfds = pollfd_array_t(#tab, pollfd_t{0, tab.events, 0})
+    for _, fd in ipairs(tab) do
+        check(type(fd) == "number", "numeric elements of passed table must be numbers",
+              level + 1)
+    end
+end
 
-    for i, fd in ipairs(tab) do
-        check(type(fd) == "number", "numeric elements of passed table must be numbers", 2)
-        pollfds[i - 1].fd = fd
+local function doPoll(specs, timeoutMs)
+    local fdCount = 0
+    for _, tab in ipairs(specs) do
+        fdCount = fdCount + #tab
+    end
+
+    local pollfds = pollfd_array_t(fdCount)
+    local pollfdIdx = 0
+
+    for _, tab in ipairs(specs) do
+        for _, fd in ipairs(tab) do
+            pollfds[pollfdIdx] = pollfd_t{fd, tab.events, 0}
+            pollfdIdx = pollfdIdx + 1
+        end
     end
 
-    local eventCount = call("poll", pollfds, #tab, timeoutMs or -1)
+    local eventCount = call("poll", pollfds, fdCount, timeoutMs or -1)
     assert(eventCount >= 0)
 
     local events = {}
 
-    for i = 0, #tab - 1 do
+    for i = 0, fdCount - 1 do
         if (pollfds[i].revents ~= 0) then
             local p = pollfds[i]
             events[#events + 1] = pollfd_t(p)
@@ -489,6 +520,36 @@ api.poll = function(tab, timeoutMs)
     return events
 end
 
+api.poll = function(tab, timeoutMs)
+    checktype(tab, 1, "table", 2)
+    check(#tab > 0, "passed table must not be empty", 2)
+    check(timeoutMs == nil or type(timeoutMs) == "number",
+          "argument #2 must be nil or a number", 2)
+
+    checkPollSpec(tab, 2)
+    return doPoll({ tab }, timeoutMs)
+end
+
+-- Like poll(), but for a sequence <specs> of tables as passed to it, so that different
+-- events can be waited for on different file descriptors. Tables may be empty, but not
+-- all of them.
+api.pollMulti = function(specs, timeoutMs)
+    checktype(specs, 1, "table", 2)
+    check(timeoutMs == nil or type(timeoutMs) == "number",
+          "argument #2 must be nil or a number", 2)
+
+    local fdCount = 0
+
+    for _, tab in ipairs(specs) do
+        check(type(tab) == "table", "elements of argument #1 must be tables", 2)
+        checkPollSpec(tab, 2)
+        fdCount = fdCount + #tab
+    end
+
+    check(fdCount > 0, "passed tables must not all be empty", 2)
+    return doPoll(specs, timeoutMs)
+end
+
 -- NOTE: Linux's "man mmap" explicitly mentions this value.
 local MAP_FAILED = ffi.cast("void *", -1)
 
@@ -685,6 +746,50 @@ api.realpath = function(pathname)
     return str
 end
 
+ffi.cdef[[
+int ljclang_getFileModificationTime(const char *path, int64_t *mtime);
+int ljclang_getResourceUsage(int children, double *cpuSeconds, int64_t *maxRssKb);
+]]
+
+local int64_array_t = ffi.typeof("int64_t [1]")
+local double_array_t = ffi.typeof("double [1]")
+local support
+
+-- Returns the modification time of the file <pathname> in seconds since the Epoch, or
+-- nil and an error string on failure.
+--
+-- NOTE: 'struct stat' differs between architectures and C libraries, so this goes
+--  through the support library instead of declaring stat() here.
+api.getModificationTime = function(pathname)
+    checktype(pathname, 1, "string", 2)
+
+    support = support or ffi.load("ljclang_support")
+    local mtime = int64_array_t()
+
+    if (support.ljclang_getFileModificationTime(pathname, mtime) ~= 0) then
+        return nil, getErrnoString()
+    end
+
+    return tonumber(mtime[0])
+end
+
+-- Returns the CPU time (user plus system) in seconds and the peak resident set size in KiB
+-- of this process or, if <ofChildren> is true, of its terminated and waited-for
+-- descendants. For the latter, the peak is that of the largest one.
+--
+-- NOTE: like with getModificationTime(), 'struct rusage' is left to the support library.
+api.getResourceUsage = function(ofChildren)
+    checktype(ofChildren, 1, "boolean", 2)
+
+    support = support or ffi.load("ljclang_support")
+    local cpuSeconds, maxRssKb = double_array_t(), int64_array_t()
+
+    local ret = support.ljclang_getResourceUsage(ofChildren and 1 or 0, cpuSeconds, maxRssKb)
+    assert(ret == 0, "getrusage() failed unexpectedly")
+
+    return cpuSeconds[0], tonumber(maxRssKb[0])
+end
+
 local pid_t = ffi.typeof("pid_t")
 
 local function isPid(v)
@@ -711,6 +816,16 @@ api.waitpid = function(pid, options)
     return "NYI", -1, pid_t(-1)
 end
 
+api.kill = function(pid, sig)
+    check(isPid(pid), "argument #1 must be a pid", 2)
+    -- Exclude signaling process groups or all processes:
+    check(pid > 0, "argument #1 must be strictly positive", 2)
+    check(sig == SIG.STOP or sig == SIG.CONT, "argument #2 must be SIG.STOP or SIG.CONT", 2)
+
+    local ret = call("kill", pid, sig)
+    assert(ret == 0)
+end
+
 api.pipe = function()
     local fds = ffi.new("int [2]")
     local ret = call("pipe", fds)
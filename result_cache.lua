@@ -0,0 +1,216 @@
+local bit = require("bit")
+local ffi = require("ffi")
+local io = require("io")
+local os = require("os")
+local table = require("table")
+
+local class = require("class").class
+local posix = require("posix")
+local util = require("util")
+
+local error_util = require("error_util")
+local check = error_util.check
+local checktype = error_util.checktype
+
+local ipairs = ipairs
+local pcall = pcall
+local tonumber = tonumber
+local tostring = tostring
+
+----------
+
+ffi.cdef[[
+uint64_t ljclang_hashBytes(const char *bytes, size_t length);
+int ljclang_hashFile(const char *path, uint64_t *hash);
+]]
+
+local support = ffi.load("ljclang_support")
+
+local api = {}
+
+local uint64_array_t = ffi.typeof("uint64_t [1]")
+
+-- Returns a 64-bit hash of <str> as a string of 16 hexadecimal digits.
+function api.hashString(str)
+    checktype(str, 1, "string", 2)
+    return bit.tohex(support.ljclang_hashBytes(str, #str), 16)
+end
+
+-- Returns the hash of the contents of the file <fileName> as its low and high 32 bits, or
+-- nil if the file could not be read.
+local function hashFile(fileName)
+    local hash = uint64_array_t()
+    if (support.ljclang_hashFile(fileName, hash) ~= 0) then
+        return nil
+    end
+    return tonumber(bit.band(hash[0], 0xffffffff)), tonumber(bit.rshift(hash[0], 32))
+end
+
+-- Layout of a cache entry file (all integers are uint32_t):
+--  "WCCR" <version> <signature length> <file count> <diags length> <graph length>
+--   <symbol count>
+--  <signature>
+--  <length of file name i> <low 32 bits of hash i> <high 32 bits of hash i> for each file i
+--  <concatenated file names>
+--  <serialized diags> <serialized graph>
+--  <length of USR i> <length of name i> <use flags i> <cursor kind i> for each symbol i
+--  <concatenated USR and name of each symbol>
+local EntryMagic, EntryVersion = "WCCR", 2
+
+-- Returns nil if the entry in <data> is not for <signature> or if any of its files has
+-- changed since it was stored. Raises an error if <data> is not a valid entry.
+local function parseEntry(data, signature)
+    check(data:sub(1, #EntryMagic) == EntryMagic, "wrong magic", 1)
+
+    local reader = util.BinaryReader(data:sub(#EntryMagic + 1))
+    local header = reader:uint32s(6)
+
+    if (header[0] ~= EntryVersion or reader:string(header[1]) ~= signature) then
+        -- NOTE: a signature mismatch means a collision of the file name hashes.
+        return nil
+    end
+
+    local fileCount, diagsLength, graphLength, symbolCount =
+        header[2], header[3], header[4], header[5]
+    local fileRecords = reader:uint32s(3 * fileCount)
+
+    for i = 0, 3 * fileCount - 1, 3 do
+        local low, high = hashFile(reader:string(fileRecords[i]))
+        if (low ~= fileRecords[i + 1] or high ~= fileRecords[i + 2]) then
+            return nil
+        end
+    end
+
+    local diagsStr = reader:string(diagsLength)
+    local graphStr = reader:string(graphLength)
+    local symbolRecords = reader:uint32s(4 * symbolCount)
+    local symbols = {}
+
+    for i = 0, 4 * symbolCount - 1, 4 do
+        symbols[#symbols + 1] = {
+            reader:string(symbolRecords[i]), reader:string(symbolRecords[i + 1]),
+            symbolRecords[i + 2], symbolRecords[i + 3]
+        }
+    end
+
+    check(reader:isAtEnd(), "trailing data", 1)
+    return diagsStr, graphStr, symbols
+end
+
+-- A cache of per-compile-command results in a directory, keyed by a signature of the
+-- compile command and validated by the hashes of the contents of the files that the
+-- results depend on. Since it does not rely on modification times, it remains usable
+-- across a fresh checkout or when copied from elsewhere, provided that the file names
+-- (which are part of the signature and of the entries) are the same there.
+--
+-- NOTE: entries are written to a temporary file first and then renamed, so that
+--  concurrent readers and writers (in particular, sibling processes) never see partial
+--  entries.
+api.ResultCache = class
+{
+    function(directory)
+        checktype(directory, 1, "string", 2)
+
+        return {
+            directory = directory,
+        }
+    end,
+
+    -- Returns the serialized diagnostics, the serialized inclusion graph and the sequence
+    -- of symbols (as passed to store()) of the entry for <signature>, or nil if there is no
+    -- such entry or any of its files has changed.
+    lookup = function(self, signature)
+        checktype(signature, 1, "string", 2)
+
+        local file = io.open(self:getFileName_(signature), "rb")
+        if (file == nil) then
+            return nil
+        end
+
+        local data = file:read("*a")
+        file:close()
+
+        local ok, diagsStr, graphStr, symbols = pcall(parseEntry, data or "", signature)
+        if (not ok) then
+            -- Treat an invalid entry like a missing one. It is overwritten on the next store.
+            return nil
+        end
+
+        return diagsStr, graphStr, symbols
+    end,
+
+    -- Stores an entry for <signature>, replacing any previous one.
+    --
+    -- <fileNames>: sequence of the names of all files that the results depend on.
+    -- <symbols>: sequence of { <USR>, <name>, <use flags>, <cursor kind> }.
+    -- <startTime>: time (in seconds since the Epoch) at which the results started to be
+    --  computed. If any file was modified at or after it, the results may predate its
+    --  current contents, so nothing is stored.
+    --
+    -- Returns true if the entry was stored, false otherwise.
+    store = function(self, signature, fileNames, diagsStr, graphStr, symbols, startTime)
+        checktype(signature, 1, "string", 2)
+        checktype(fileNames, 2, "table", 2)
+        checktype(diagsStr, 3, "string", 2)
+        checktype(graphStr, 4, "string", 2)
+        checktype(symbols, 5, "table", 2)
+        checktype(startTime, 6, "number", 2)
+
+        local fileRecords = {}
+
+        for _, fileName in ipairs(fileNames) do
+            local mtime = posix.getModificationTime(fileName)
+            local low, high = hashFile(fileName)
+
+            if (mtime == nil or mtime >= startTime or low == nil) then
+                return false
+            end
+
+            fileRecords[#fileRecords + 1] = #fileName
+            fileRecords[#fileRecords + 1] = low
+            fileRecords[#fileRecords + 1] = high
+        end
+
+        local symbolRecords, symbolStrings = {}, {}
+
+        for _, symbol in ipairs(symbols) do
+            symbolRecords[#symbolRecords + 1] = #symbol[1]
+            symbolRecords[#symbolRecords + 1] = #symbol[2]
+            symbolRecords[#symbolRecords + 1] = symbol[3]
+            symbolRecords[#symbolRecords + 1] = symbol[4]
+            symbolStrings[#symbolStrings + 1] = symbol[1]
+            symbolStrings[#symbolStrings + 1] = symbol[2]
+        end
+
+        local header = { EntryVersion, #signature, #fileNames, #diagsStr, #graphStr, #symbols }
+        local data = EntryMagic..util.packUint32s(header)..signature..
+            util.packUint32s(fileRecords)..table.concat(fileNames)..diagsStr..graphStr..
+            util.packUint32s(symbolRecords)..table.concat(symbolStrings)
+
+        local fileName = self:getFileName_(signature)
+        local tempFileName = fileName..".tmp"..tostring(ffi.C.getpid())
+        local file = io.open(tempFileName, "wb")
+
+        if (file == nil) then
+            return false
+        end
+
+        local ok = file:write(data)
+        ok = file:close() and ok
+
+        if (not ok or not os.rename(tempFileName, fileName)) then
+            os.remove(tempFileName)
+            return false
+        end
+
+        return true
+    end,
+
+-- private:
+    getFileName_ = function(self, signature)
+        return self.directory.."/"..api.hashString(signature)..".wccr"
+    end,
+}
+
+-- Done!
+return api
@@ -18,4 +18,43 @@ fi
 
 export LUA_PATH LUA_CPATH LD_LIBRARY_PATH
 
-luajit "$d/tests.lua" "$@"
+# NOTE: 'make bench' passes LJCLANG_SCRIPT=bench.lua to run the benchmarks in the same
+#  environment.
+if [ -n "$LJCLANG_SCRIPT" ]; then
+    exec luajit "$d/$LJCLANG_SCRIPT" "$@"
+fi
+
+# Translation units that the tests only inspect are parsed once and shared through this
+# directory (see GetSharedTU() in tests.lua).
+LJCLANG_TEST_AST_CACHE=`mktemp -d /tmp/ljclang_test_ast.XXXXXX` || exit 1
+export LJCLANG_TEST_AST_CACHE
+
+jobs=${TEST_JOBS:-1}
+
+if [ "$jobs" -le 1 ]; then
+    luajit "$d/tests.lua" "$@"
+    status=$?
+else
+    # Split the top-level test groups among <jobs> processes running in parallel. Their
+    # output is printed in order once all of them have finished.
+    pids=
+    i=1
+    while [ $i -le $jobs ]; do
+        LJCLANG_TEST_SHARD="$i/$jobs" luajit "$d/tests.lua" "$@" \
+            > "$LJCLANG_TEST_AST_CACHE/shard$i.log" 2>&1 &
+        pids="$pids $!"
+        i=$((i + 1))
+    done
+
+    status=0
+    i=1
+    for pid in $pids; do
+        wait $pid || status=1
+        echo "== Tests, part $i of $jobs"
+        cat "$LJCLANG_TEST_AST_CACHE/shard$i.log"
+        i=$((i + 1))
+    done
+fi
+
+rm -rf "$LJCLANG_TEST_AST_CACHE"
+exit $status
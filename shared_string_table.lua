@@ -0,0 +1,100 @@
+local ffi = require("ffi")
+
+local class = require("class").class
+local posix = require("posix")
+local linux_decls = require("ljclang_linux_decls")
+
+local error_util = require("error_util")
+local checktype = error_util.checktype
+local check = error_util.check
+
+local tonumber = tonumber
+
+----------
+
+ffi.cdef[[
+size_t ljclang_getStringTableSize(uint32_t maxStringCount, uint32_t arenaSize);
+void ljclang_initStringTable(void *mem, uint32_t maxStringCount, uint32_t arenaSize);
+uint32_t ljclang_internString(void *mem, const char *str, uint32_t length);
+uint32_t ljclang_findString(void *mem, const char *str, uint32_t length);
+const char *ljclang_getInternedString(void *mem, uint32_t id, uint32_t *length);
+]]
+
+local support = ffi.load("ljclang_support")
+
+local api = {}
+
+local uint32_array_t = ffi.typeof("uint32_t [1]")
+
+-- A table of strings that is shared between a process and the children it forks after
+-- having created it. Each string is assigned a positive integer id that is the same for
+-- all of these processes, so that ids can be exchanged in place of the strings.
+-- Strings are never removed.
+--
+-- <maxStringCount>: maximum number of strings.
+-- <arenaSize>: maximum total length of all strings, in bytes.
+--
+-- NOTE: the memory is reserved up front, but pages are only backed once they are touched.
+api.SharedStringTable = class
+{
+    function(maxStringCount, arenaSize)
+        checktype(maxStringCount, 1, "number", 2)
+        check(maxStringCount >= 1 and maxStringCount <= 2^30,
+              "argument #1 must be a number between 1 and 2^30", 2)
+        checktype(arenaSize, 2, "number", 2)
+        check(arenaSize >= 0 and arenaSize < 2^32,
+              "argument #2 must be a non-negative number less than 2^32", 2)
+
+        local PROT, MAP, LMAP = posix.PROT, posix.MAP, linux_decls.MAP
+
+        local size = support.ljclang_getStringTableSize(maxStringCount, arenaSize)
+        local voidPtr = posix.mmap(nil, size, PROT.READ + PROT.WRITE,
+                                   MAP.SHARED + LMAP.ANONYMOUS, -1, 0)
+        support.ljclang_initStringTable(voidPtr, maxStringCount, arenaSize)
+
+        return {
+            -- Need to retain the pointer as its GC triggers the munmap().
+            voidPtr_ = voidPtr,
+            -- Per-process cache: id -> Lua string.
+            strings_ = {},
+            length_ = uint32_array_t(),
+        }
+    end,
+
+    -- Returns the id of <str>, adding it to the table first if necessary, or nil if the
+    -- table is full.
+    intern = function(self, str)
+        checktype(str, 1, "string", 2)
+
+        local id = tonumber(support.ljclang_internString(self.voidPtr_, str, #str))
+        return (id ~= 0) and id or nil
+    end,
+
+    -- Returns the id of <str> if it is in the table, nil otherwise.
+    getId = function(self, str)
+        checktype(str, 1, "string", 2)
+
+        local id = tonumber(support.ljclang_findString(self.voidPtr_, str, #str))
+        return (id ~= 0) and id or nil
+    end,
+
+    -- Returns the string with id <id>, which must have been obtained from intern() in this
+    -- process or a related one.
+    getString = function(self, id)
+        checktype(id, 1, "number", 2)
+
+        local str = self.strings_[id]
+
+        if (str == nil) then
+            local ptr = support.ljclang_getInternedString(self.voidPtr_, id, self.length_)
+            check(ptr ~= nil, "argument #1 must be a valid string id", 2)
+            str = ffi.string(ptr, self.length_[0])
+            self.strings_[id] = str
+        end
+
+        return str
+    end,
+}
+
+-- Done!
+return api
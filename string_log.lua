@@ -0,0 +1,89 @@
+local io = require("io")
+
+local class = require("class").class
+
+local error_util = require("error_util")
+local check = error_util.check
+local checktype = error_util.checktype
+
+local assert = assert
+local pairs = pairs
+
+----------
+
+local api = {}
+
+local function openFile()
+    local file = io.tmpfile()
+    check(file ~= nil, "failed creating temporary file", 3)
+    -- NOTE: the file must be unbuffered. Otherwise, a child forked while data is still
+    --  buffered would write it to the (shared) file a second time on exit, invalidating
+    --  the handles of all later entries.
+    assert(file:setvbuf("no"))
+    return file
+end
+
+-- An append-only log of strings in an anonymous temporary file, so that they do not need
+-- to be kept in memory. An entry is referred to by a handle { <offset>, <length> }.
+--
+-- NOTE: it may be created before forking, but only the creating process may use it.
+api.StringLog = class
+{
+    function()
+        return {
+            file = openFile(),
+            length = 0,
+        }
+    end,
+
+    -- Appends <str>. Returns its handle.
+    append = function(self, str)
+        checktype(str, 1, "string", 2)
+
+        local handle = { self.length, #str }
+        assert(self.file:seek("end") == self.length)
+        assert(self.file:write(str))
+        self.length = self.length + #str
+
+        return handle
+    end,
+
+    -- Returns the string for <handle>.
+    read = function(self, handle)
+        if (handle[2] == 0) then
+            return ""
+        end
+
+        self.file:seek("set", handle[1])
+        local str = self.file:read(handle[2])
+        assert(str ~= nil and #str == handle[2])
+        return str
+    end,
+
+    -- Rewrites the log with only the entries whose handles are the values of the table
+    -- <handles>, which are updated. Only done if other entries make up most of the log.
+    compact = function(self, handles)
+        local liveLength = 0
+        for _, handle in pairs(handles) do
+            liveLength = liveLength + handle[2]
+        end
+
+        if (self.length < api.StringLog.MinCompactLength or 2 * liveLength > self.length) then
+            return
+        end
+
+        local newLog = api.StringLog()
+
+        for key, handle in pairs(handles) do
+            handles[key] = newLog:append(self:read(handle))
+        end
+
+        self.file:close()
+        self.file, self.length = newLog.file, newLog.length
+    end,
+}
+
+api.StringLog.MinCompactLength = 2^24
+
+-- Done!
+return api
@@ -1,5 +1,8 @@
 
+local bit = require("bit")
 local ffi = require("ffi")
+local math = require("math")
+local table = require("table")
 
 local class = require("class").class
 local posix = require("posix")
@@ -10,12 +13,20 @@ local checktype = error_util.checktype
 local check = error_util.check
 
 local assert = assert
+local ipairs = ipairs
 local tonumber = tonumber
 
 ----------
 
 local api = {
-    EntriesPerPage = nil  -- set below
+    EntriesPerPage = nil,  -- set below
+
+    -- How a symbol is used, see 'extFlags' below.
+    UseFlags = {
+        Declaration = 1,
+        Definition = 2,
+        Reference = 4,
+    },
 }
 
 local SymbolInfo = ffi.typeof[[struct {
@@ -32,11 +43,60 @@ end)()
 
 local SymbolInfoPagePtr = ffi.typeof("$ *", SymbolInfoPage)
 
+-- Layout of the SymbolInfo flags:
+--  intFlags: bits 0-31: id of the USR of the symbol,
+--            bits 32-63: id of the name of the symbol
+--   (with ids of a SharedStringTable; zero means that the entry is unused),
+--  extFlags: bits 0-31: index of the compile command in which the symbol is used,
+--            bits 32-39: bitwise OR of UseFlags,
+--            bits 40-55: cursor kind of the declaration of the symbol.
+
+local uint64_t = ffi.typeof("uint64_t")
+
+function api.packIntFlags(usrId, nameId)
+    return bit.bor(bit.lshift(uint64_t(nameId), 32), usrId)
+end
+
+-- Returns <usrId>, <nameId>.
+function api.unpackIntFlags(intFlags)
+    return tonumber(bit.band(intFlags, 0xffffffff)), tonumber(bit.rshift(intFlags, 32))
+end
+
+function api.packExtFlags(ccIdx, useFlags, cursorKind)
+    return bit.bor(bit.lshift(uint64_t(cursorKind), 40), bit.lshift(uint64_t(useFlags), 32), ccIdx)
+end
+
+-- Returns <ccIdx>, <useFlags>, <cursorKind>.
+function api.unpackExtFlags(extFlags)
+    return tonumber(bit.band(extFlags, 0xffffffff)),
+        tonumber(bit.band(bit.rshift(extFlags, 32), 0xff)),
+        tonumber(bit.band(bit.rshift(extFlags, 40), 0xffff))
+end
+
 local MaxSymPages = {
     Local = (ffi.abi("64bit") and 1*2^30 or 128*2^20) / ffi.sizeof(SymbolInfoPage),
     Global = (ffi.abi("64bit") and 4*2^30 or 512*2^20) / ffi.sizeof(SymbolInfoPage),
 }
 
+-- Writes the sequence <symbolInfos> of { <intFlags>, <extFlags> } pairs to consecutive
+-- entries of the pages getPage(1), getPage(2), ..., clearing the remainder of the last one.
+local function writeEntries(getPage, symbolInfos)
+    local entriesPerPage = api.EntriesPerPage
+
+    for i, symbolInfo in ipairs(symbolInfos) do
+        local page = getPage(math.floor((i - 1) / entriesPerPage) + 1)
+        local entry = page[(i - 1) % entriesPerPage]
+        entry.intFlags = symbolInfo[1]
+        entry.extFlags = symbolInfo[2]
+    end
+
+    local usedInLastPage = #symbolInfos % entriesPerPage
+    if (usedInLastPage > 0) then
+        ffi.fill(getPage(math.ceil(#symbolInfos / entriesPerPage)) + usedInLastPage,
+                 (entriesPerPage - usedInLastPage) * ffi.sizeof(SymbolInfo))
+    end
+end
+
 api.SymbolIndex = class
 {
     function(localPageArrayCount)
@@ -60,18 +120,134 @@ api.SymbolIndex = class
                 MaxSymPages.Local, MAP.SHARED + LMAP.ANONYMOUS, voidPtrs)
         end
 
+        local nextLocalPageIdxs = {}
+        for i = 1, localPageArrayCount do
+            nextLocalPageIdxs[i] = 0
+        end
+
         return {
             globalPageArray = requestSymPages(
                 MaxSymPages.Global, MAP.PRIVATE + LMAP.ANONYMOUS, voidPtrs),
             localPageArrays = localPageArrays,
             voidPtrs_ = voidPtrs,
+
+            -- Each local page is written to only once, since after having been remapped to
+            -- the global page array, it may still be shared with the (forked) process that
+            -- wrote it.
+            -- [<localPageArrayIdx>] = <index of the first local page not used yet>
+            nextLocalPageIdxs = nextLocalPageIdxs,
+
+            -- Number of global pages handed out so far, and a stack of the indexes of those
+            -- that have been released again.
+            globalPageCount = 0,
+            freeGlobalPageIdxs = {},
         }
     end,
 
+    -- Stores the sequence <symbolInfos> of { <intFlags>, <extFlags> } pairs into local
+    -- pages of array #<localPageArrayIdx> that have not been used yet. Returns the index of
+    -- the first page and the page count, or nil if there are not enough pages left.
+    storeLocal = function(self, localPageArrayIdx, symbolInfos)
+        self:checkLocalPageArrayIdx_(localPageArrayIdx)
+        checktype(symbolInfos, 2, "table", 2)
+
+        local entriesPerPage = api.EntriesPerPage
+        local firstPageIdx = self.nextLocalPageIdxs[localPageArrayIdx]
+        local pageCount = math.ceil(#symbolInfos / entriesPerPage)
+
+        if (firstPageIdx + pageCount > MaxSymPages.Local) then
+            return nil
+        end
+
+        local pages = self.localPageArrays[localPageArrayIdx] + firstPageIdx
+        -- NOTE: clearing the remainder of the last page is necessary since a process that
+        --  has written to it before may not have had its pages taken over.
+        writeEntries(function(i) return pages[i - 1] end, symbolInfos)
+
+        self.nextLocalPageIdxs[localPageArrayIdx] = firstPageIdx + pageCount
+        return firstPageIdx, pageCount
+    end,
+
+    -- Moves (without copying) <pageCount> pages of local page array #<localPageArrayIdx>,
+    -- starting with page <firstPageIdx>, to unused pages of the global page array. Returns
+    -- the sequence of the global page indexes, or nil if not enough of them are left.
+    moveLocalPagesToGlobal = function(self, localPageArrayIdx, firstPageIdx, pageCount)
+        self:checkLocalPageArrayIdx_(localPageArrayIdx)
+        checktype(firstPageIdx, 2, "number", 2)
+        checktype(pageCount, 3, "number", 2)
+        check(firstPageIdx >= 0 and pageCount >= 0 and
+                  firstPageIdx + pageCount <= MaxSymPages.Local,
+              "arguments #2 and #3 must denote a valid range of local pages", 2)
+
+        local globalPageIdxs = self:allocateGlobalPages_(pageCount)
+        if (globalPageIdxs == nil) then
+            return nil
+        end
+
+        for i, globalPageIdx in ipairs(globalPageIdxs) do
+            self:remapLocalToGlobalPage(localPageArrayIdx, firstPageIdx + i - 1, globalPageIdx)
+        end
+
+        local nextIdxs = self.nextLocalPageIdxs
+        nextIdxs[localPageArrayIdx] = math.max(nextIdxs[localPageArrayIdx],
+                                               firstPageIdx + pageCount)
+        return globalPageIdxs
+    end,
+
+    -- Stores the sequence <symbolInfos> (see storeLocal()) directly into unused pages of
+    -- the global page array. Returns the sequence of the global page indexes, or nil if
+    -- not enough of them are left.
+    storeGlobal = function(self, symbolInfos)
+        checktype(symbolInfos, 1, "table", 2)
+
+        local globalPageIdxs = self:allocateGlobalPages_(
+            math.ceil(#symbolInfos / api.EntriesPerPage))
+
+        if (globalPageIdxs ~= nil) then
+            local pages = self.globalPageArray
+            writeEntries(function(i) return pages[globalPageIdxs[i]] end, symbolInfos)
+        end
+
+        return globalPageIdxs
+    end,
+
+    -- Returns the sequence of { <intFlags>, <extFlags> } pairs stored in the global pages
+    -- with indexes in the sequence <globalPageIdxs>.
+    readGlobal = function(self, globalPageIdxs)
+        checktype(globalPageIdxs, 1, "table", 2)
+
+        local pages = self.globalPageArray
+        local symbolInfos = {}
+
+        for _, pageIdx in ipairs(globalPageIdxs) do
+            local page = pages[pageIdx]
+
+            for i = 0, api.EntriesPerPage - 1 do
+                if (page[i].intFlags == 0) then
+                    -- Unused entry: the remaining ones on the page are unused, too.
+                    break
+                end
+
+                symbolInfos[#symbolInfos + 1] = { page[i].intFlags, page[i].extFlags }
+            end
+        end
+
+        return symbolInfos
+    end,
+
+    -- Makes the global pages with indexes in the sequence <globalPageIdxs> available again
+    -- to moveLocalPagesToGlobal() and storeGlobal().
+    releaseGlobalPages = function(self, globalPageIdxs)
+        checktype(globalPageIdxs, 1, "table", 2)
+
+        local freeIdxs = self.freeGlobalPageIdxs
+        for _, globalPageIdx in ipairs(globalPageIdxs) do
+            freeIdxs[#freeIdxs + 1] = globalPageIdx
+        end
+    end,
+
     remapLocalToGlobalPage = function(self, localPageArrayIdx, srcPageIdx, globalPageIdx)
-        checktype(localPageArrayIdx, 1, "number", 2)
-        check(localPageArrayIdx >= 1 and localPageArrayIdx <= #self.localPageArrays,
-              "argument #1 must be a valid local page array index" ,2)
+        self:checkLocalPageArrayIdx_(localPageArrayIdx)
 
         checktype(srcPageIdx, 2, "number", 2)
         check(srcPageIdx >= 0 and srcPageIdx < MaxSymPages.Local,
@@ -85,6 +261,36 @@ api.SymbolIndex = class
             self:getGlobalPageArrayVoidPtr(), globalPageIdx)
     end,
 
+-- private:
+    -- Returns a sequence of <pageCount> unused global page indexes, marking them as used,
+    -- or nil if not enough of them are left.
+    allocateGlobalPages_ = function(self, pageCount)
+        local freeIdxs = self.freeGlobalPageIdxs
+        if (#freeIdxs + (MaxSymPages.Global - self.globalPageCount) < pageCount) then
+            return nil
+        end
+
+        local globalPageIdxs = {}
+
+        for i = 1, pageCount do
+            local globalPageIdx = table.remove(freeIdxs)
+            if (globalPageIdx == nil) then
+                globalPageIdx = self.globalPageCount
+                self.globalPageCount = globalPageIdx + 1
+            end
+
+            globalPageIdxs[i] = globalPageIdx
+        end
+
+        return globalPageIdxs
+    end,
+
+    checkLocalPageArrayIdx_ = function(self, localPageArrayIdx)
+        checktype(localPageArrayIdx, 1, "number", 3)
+        check(localPageArrayIdx >= 1 and localPageArrayIdx <= #self.localPageArrays,
+              "argument #1 must be a valid local page array index", 3)
+    end,
+
 -- private, KEEPINSYNC with how self.voidPtrs_ is set up:
     getLocalPageArrayVoidPtr = function(self, localPageArrayIdx)
         return self.voidPtrs_[localPageArrayIdx]
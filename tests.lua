@@ -3,22 +3,30 @@
 -- NOTE: on Raspbian, we need to require ljclang before busted, otherwise we get
 --  error "wrong number of type parameters" for ffi.cdef 'typedef enum CXChildVisitResult'.
 local cl = require("ljclang")
+local ASTCache = require("ast_cache").ASTCache
+local compile_commands_reader = require("compile_commands_reader")
+local diagnostics_util = require("diagnostics_util")
+local inclusion_graph = require("inclusion_graph")
 local linux_decls = require("ljclang_linux_decls")
 local llvm_libdir_include = require("llvm_libdir_include")[1]
 local posix = require("posix")
+local ResultCache = require("result_cache").ResultCache
+local SharedStringTable = require("shared_string_table").SharedStringTable
+local StringLog = require("string_log").StringLog
 local symbol_index = require("symbol_index")
 local SymbolIndex = symbol_index.SymbolIndex
 
 require 'busted.runner'()
 
 local assert = assert
-local describe = describe
+local busted_describe = describe
 local it = it
 
 local collectgarbage = collectgarbage
 local ipairs = ipairs
 local rawequal = rawequal
 local type = type
+local tonumber = tonumber
 local tostring = tostring
 local unpack = unpack
 
@@ -41,6 +49,45 @@ assert(io.open(nonExistentFileName) == nil)
 
 local arg0 = arg[0]
 
+---------- Running in parallel
+
+-- With LJCLANG_TEST_SHARD=<i>/<n> (set by run_tests.sh with TEST_JOBS=<n>), only every
+-- <n>-th top-level test group, starting with the <i>-th one, is run by this process.
+local ShardIdx, ShardCount = (os.getenv("LJCLANG_TEST_SHARD") or ""):match("^(%d+)/(%d+)$")
+ShardIdx, ShardCount = tonumber(ShardIdx), tonumber(ShardCount)
+
+local topLevelGroupCount = 0
+local describeDepth = 0
+
+local function isTopLevelGroupInShard()
+    topLevelGroupCount = topLevelGroupCount + 1
+    return (ShardCount == nil or (topLevelGroupCount - 1) % ShardCount == ShardIdx - 1)
+end
+
+local function describe(title, func)
+    if (describeDepth == 0 and not isTopLevelGroupInShard()) then
+        return
+    end
+
+    busted_describe(title, function()
+        describeDepth = describeDepth + 1
+        func()
+        describeDepth = describeDepth - 1
+    end)
+end
+
+-- Runs <func> with the top-level test groups it creates being treated as one, so that
+-- they end up in the same shard.
+local function asOneGroup(func)
+    if (describeDepth == 0 and not isTopLevelGroupInShard()) then
+        return
+    end
+
+    describeDepth = describeDepth + 1
+    func()
+    describeDepth = describeDepth - 1
+end
+
 ----------
 
 --== posix.lua
@@ -65,6 +112,16 @@ describe("posix.lua", function()
         assert.is_true(haveFile["simple.hpp"])
     end)
 
+    it("tests getModificationTime", function()
+        local mtime = posix.getModificationTime("test_data/simple.hpp")
+        assert.is_true(type(mtime) == "number")
+        assert.is_true(mtime > 0 and mtime <= os.time())
+
+        local noTime, errorString = posix.getModificationTime("test_data/nonexistent.hpp")
+        assert.is_nil(noTime)
+        assert.is_true(type(errorString) == "string")
+    end)
+
     it("tests fd_set_t", function()
         local MaxFdToTest = 65
         local FdsToTest = { 7, 8+1, 16+2, 24+3, 31, 32, 33, 63, 64, MaxFdToTest }
@@ -253,12 +310,458 @@ local function testSymbolIndex()
         symIndex = nil
         collectgarbage()
     end)
+
+    it("tests taking over symbol pages stored by the child", function()
+        local symIndex = SymbolIndex(LocalPageArrayCount)
+        local EntryCount = symbol_index.EntriesPerPage + 3
+        local UseFlags = symbol_index.UseFlags
+
+        local symbolInfos = {}
+        for i = 1, EntryCount do
+            symbolInfos[i] = {
+                symbol_index.packIntFlags(i, 2^32 - i),
+                symbol_index.packExtFlags(RefNum, UseFlags.Definition, 0xffff),
+            }
+        end
+
+        local whoami, pid = posix.fork()
+
+        if (whoami == "child") then
+            local firstPageIdx, pageCount = symIndex:storeLocal(LocalPageArrayIdx, symbolInfos)
+            os.exit((firstPageIdx == 0 and pageCount == 2) and 0 or 1)
+        end
+
+        local status, exitCode = posix.waitpid(pid, 0)
+        assert.is_equal(status, "exited")
+        assert.is_equal(exitCode, 0)
+
+        local globalPageIdxs = symIndex:moveLocalPagesToGlobal(LocalPageArrayIdx, 0, 2)
+        assert.is_same(globalPageIdxs, { 0, 1 })
+        assert.is_equal(symIndex.nextLocalPageIdxs[LocalPageArrayIdx], 2)
+
+        local lastEntry = symIndex.globalPageArray[1][2]
+        local usrId, nameId = symbol_index.unpackIntFlags(lastEntry.intFlags)
+        local ccIdx, useFlags, kind = symbol_index.unpackExtFlags(lastEntry.extFlags)
+        assert.is_same({ usrId, nameId }, { EntryCount, 2^32 - EntryCount })
+        assert.is_same({ ccIdx, useFlags, kind }, { RefNum, UseFlags.Definition, 0xffff })
+        assert.is_true(symIndex.globalPageArray[1][3].intFlags == 0)
+
+        -- Released global pages are reused.
+        symIndex:releaseGlobalPages(globalPageIdxs)
+        local firstPageIdx, pageCount = symIndex:storeLocal(LocalPageArrayIdx, { symbolInfos[1] })
+        assert.is_same({ firstPageIdx, pageCount }, { 2, 1 })
+        assert.is_same(symIndex:moveLocalPagesToGlobal(LocalPageArrayIdx, 2, 1), { 1 })
+
+        -- Storing directly into global pages.
+        local storedPageIdxs = symIndex:storeGlobal(symbolInfos)
+        assert.is_same(storedPageIdxs, { 0, 2 })
+        local readInfos = symIndex:readGlobal(storedPageIdxs)
+        assert.is_equal(#readInfos, EntryCount)
+        assert.is_true(readInfos[EntryCount][1] == symbolInfos[EntryCount][1])
+        assert.is_true(readInfos[EntryCount][2] == symbolInfos[EntryCount][2])
+
+        symIndex = nil
+        collectgarbage()
+    end)
 end
 
 if (jit.arch ~= "arm64") then
     describe("Symbol index", testSymbolIndex)
 end
 
+describe("Shared string table", function()
+    it("tests interning and lookup", function()
+        local stringTable = SharedStringTable(3, 16)
+        local aId = stringTable:intern("/a.hpp")
+        local bId = stringTable:intern("/b.hpp")
+
+        assert.is_not_equal(aId, bId)
+        assert.is_equal(stringTable:intern("/a.hpp"), aId)
+        assert.is_equal(stringTable:getString(aId), "/a.hpp")
+        assert.is_equal(stringTable:getString(bId), "/b.hpp")
+
+        -- Exceeds the arena size:
+        assert.is_nil(stringTable:intern("/too_long.hpp"))
+        assert.is_not_nil(stringTable:intern(""))
+        -- Exceeds the string count:
+        assert.is_nil(stringTable:intern("/c"))
+
+        assert.has_error(function() stringTable:getString(0) end)
+        assert.has_error(function() stringTable:getString(4) end)
+    end)
+
+    it("tests that the parent can look up a string interned by the child", function()
+        local stringTable = SharedStringTable(16, 256)
+        local aId = stringTable:intern("/a.hpp")
+
+        local whoami, pid = posix.fork()
+
+        if (whoami == "child") then
+            local ok = (stringTable:intern("/a.hpp") == aId)
+            local bId = stringTable:intern("/b.hpp")
+            os.exit(ok and bId or 255)
+        else
+            local status, bId = posix.waitpid(pid, 0)
+            assert.is_equal(status, "exited")
+            assert.is_not_equal(bId, 255)
+            assert.is_equal(stringTable:getString(bId), "/b.hpp")
+            assert.is_equal(stringTable:intern("/b.hpp"), bId)
+        end
+    end)
+end)
+
+describe("String log", function()
+    it("tests appending and reading across a fork", function()
+        local log = StringLog()
+        local aHandle = log:append("first entry")
+        local emptyHandle = log:append("")
+
+        -- NOTE: the child's exit must not write data appended before the fork a second time.
+        io.stdout:flush()
+        io.stderr:flush()
+        local whoami, pid = posix.fork()
+
+        if (whoami == "child") then
+            os.exit(0)
+        else
+            local status, exitCode = posix.waitpid(pid, 0)
+            assert.is_equal(status, "exited")
+            assert.is_equal(exitCode, 0)
+        end
+
+        local bHandle = log:append("second")
+        assert.is_equal(log:read(bHandle), "second")
+        assert.is_equal(log:read(aHandle), "first entry")
+        assert.is_equal(log:read(emptyHandle), "")
+        assert.is_equal(log.file:seek("end"), log.length)
+    end)
+end)
+
+--== Serialization of results sent from watch_compile_commands.lua children
+
+describe("Compile commands reader", function()
+    local parse = compile_commands_reader.parse_compile_commands
+
+    it("tests parsing entries with 'arguments'", function()
+        local cmds = parse([=[
+[
+  {
+    "arguments": [ "c++", "-DS=\"a\\b\"", "-Iinc", "-c", "src/ä.cpp" ],
+    "directory": "/build",
+    "file": "src/ä.cpp",
+    "output": "a.o"
+  },
+  { "arguments": ["cc", "b.c"], "directory": "/build", "file": "/b.c" }
+]
+]=])
+        assert.is_equal(#cmds, 2)
+        assert.is_equal(cmds[1].file, "/build/src/\195\164.cpp")
+        assert.is_equal(cmds[1].compiler_executable, "c++")
+        assert.is_same(cmds[1].arguments, { '-DS="a\\b"', "-I/build/inc", cmds[1].file })
+        assert.is_equal(cmds[1].fileNameIdx, 3)
+        assert.is_equal(cmds[2].file, "/b.c")
+    end)
+
+    it("tests parsing entries with 'command'", function()
+        local cmds = parse('[{"command": "cc -c x.c", "directory": "/d", "file": "x.c"}]')
+        assert.is_equal(#cmds, 1)
+        assert.is_same(cmds[1].arguments, { "/d/x.c" })
+        assert.is_equal(cmds[1].compiler_executable, "cc")
+    end)
+
+    it("tests invalid input", function()
+        assert.is_same(parse(" [ ] \n"), {})
+
+        local InvalidInputs = {
+            "", "{}", "[", "[{}]", '[{"file": "x.c"}]', "[1,]", "[] []",
+            '[{"command": "cc x.c", "directory": "/d", "file": "x.c"',
+            '[{"arguments": ["cc", "x.c"], "command": "cc x.c", "directory": "/d", "file": "x.c"}]',
+            '[{"arguments": ["cc", "x.c"], "directory": "/d", "file": "x.c\\q"}]',
+        }
+
+        for _, input in ipairs(InvalidInputs) do
+            local cmds, errmsg = parse(input)
+            assert.is_nil(cmds)
+            assert.is_true(type(errmsg) == "string")
+        end
+    end)
+end)
+
+describe("Result cache", function()
+    it("tests storing and looking up results", function()
+        local cache = ResultCache("/tmp")
+        local fileName = os.tmpname()
+
+        local writeFile = function(contents)
+            local f = io.open(fileName, "w")
+            f:write(contents)
+            f:close()
+        end
+
+        writeFile("int i;")
+
+        local signature = "ljclang test "..fileName
+        local symbols = { { "c:@i", "i", 2, 9 } }
+
+        -- Results computed before the file was last modified are not stored.
+        assert.is_false(cache:store(signature, { fileName }, "D", "G", symbols, os.time() - 60))
+        assert.is_nil(cache:lookup(signature))
+
+        assert.is_true(cache:store(signature, { fileName }, "D", "G", symbols, os.time() + 1))
+        local diagsStr, graphStr, gotSymbols = cache:lookup(signature)
+        assert.is_equal(diagsStr, "D")
+        assert.is_equal(graphStr, "G")
+        assert.is_same(gotSymbols, symbols)
+        assert.is_nil(cache:lookup(signature.."x"))
+
+        -- A change of the contents invalidates the entry.
+        writeFile("int j;")
+        assert.is_nil(cache:lookup(signature))
+
+        os.remove(fileName)
+        os.remove(cache:getFileName_(signature))
+    end)
+end)
+
+describe("AST cache", function()
+    it("tests loading translation units from the cache", function()
+        local dirName = os.tmpname()
+        assert(os.remove(dirName))
+        assert(os.execute("/bin/mkdir '"..dirName.."'") == 0)
+
+        local cache = ASTCache(dirName)
+        local fileName = dirName.."/test.cpp"
+
+        local writeFile = function(contents, mtime)
+            local f = io.open(fileName, "w")
+            f:write(contents)
+            f:close()
+            assert(os.execute(string.format("touch -d @%d '%s'", mtime, fileName)) == 0)
+        end
+
+        local parse = function()
+            local tu, errorCode, diags, wasLoaded = cache:parse(
+                cl.createIndex(), fileName, { "-std=c++14" })
+            assert.are.equal(errorCode, cl.ErrorCode.Success)
+            assert.is_equal(tu:cursor():children()[1]:name(), "f")
+            -- The diagnostics survive the round trip.
+            assert.is_equal(#diags, 1)
+            assert.is_equal(diags[1][1], "warning")
+            return wasLoaded
+        end
+
+        writeFile("int f() {}\n", os.time() - 60)
+        assert.is_false(parse())
+        assert.is_true(parse())
+        assert.is_same(cache:getFileNames(fileName, { "-std=c++14" }), { fileName })
+
+        -- A modification invalidates the entry.
+        writeFile("int f() { return 1; }\nint g() {}\n", os.time() - 30)
+        assert.is_false(parse())
+        assert.is_true(parse())
+
+        -- A translation unit parsed from a file modified since its start is not stored.
+        writeFile("int f() {}\n", os.time() + 60)
+        assert.is_false(parse())
+        assert.is_false(parse())
+        assert.is_nil(cache:getFileNames(fileName, { "-std=c++14" }))
+
+        os.execute("/bin/rm -rf '"..dirName.."'")
+    end)
+end)
+
+---------- Running the tools
+
+-- Runs the shell command <cmdLine> and returns its standard output and standard error
+-- combined, as well as its exit code.
+local function RunCommand(cmdLine)
+    local pipe = assert(io.popen(cmdLine..' 2>&1; echo "EXIT:$?"'))
+    local output = pipe:read("*a")
+    pipe:close()
+
+    local text, exitCode = output:match("^(.*)EXIT:(%d+)\n$")
+    return text, tonumber(exitCode)
+end
+
+-- Creates a new temporary directory with a compile_commands.json that compiles each of the
+-- files in <fileNames> (relative to the current directory) as C++14. Returns the name of
+-- the directory.
+local function CreateCompileCommands(fileNames)
+    local dirName = os.tmpname()
+    assert(os.remove(dirName))
+    assert(os.execute("/bin/mkdir '"..dirName.."'") == 0)
+
+    local cwd = posix.realpath(".")
+    local entries = {}
+
+    for i, fileName in ipairs(fileNames) do
+        local absFileName = cwd.."/"..fileName
+        entries[i] = string.format(
+            '{ "directory": "%s", "arguments": ["c++", "-std=c++14", "-c", "%s"], '..
+                '"file": "%s" }', cwd, absFileName, absFileName)
+    end
+
+    local f = assert(io.open(dirName.."/compile_commands.json", "w"))
+    f:write("[\n"..table.concat(entries, ",\n").."\n]\n")
+    f:close()
+
+    return dirName
+end
+
+describe("Running the tools", function()
+    it("tests processing compile commands with watch_compile_commands -x", function()
+        local dirName = CreateCompileCommands({ "test_data/simple.hpp" })
+        local output, exitCode = RunCommand(
+            "luajit ./watch_compile_commands.lua -x -P -c 1 '"..dirName..
+                "/compile_commands.json'")
+        os.execute("/bin/rm -rf '"..dirName.."'")
+
+        assert.is_equal(exitCode, 0)
+        assert.is_truthy(output:find("Processed 1 compile command in", 1, true))
+    end)
+
+    it("tests searching member accesses with mgrep", function()
+        local expectedLine = "test_data/simple.hpp:16:     return f.a;\n"
+
+        local output, exitCode = RunCommand(
+            "luajit ./mgrep.lua First::a -q --no-color -c 1 -O '-std=c++14' "..
+                "test_data/simple.hpp")
+        assert.is_equal(exitCode, 0)
+        assert.is_equal(output, expectedLine)
+
+        -- Through a compilation database, file names are absolute and are printed relative
+        -- to the current directory.
+        local dirName = CreateCompileCommands({ "test_data/simple.hpp" })
+        output, exitCode = RunCommand(
+            "luajit ./mgrep.lua First::a -q --no-color -d '"..dirName..
+                "/compile_commands.json'")
+        os.execute("/bin/rm -rf '"..dirName.."'")
+
+        assert.is_equal(exitCode, 0)
+        assert.is_equal(output, "./"..expectedLine)
+
+        output, exitCode = RunCommand(
+            "luajit ./mgrep.lua First::nonexistent -q -c 1 test_data/simple.hpp")
+        assert.is_equal(exitCode, 0)
+        assert.is_equal(output, "")
+    end)
+end)
+
+describe("Serialization", function()
+    it("tests an inclusion graph round trip", function()
+        local graph = inclusion_graph.InclusionGraph()
+        graph:addInclusion("/a.hpp", "/b.cpp")
+        graph:addInclusion("/a.hpp", "/c.cpp")
+        graph:addInclusion("/b.hpp", "/c.cpp")
+
+        local serialized = graph:serialize()
+        local newGraph = inclusion_graph.Deserialize(serialized)
+
+        assert.is_equal(newGraph:getNodeCount(), 4)
+        assert.is_equal(newGraph:getNode("/a.hpp"):getEdgeCount(), 2)
+        assert.is_equal(newGraph:getNode("/c.cpp"):getEdgeCount(), 0)
+        assert.is_equal(newGraph:serialize(), serialized)
+
+        local emptyGraph = inclusion_graph.Deserialize(inclusion_graph.InclusionGraph():serialize())
+        assert.is_equal(emptyGraph:getNodeCount(), 0)
+
+        assert.has_error(function() inclusion_graph.Deserialize(serialized.."x") end)
+        assert.has_error(function() inclusion_graph.Deserialize(serialized:sub(1, -2)) end)
+    end)
+
+    it("tests an inclusion graph round trip using file ids", function()
+        local graph = inclusion_graph.InclusionGraph()
+        graph:addInclusion("/a.hpp", "/b.cpp")
+        graph:addInclusion("/b.hpp", "/b.cpp")
+
+        local stringTable = SharedStringTable(16, 256)
+        local serialized = graph:serialize(stringTable)
+        assert.is_true(#serialized < #graph:serialize())
+
+        local newGraph = inclusion_graph.Deserialize(serialized, stringTable)
+        assert.is_equal(newGraph:getNodeCount(), 3)
+        assert.is_equal(newGraph:getNode("/b.hpp"):getEdgeCount(), 1)
+        assert.is_equal(newGraph:serialize(), graph:serialize())
+
+        assert.has_error(function() inclusion_graph.Deserialize(serialized) end)
+
+        -- A full table makes us fall back to serializing the names.
+        local fullTable = SharedStringTable(1, 256)
+        assert.is_equal(graph:serialize(fullTable), graph:serialize())
+    end)
+
+    it("tests a frozen inclusion graph and the reverse dependency index", function()
+        local graph = inclusion_graph.InclusionGraph()
+        graph:addInclusion("/a.hpp", "/b.cpp")
+        graph:addInclusion("/a.hpp", "/c.cpp")
+        graph:addInclusion("/b.hpp", "/c.cpp")
+
+        local stringTable = SharedStringTable(16, 256)
+        local frozenGraph = inclusion_graph.DeserializeFrozen(graph:serialize(), stringTable)
+        assert.is_equal(frozenGraph:getNodeCount(), 4)
+        assert.is_equal(frozenGraph:getNode("/a.hpp"):getEdgeCount(), 2)
+        assert.is_equal(frozenGraph:getNode("/c.cpp"):getEdgeCount(), 0)
+        assert.is_nil(frozenGraph:getNode("/d.cpp"))
+
+        local mergedGraph = inclusion_graph.InclusionGraph()
+        mergedGraph:merge(frozenGraph)
+        assert.is_equal(mergedGraph:serialize(), graph:serialize())
+        assert.is_equal(frozenGraph:serialize(), graph:serialize())
+
+        -- Ids referring to one table are translated to another one.
+        local otherTable = SharedStringTable(16, 256)
+        local refrozenGraph = inclusion_graph.DeserializeFrozen(
+            frozenGraph:serialize(stringTable), otherTable, stringTable)
+        assert.is_equal(refrozenGraph:serialize(), graph:serialize())
+        assert.is_not_nil(otherTable:getId("/b.hpp"))
+
+        local otherGraph = inclusion_graph.InclusionGraph()
+        otherGraph:addInclusion("/b.hpp", "/d.cpp")
+        local frozenOtherGraph = inclusion_graph.DeserializeFrozen(
+            otherGraph:serialize(stringTable), stringTable)
+
+        local CcCount = 40
+        local reverseDeps = inclusion_graph.ReverseDependencyIndex(CcCount)
+        local id = function(fileName) return stringTable:getId(fileName) end
+
+        reverseDeps:setGraph(3, frozenGraph)
+        reverseDeps:setGraph(CcCount, frozenOtherGraph)
+        assert.is_same(reverseDeps:getCcIdxs({ id("/a.hpp") }), { 3 })
+        assert.is_same(reverseDeps:getCcIdxs({ id("/b.hpp") }), { 3, CcCount })
+        assert.is_same(reverseDeps:getCcIdxs({ id("/a.hpp"), id("/d.cpp") }), { 3, CcCount })
+        assert.is_same(reverseDeps:getCcIdxs({}), {})
+
+        reverseDeps:setGraph(3, frozenOtherGraph)
+        assert.is_same(reverseDeps:getCcIdxs({ id("/a.hpp") }), {})
+        assert.is_same(reverseDeps:getCcIdxs({ id("/d.cpp") }), { 3, CcCount })
+
+        reverseDeps:setGraph(CcCount, nil)
+        assert.is_same(reverseDeps:getCcIdxs({ id("/b.hpp") }), { 3 })
+    end)
+
+    it("tests a formatted diagnostic set round trip", function()
+        local fDiagSet = diagnostics_util.FormattedDiagSet(false)
+        local fDiag = fDiagSet:newDiag("warning")
+        fDiag:addIndentedLine(0, "/a.cpp:1:2: warning: unused variable 'i'")
+        fDiag:addIndentedLine(2, "/a.cpp:1:1: note: declared here")
+        fDiagSet:appendDiag(fDiag)
+        fDiagSet:appendDiag(fDiagSet:newDiag("error"))
+        fDiagSet:setInfo("NOTE: omitting 1 following diagnostics.")
+
+        local newFDiagSet = diagnostics_util.FormattedDiagSet_Deserialize(
+            fDiagSet:serialize(), false)
+
+        assert.is_equal(#newFDiagSet:getDiags(), 2)
+        assert.is_equal(newFDiagSet:getDiags()[1]:getSeverity(), "warning")
+        assert.is_equal(newFDiagSet:getDiags()[2]:getSeverity(), "error")
+        assert.is_equal(newFDiagSet:getString(false), fDiagSet:getString(false))
+
+        local emptySet = diagnostics_util.FormattedDiagSet(false)
+        local newEmptySet = diagnostics_util.FormattedDiagSet_Deserialize(emptySet:serialize(), false)
+        assert.is_true(newEmptySet:isEmpty())
+    end)
+end)
+
 --== ljclang
 
 local CreateTUFuncs = {
@@ -277,13 +780,16 @@ local CreateTUFuncs = {
     end,
 }
 
+-- NOTE: both variants use the same temporary files, so they must not run in parallel.
 local function describe2(title, func)
-    for i, createTU in ipairs(CreateTUFuncs) do
-        local tag = (i == 1) and "direct" or "session"
-        describe(title.." ["..tag.."]", function()
-            func(createTU)
-        end)
-    end
+    asOneGroup(function()
+        for i, createTU in ipairs(CreateTUFuncs) do
+            local tag = (i == 1) and "direct" or "session"
+            describe(title.." ["..tag.."]", function()
+                func(createTU)
+            end)
+        end
+    end)
 end
 
 local clangOpts = { "-std=c++14", "-Wall", "-pedantic" }
@@ -299,6 +805,41 @@ local function GetTU(createTU, fileName,
     return tu
 end
 
+-- With LJCLANG_TEST_AST_CACHE=<directory> (set by run_tests.sh), translation units that
+-- are only inspected are parsed once per input and saved there. Later requests for the
+-- same input, also from other processes running tests in parallel, load the saved AST.
+local ASTCacheDirectory = os.getenv("LJCLANG_TEST_AST_CACHE")
+
+-- Like GetTU(), but with the "direct" variant, the translation unit may come from the AST
+-- cache. The expected diagnostic count is then only checked on parsing.
+-- NOTE: a given file must always be passed with the same <opts>.
+local function GetSharedTU(createTU, fileName, expectedDiagCount, opts)
+    if (ASTCacheDirectory == nil or createTU ~= CreateTUFuncs[1]) then
+        return GetTU(createTU, fileName, expectedDiagCount, opts)
+    end
+
+    local astFileName = ASTCacheDirectory.."/"..fileName:gsub("/", "_")..".ast"
+    local index = cl.createIndex()
+
+    local astFile = io.open(astFileName)
+
+    if (astFile ~= nil) then
+        astFile:close()
+        local tu, errorCode = index:loadTranslationUnit(astFileName)
+        assert.are.equal(errorCode, cl.ErrorCode.Success)
+        return tu
+    end
+
+    local tu = GetTU(createTU, fileName, expectedDiagCount, opts)
+
+    -- NOTE: save under a temporary name first, since other processes may load it any time.
+    local tempFileName = astFileName..".tmp"..tostring(C.getpid())
+    assert.are.equal(tu:save(tempFileName), cl.SaveError.None)
+    assert(os.rename(tempFileName, astFileName))
+
+    return tu
+end
+
 describe2("Attempting to parse a nonexistent file", function(createTU)
     local index = cl.createIndex()
     local tu, errorCode = createTU(index, nonExistentFileName, { "-std=c99" })
@@ -389,6 +930,25 @@ describe2("Loading a cpp file without includes", function(createTU)
             assert.is_string(diag:spelling())
         end)
 
+        it("tests formatting them with diagnostics_util", function()
+            local diags = tu:diagnosticSet()
+            local fDiagSet = diagnostics_util.GetDiags(diags, false, false)
+            assert.are.equal(#fDiagSet:getDiags(), 1)
+
+            local fDiag = fDiagSet:getDiags()[1]
+            assert.are.equal(fDiag:getString(false):match("^[^\n]*"),
+                             diags[1]:format().." ["..diags[1]:category().."]")
+
+            local coloredFDiagSet = diagnostics_util.GetDiags(diags, true, false)
+            assert.are.equal(coloredFDiagSet:getString(false), fDiagSet:getString(false))
+            assert.are.equal(coloredFDiagSet:getDiags()[1]:getKey(), fDiag:getKey())
+
+            local newFDiagSet = diagnostics_util.FormattedDiagSet_Deserialize(
+                fDiagSet:serialize(), false)
+            assert.are.equal(newFDiagSet:getString(false), fDiagSet:getString(false))
+            assert.are.equal(newFDiagSet:getDiags()[1]:getKey(), fDiag:getKey())
+        end)
+
         it("tests obtaining and discarding diagnostics many times", function()
             collectgarbage()
             local memInUseBefore = collectgarbage("count")
@@ -542,6 +1102,52 @@ describe2("Loading a cpp file without includes", function(createTU)
             assert.are.same(members, expectedMembers)
             assert.are.same(refQuals, expectedRefQuals)
         end)
+
+        it("tests cursor:collect()", function()
+            local all = tuCursor:collect()
+            local kinds = {}
+
+            for i = 0, #all - 1 do
+                local parentIdx = all.parentIndexes[i]
+
+                if (all.depths[i] == 1) then
+                    assert.is_equal(parentIdx, -1)
+                    kinds[#kinds + 1] = all.cursors[i]:kind()
+                else
+                    assert.is_true(parentIdx >= 0 and parentIdx < i)
+                    assert.is_equal(all.depths[parentIdx], all.depths[i] - 1)
+                end
+            end
+
+            assert.are.same(kinds, expectedKinds)
+
+            local selected = tuCursor:collect{ "StructDecl", "FieldDecl" }
+            local names, parentIdxs, depths = {}, {}, {}
+
+            for i = 0, #selected - 1 do
+                names[#names + 1] = selected.cursors[i]:name()
+                parentIdxs[#parentIdxs + 1] = selected.parentIndexes[i]
+                depths[#depths + 1] = selected.depths[i]
+            end
+
+            assert.are.same(names, { "First", "a", "b" })
+            assert.are.same(parentIdxs, { -1, 0, 0 })
+            assert.are.same(depths, { 1, 2, 2 })
+        end)
+
+        it("tests cursor:find()", function()
+            local found = tuCursor:find({ "FieldDecl", "VarDecl" }, "a")
+            assert.is_equal(#found, 1)
+            assert.is_true(found.cursors[0]:haskind("FieldDecl"))
+            assert.is_equal(found.depths[0], 2)
+
+            -- 'badFunc' -> CompoundStmt -> DeclStmt -> VarDecl 'i'
+            local varDecls = tuCursor:find({ "VarDecl" }, "i")
+            assert.is_equal(#varDecls, 1)
+            assert.is_equal(varDecls.depths[0], 4)
+            assert.is_equal(#tuCursor:find({ "VarDecl" }, "i", 3), 0)
+            assert.is_equal(#tuCursor:find({ "StructDecl" }, "Second"), 0)
+        end)
     end)
 end)
 
@@ -616,8 +1222,58 @@ describe2("Loading a file with includes", function(createTU)
     end)
 end)
 
+describe2("Reparsing a translation unit", function(createTU)
+    local fileName = "/tmp/ljclang_test_reparse.cpp"
+
+    it("tests that tu:reparse() picks up a modification", function()
+        writeToFile(fileName, "int a;")
+        local tu = GetTU(createTU, fileName)
+
+        writeToFile(fileName, "int b = c;")
+        local reparsedTU, errorCode = tu:reparse()
+        assert.are.equal(reparsedTU, tu)
+        assert.are.equal(errorCode, cl.ErrorCode.Success)
+
+        local diags = tu:diagnosticSet()
+        assert.are.equal(#diags, 1)
+        assert.are.equal(diags[1]:severity(), "error")
+    end)
+
+    it("tests that tu:memoizeStrings() does not change results, also across tu:reparse()",
+       function()
+        writeToFile(fileName, "int a; struct S { int m; };")
+        local tu = GetTU(createTU, fileName)
+
+        local getStrings = function()
+            local cursorArray = tu:cursor():collect()
+            local strings = {}
+
+            for i = 0, #cursorArray - 1 do
+                local cur = cursorArray.cursors[i]
+                strings[#strings + 1] = cur:name().." "..cur:displayName().." "..cur:USR()
+            end
+
+            return table.concat(strings, ",")
+        end
+
+        local expectedStrings = getStrings()
+        local expectedRealName = tu:file(fileName):realPathName()
+
+        assert.are.equal(tu:memoizeStrings(), tu)
+
+        for _ = 1, 2 do
+            assert.are.equal(getStrings(), expectedStrings)
+            assert.are.equal(tu:file(fileName):realPathName(), expectedRealName)
+        end
+
+        writeToFile(fileName, "int b;")
+        assert.are.equal(tu:reparse(), tu)
+        assert.are.equal(getStrings(), "b b c:@b")
+    end)
+end)
+
 describe2("Enumerations", function(createTU)
-    local tu = GetTU(createTU, "test_data/enums.hpp")
+    local tu = GetSharedTU(createTU, "test_data/enums.hpp")
     local tuCursor = tu:cursor()
 
     it("tests various queries on enumerations", function()
@@ -678,7 +1334,7 @@ describe2("Enumerations", function(createTU)
 end)
 
 describe2("Virtual functions", function(createTU)
-    local tu = GetTU(createTU, "test_data/virtual.hpp")
+    local tu = GetSharedTU(createTU, "test_data/virtual.hpp")
     local tuCursor = tu:cursor()
 
     local classDefs = tuCursor:children()
@@ -759,9 +1415,9 @@ describe2("Virtual functions", function(createTU)
 end)
 
 describe2("Cross-referencing", function(createTU)
-    local tuDef = GetTU(createTU, "test_data/enums.hpp")  -- contains definition of enum BigNumbers
-    local tuDecl = GetTU(createTU, "test_data/simple.hpp", 1)  -- a declaration
-    local tuMisDecl = GetTU(createTU, "test_data/virtual.hpp")  -- a mis-declaration (wrong underlying type)
+    local tuDef = GetSharedTU(createTU, "test_data/enums.hpp")  -- contains definition of enum BigNumbers
+    local tuDecl = GetSharedTU(createTU, "test_data/simple.hpp", 1)  -- a declaration
+    local tuMisDecl = GetSharedTU(createTU, "test_data/virtual.hpp")  -- a mis-declaration (wrong underlying type)
 
     local USRs = {}
     local declCursors, defCursors = {}, {}
@@ -909,6 +1565,10 @@ describe("Indexer callbacks", function()
                 checkSeqNum((seqNum == 4) and 4 or 5)
 
                 assert.is_not_nil(incFileInfo.file)
+                assert.is_equal(incFileInfo.file:name():sub(-#incFileInfo.filename),
+                                incFileInfo.filename)
+                assert.is_equal(incFileInfo.file:realPathName():sub(-#incFileInfo.filename),
+                                incFileInfo.filename)
                 assert.is_false(incFileInfo.isImport)
                 local _, hashLco = incFileInfo.hashLoc:fileSite()
                 assert.is_equal(hashLco.line, seqNum - 4)
@@ -1222,3 +1882,107 @@ MAKE_VAR(long long, Ninth, Green);
         })
     end)
 end)
+
+--== Timings of binding hot paths
+
+-- Upper bounds on the time per item of frequently used functions of the binding. They are
+-- generous enough to hold on slow machines, but catch regressions by an order of magnitude.
+-- To account for slower environments (such as instrumented builds), they are multiplied by
+-- LJCLANG_TEST_TIME_FACTOR if it is set.
+local TimeFactor = tonumber(os.getenv("LJCLANG_TEST_TIME_FACTOR") or "1")
+
+local function getMonotonicSeconds()
+    local ts = posix.clock_gettime()
+    return tonumber(ts.sec) + tonumber(ts.nsec) / 1e9
+end
+
+-- Returns the best time in microseconds per item of several runs of <func>, which
+-- processes <itemCount> items.
+local function measureMicrosPerItem(itemCount, func)
+    func()
+
+    local bestSeconds = math.huge
+
+    for _ = 1, 5 do
+        local startTime = getMonotonicSeconds()
+        func()
+        bestSeconds = math.min(bestSeconds, getMonotonicSeconds() - startTime)
+    end
+
+    return 1e6 * bestSeconds / itemCount
+end
+
+local function assertTimePerItem(microsPerItem, limit)
+    assert.is_true(microsPerItem <= TimeFactor * limit,
+                   string.format("%.3f us per item, expected at most %.3f",
+                                 microsPerItem, TimeFactor * limit))
+end
+
+local function testTimings()
+    local tu = GetSharedTU(CreateTUFuncs[1], "dev/cxx_headers.hpp", 0,
+                           {"-std=c++14", "-isystem", llvm_libdir_include})
+    local tuCursor = tu:cursor()
+    local cursorArray = tuCursor:collect()
+    -- The per-cursor functions are only timed for a prefix, to keep the test quick.
+    local cursorCount = math.min(#cursorArray, 20000)
+
+    local visitedCount
+    local countingVisitor = cl.regCursorVisitor(function()
+        visitedCount = visitedCount + 1
+        return cl.ChildVisitResult.Recurse
+    end)
+
+    local forEachCursor = function(func)
+        return function()
+            for i = 0, cursorCount - 1 do
+                func(cursorArray.cursors[i])
+            end
+        end
+    end
+
+    it("tests that there is something to measure", function()
+        assert.is_true(cursorCount >= 10000)
+    end)
+
+    it("tests Cursor:children(<visitor>)", function()
+        assertTimePerItem(measureMicrosPerItem(#cursorArray, function()
+            visitedCount = 0
+            tuCursor:children(countingVisitor)
+            assert.are.equal(visitedCount, #cursorArray)
+        end), 5)
+    end)
+
+    it("tests Cursor:collect()", function()
+        assertTimePerItem(measureMicrosPerItem(#cursorArray, function()
+            tuCursor:collect()
+        end), 2)
+    end)
+
+    it("tests Cursor:name()", function()
+        assertTimePerItem(measureMicrosPerItem(cursorCount, forEachCursor(function(cur)
+            cur:name()
+        end)), 10)
+    end)
+
+    it("tests Cursor:USR()", function()
+        assertTimePerItem(measureMicrosPerItem(cursorCount, forEachCursor(function(cur)
+            cur:USR()
+        end)), 20)
+    end)
+
+    it("tests Cursor:location()", function()
+        assertTimePerItem(measureMicrosPerItem(cursorCount, forEachCursor(function(cur)
+            cur:location()
+        end)), 20)
+    end)
+
+    it("tests TranslationUnit:diagnosticSet()", function()
+        assertTimePerItem(measureMicrosPerItem(1, function()
+            tu:diagnosticSet()
+        end), 200)
+    end)
+end
+
+if (os.getenv("LJCLANG_TESTS_NO_CXX_STDLIB") ~= "1") then
+    describe("Timings of binding hot paths", testTimings)
+end
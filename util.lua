@@ -11,6 +11,7 @@ local class = require("class").class
 local assert = assert
 local error = error
 local ipairs = ipairs
+local tonumber = tonumber
 local type = type
 local unpack = unpack
 
@@ -184,5 +185,72 @@ api.BoolArray = function(size, initialValue)
     return array
 end
 
+---------- Binary serialization ----------
+
+-- Strings produced by the functions below contain native-endian data and are only meant to
+-- be exchanged between processes on the same machine.
+
+local uint32_array_t = ffi.typeof("uint32_t [?]")
+local const_uint8_ptr_t = ffi.typeof("const uint8_t *")
+local const_uint32_ptr_t = ffi.typeof("const uint32_t *")
+
+-- Return a string containing the uint32_t representation of each number in the
+-- sequence <values>.
+function api.packUint32s(values)
+    checktype(values, 1, "table", 2)
+
+    local count = #values
+    if (count == 0) then
+        return ""
+    end
+
+    local array = uint32_array_t(count, values)
+    return ffi.string(array, count * 4)
+end
+
+-- Reads values from a string built by concatenating results of packUint32s() and plain
+-- strings. All functions check that the requested data is in bounds.
+api.BinaryReader = class
+{
+    function(str)
+        checktype(str, 1, "string", 2)
+
+        return {
+            str = str,  -- (anchors the data pointed to by 'ptr')
+            ptr = ffi.cast(const_uint8_ptr_t, str),
+            pos = 0,
+        }
+    end,
+
+    -- Returns a pointer to <count> uint32_t values that is valid as long as the reader is.
+    uint32s = function(self, count)
+        checktype(count, 1, "number", 2)
+        local ptr = ffi.cast(const_uint32_ptr_t, self.ptr + self.pos)
+        self:advance_(4 * count)
+        return ptr
+    end,
+
+    uint32 = function(self)
+        return tonumber(self:uint32s(1)[0])
+    end,
+
+    string = function(self, length)
+        checktype(length, 1, "number", 2)
+        local startPos = self.pos
+        self:advance_(length)
+        return ffi.string(self.ptr + startPos, length)
+    end,
+
+    isAtEnd = function(self)
+        return (self.pos == #self.str)
+    end,
+
+    advance_ = function(self, byteCount)
+        check(byteCount >= 0 and self.pos + byteCount <= #self.str,
+              "attempt to read past the end of the binary string", 3)
+        self.pos = self.pos + byteCount
+    end,
+}
+
 -- Done!
 return api
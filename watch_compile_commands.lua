@@ -106,8 +106,21 @@ Options:
       Note that this will remove errors due to forgetting to include a standard library header.
       Only supported for C++11 upwards.
       Precompiled headers are stored in '%s'.
+  -A <count>: With -a, additionally precompile project headers. For each set of at least as many
+      PCH-enabled compile commands as required by -a that have identical options, the up to
+      <count> non-system headers included by most of them and not modified within the last hour
+      are put into a PCH together with the standard library headers. It is used for the compile
+      commands including all of these headers, from the run after it has been built on. When
+      any file going into it is modified, it is rebuilt in the background.
   -c <concurrency>: set number of parallel parser invocations. (Minimum: 1)
      'auto' means use hardware concurrency (the default).
+     Except with -i, compile commands are processed longest first, using the time and memory
+     recorded in earlier runs. Fewer high-memory compile commands may run at once.
+  -D <milliseconds>: Quiet period for modifications of watched files. (Default: 200)
+     After a modification, further ones are collected until none has happened for that long.
+     Only then are the affected compile commands processed again, each one once. While
+     compile commands are being processed, a modification only makes those that depend on
+     the modified file be processed again. The others are not interrupted.
   -i <severity-spec>: Enable incremental mode. Stop processing further compile commands on the first
      diagnostic matching the severity specification. Its syntax one of:
       1. a comma-separated list, <severity>(,<severity>)*
@@ -115,10 +128,21 @@ Options:
       2. a single severity suffixed by '+', meaning to select the specified severity
          and more serious ones.
      As a convenience, the specification can also be '-', meaning 'error+'.
+  -I: Process each compile command in a single pass of clang_indexSourceFile(), taking the
+     inclusion graph and the symbols for -S from the indexer callbacks instead of traversing
+     the translation unit afterwards. With -W, the function bodies of headers that a worker has
+     already indexed are skipped, so diagnostics in them are only reported once.
   -g [includes|isIncludedBy]: Print inclusion graph as a DOT (of Graphviz) file to stdout and exit.
      Argument specifies the relation between graph nodes (which are file names).
+     Only the preprocessor is run, unless that fails for a compile command.
   -l <number>: edge count limit for the graph produced by -g %s.
      If exceeded, a placeholder node is placed.
+  -k <directory>: Keep a cache of the results of each compile command in <directory>. Results
+     are taken from it if the contents of the compiled file and of all non-system headers it
+     includes are unchanged. Since modification times are not considered, the cache can be
+     reused after a fresh checkout, or be populated elsewhere (for example, by a CI build).
+     However, entries are keyed by absolute file and directory names, so the checkout must be
+     at the same path as the one that populated the cache.
   -r [c<commands>|<seconds>s]: report progress after the specified number of
      processed compile commands or the given time interval.
      Specifying any of 'c0', 'c1' or '0s' effectively prints progress with each compile command.
@@ -130,11 +154,35 @@ Options:
      Each <selector> can be one of:
       - '@...': by index (see below).
       - '{<pattern>}': by Lua pattern matching the absolute file name in a compile command.
+     When a selection is made, a change of <compile_commands-file> makes the program exit.
+     Otherwise, it is re-read and only added or modified compile commands are processed.
+  -M <bytes>[K|M|G]: Memory budget for the processes parsing compile commands. A compile
+     command is only handed to a new child if the current resident set sizes of the running
+     ones, but at least the peaks recorded for their compile commands, plus the peak recorded
+     for the new one stay within the budget. A compile command without a recorded peak is
+     assumed to need the average of the recorded ones, or if there are none (for example, on
+     a first run), the budget divided by the concurrency but at least 3 GiB. While fewer
+     children than allowed are running, the budget is re-checked every 250 milliseconds.
+     At least one compile command is always being processed. The concurrency given by -c
+     remains the upper limit.
   -N: Print all diagnostics. This disables omission of:
       - diagnostics that follow a Parse Issue error, and
       - diagnostics that were seen in previous compile commands.
   -P: Disable color output.
+  -R: In command mode, keep a snapshot of the results of all compile commands in the cache
+     directory (see -a) up to date. On startup, the results of those compile commands whose
+     files have not been modified since they were processed are restored from it.
+  -S: Record the symbols that are declared, defined or referenced in the main file of each
+     compile command into an index kept in shared memory. In command mode, it can be
+     queried with the 'symbol' command.
+  -T <count>: with -W, keep the translation units of the <count> most recently processed
+     compile commands resident in each worker. They are parsed with a precompiled preamble
+     and reparsed (instead of parsed anew) when a file they depend on is modified.
+     A compile command is handed to the worker that processed it last if that one is idle.
   -v: Be verbose. Currently: output compiler invocations for Auto-PCH generation failures.
+  -W: Use a pool of long-lived worker processes that are forked once at startup instead of
+      forking a new process for each compile command. Each worker keeps its libclang index
+      across the compile commands it is handed.
   -x: exit after parsing and displaying diagnostics once.
 
   If the selector to an option -s starts with '@', it must have one of the following forms,
@@ -154,32 +202,50 @@ local parsecmdline = require("parsecmdline_pk")
 
 local opts_meta = {
     a = false,
+    A = true,
     c = true,
+    D = true,
     i = true,
+    I = false,
     m = true,
+    M = true,
     g = true,
     l = true,
+    k = true,
     r = true,
     s = 1,  -- collect all instances
+    T = true,
     N = false,
     P = false,
+    R = false,
+    S = false,
     v = false,
+    W = false,
     x = false,
 }
 
 local opts, args = parsecmdline.getopts(opts_meta, arg, usage)
 
 local autoPch = opts.a
+local projectPchHeaderCountOpt = opts.A
 local concurrencyOpt = opts.c or "auto"
+local quietPeriodOpt = opts.D or "200"
 local requestFifoFileName = opts.m
 local commandMode = (requestFifoFileName ~= nil)
 local incrementalMode = opts.i
+local useIndexer = opts.I
 local printGraphMode = opts.g
 local edgeCountLimit = tonumber(opts.l)
+local resultCacheDirectory = opts.k
 local progressSpec = opts.r
 local selectionSpecs = opts.s
 local printAllDiags = opts.N or false
 local plainMode = opts.P
+local useWorkerPool = opts.W
+local indexSymbols = opts.S
+local useSnapshot = opts.R
+local tuCacheSizeOpt = opts.T
+local memoryBudgetOpt = opts.M
 local exitImmediately = opts.x or printGraphMode
 
 local function colorize(...)
@@ -320,6 +386,59 @@ if (incrementalMode ~= nil) then
     incrementalMode = incMode
 end
 
+local tuCacheSize = nil
+
+if (tuCacheSizeOpt ~= nil) then
+    if (not useWorkerPool) then
+        abort("Option -T can only be used with -W.")
+    end
+
+    if (not tuCacheSizeOpt:match("^[1-9][0-9]*$")) then
+        abort("Argument to option -T must be a positive integral number.")
+    end
+
+    tuCacheSize = tonumber(tuCacheSizeOpt)
+end
+
+if (useSnapshot and not commandMode) then
+    abort("Option -R can only be used with -m.")
+end
+
+if (not quietPeriodOpt:match("^[0-9]+$")) then
+    abort("Argument to option -D must be a non-negative integral number.")
+end
+
+local QuietPeriodMs = tonumber(quietPeriodOpt)
+
+-- With -M: the memory budget in KiB.
+local memoryBudgetKb = nil
+
+if (memoryBudgetOpt ~= nil) then
+    local number, suffix = memoryBudgetOpt:match("^([1-9][0-9]*)([KMG]?)$")
+
+    if (number == nil) then
+        abort("Argument to option -M must be a positive integral number, "..
+                  "optionally suffixed by 'K', 'M' or 'G'.")
+    end
+
+    local Factors = { [""] = 1, K = 2^10, M = 2^20, G = 2^30 }
+    memoryBudgetKb = tonumber(number) * Factors[suffix] / 1024
+end
+
+local projectPchHeaderCount = nil
+
+if (projectPchHeaderCountOpt ~= nil) then
+    if (autoPch == nil) then
+        abort("Option -A can only be used with -a.")
+    end
+
+    if (not projectPchHeaderCountOpt:match("^[1-9][0-9]*$")) then
+        abort("Argument to option -A must be a positive integral number.")
+    end
+
+    projectPchHeaderCount = tonumber(projectPchHeaderCountOpt)
+end
+
 if (edgeCountLimit ~= nil) then
     if (printGraphMode ~= GlobalInclusionGraphRelation) then
         abort("Option -l can only be used with -g being %s.", GlobalInclusionGraphRelation)
@@ -369,7 +488,12 @@ local POLL = posix.POLL
 local linux_decls = require("ljclang_linux_decls")
 local inotify = require("inotify")
 local IN = inotify.IN
-local SymbolIndex = require("symbol_index").SymbolIndex
+local symbol_index = require("symbol_index")
+local SymbolIndex = symbol_index.SymbolIndex
+local SharedStringTable = require("shared_string_table").SharedStringTable
+local ResultCache = require("result_cache").ResultCache
+local StringLog = require("string_log").StringLog
+local hashString = require("result_cache").hashString
 
 if (IsMakingApp) then
     -- KEEPINSYNC: make sure that there are no require() calls below us!
@@ -378,6 +502,12 @@ end
 
 ----------
 
+-- Returns the signature by which entries of the compilation database are matched when it
+-- is reloaded. Must be computed before the preparation steps modify the entry.
+local function GetEntrySignature(cmd)
+    return table.concat({ cmd.file, cmd.directory, table.concat(cmd.arguments, '\0') }, '\0')
+end
+
 local function ReadCompileCommands()
     local compileCmds, errorMessage =
         compile_commands_reader.read_compile_commands(compileCommandsFile)
@@ -391,6 +521,10 @@ local function ReadCompileCommands()
         infoAndExit("'%s' contains zero entries.", compileCommandsFile)
     end
 
+    for _, cmd in ipairs(compileCmds) do
+        cmd.entrySignature = GetEntrySignature(cmd)
+    end
+
     return compileCmds
 end
 
@@ -521,7 +655,270 @@ end
 local compileCommands, selectionInfo = HandleAllSelectionSpecs()
 local usedConcurrency = math.min(getUsedConcurrency(), #compileCommands)
 
-do
+-- Names of the files in the inclusion graphs, shared with all children (which must be
+-- forked after this point). Children send file ids instead of names to the parent.
+local FileNames = SharedStringTable(
+    ffi.abi("64bit") and 2^20 or 2^17,
+    ffi.abi("64bit") and 256*2^20 or 32*2^20)
+
+-- For each file, the compile commands whose last inclusion graph contains it.
+-- KEEPINSYNC with the assignments to 'ccInclusionGraphs[]'.
+local CcReverseDeps = inclusion_graph.ReverseDependencyIndex(#compileCommands)
+
+-- Number of local symbol page arrays: one for each concurrently running child.
+-- NOTE: twice the concurrency, since children replacing finished ones are forked before
+--  the connections to the latter are closed.
+local LocalPageArrayCount = 2 * usedConcurrency
+
+-- With -S: the index of symbols used by the compile commands, with a local page array for
+-- each concurrently running child, and the USRs and names of the symbols.
+local SymIndex = indexSymbols and SymbolIndex(LocalPageArrayCount) or nil
+local SymbolNames = indexSymbols and SharedStringTable(
+    ffi.abi("64bit") and 2^22 or 2^19,
+    ffi.abi("64bit") and 512*2^20 or 64*2^20) or nil
+-- [<ccIdx>] = <sequence of indexes of the global pages holding the compile command's symbols>
+local CcSymbolPages = {}
+local SymUse = symbol_index.UseFlags
+
+-- [<ccIdx>] = <time at which the compile command was last handed to a child>
+-- Results of a compile command are only restored from a snapshot (option -R) if none of
+-- the files it depends on was modified at or after that time.
+local CcDispatchTimes = {}
+-- [<ccIdx>] = <event round (see Notifier) at the time the compile command was last handed
+--  to a child>
+local CcDispatchEventRounds = {}
+
+-- Phases of processing a compile command whose durations are recorded. The child ones are
+-- timed by the process handling the compile command and sent with its results, the parent
+-- ones by the parent. "cache" covers the lookup in and the store to the result cache (-k).
+-- KEEPINSYNC with DoneHeader_t.phaseUs.
+local ChildPhases = { "cache", "parse", "diags", "graph", "symbols", "serialize" }
+local ParentPhases = { "merge", "print" }
+local PhaseNames = util.copySequence(ChildPhases)
+for _, name in ipairs(ParentPhases) do
+    PhaseNames[#PhaseNames + 1] = name
+end
+-- [<phase name>] = <index into PhaseNames>
+local Phase = {}
+for i, name in ipairs(PhaseNames) do
+    Phase[name] = i
+end
+
+-- [<ccIdx>] = { [<phase index>] = <microseconds> }: the durations of the phases of the
+-- last processing of the compile command.
+local CcPhaseTimes = {}
+
+-- Returns the name of the file in the cache directory that stores data of kind <kind> for
+-- the compilation database.
+local function GetDatabaseCacheFileName(kind)
+    local realName = posix.realpath(compileCommandsFile) or compileCommandsFile
+    -- Percent-encode '%' and '/' (and nothing else), which keeps the mapping injective.
+    local mangledName = realName:gsub("[%%/]", { ["%"] = "%25", ["/"] = "%2F" })
+    return format("%s/wcc-%s-%s.bin", CacheDirectory, kind, mangledName)
+end
+
+---------- Compile command costs ----------
+
+-- [<entry signature>] = { wallMs=<number>, peakRssKb=<number> }: resource usage of the last
+--  processing of a compile command, in this or an earlier invocation. Keyed by the entry
+--  signature (see GetEntrySignature()) so that it survives reloads and reorderings.
+local CcCosts = {}
+local haveNewCcCosts = false
+-- Sum and count of the peak RSS values in CcCosts, for the average.
+local PeakRssKbSum, PeakRssKbCount = 0, 0
+
+-- Layout (all integers are uint32_t):
+--  "WCCT" <version> <record count>
+--  <length of signature i> <wall time in ms i> <peak RSS in KiB i> for each record i
+--  <concatenated signatures>
+local CostsMagic, CostsVersion = "WCCT", 1
+local CostsFileName = GetDatabaseCacheFileName("costs")
+
+local function ReadCcCosts()
+    local f = io.open(CostsFileName, "rb")
+    if (f == nil) then
+        return
+    end
+
+    local data = f:read("*a")
+    f:close()
+
+    local costs = {}
+
+    local ok = pcall(function()
+        check(data:sub(1, #CostsMagic) == CostsMagic, "wrong magic", 1)
+
+        local reader = util.BinaryReader(data:sub(#CostsMagic + 1))
+        if (reader:uint32() ~= CostsVersion) then
+            return
+        end
+
+        local recordCount = reader:uint32()
+        local records = reader:uint32s(3 * recordCount)
+
+        for i = 0, 3 * recordCount - 1, 3 do
+            costs[reader:string(records[i])] = {
+                wallMs = records[i + 1], peakRssKb = records[i + 2]
+            }
+        end
+
+        check(reader:isAtEnd(), "trailing data", 1)
+    end)
+
+    -- NOTE: an invalid file is treated like a missing one. It is overwritten later.
+    CcCosts = ok and costs or {}
+
+    for _, cost in pairs(CcCosts) do
+        PeakRssKbSum, PeakRssKbCount = PeakRssKbSum + cost.peakRssKb, PeakRssKbCount + 1
+    end
+end
+
+-- Stores the costs of the current compile commands, if any have been newly recorded.
+local function WriteCcCosts()
+    if (not haveNewCcCosts) then
+        return
+    end
+
+    local records, signatures = {}, {}
+
+    for _, cmd in ipairs(compileCommands) do
+        local cost = CcCosts[cmd.entrySignature]
+
+        if (cost ~= nil) then
+            records[#records + 1] = #cmd.entrySignature
+            records[#records + 1] = cost.wallMs
+            records[#records + 1] = cost.peakRssKb
+            signatures[#signatures + 1] = cmd.entrySignature
+        end
+    end
+
+    local data = CostsMagic..util.packUint32s({ CostsVersion, #signatures })..
+        util.packUint32s(records)..table.concat(signatures)
+
+    local tempFileName = CostsFileName..".tmp"
+    local f = io.open(tempFileName, "wb")
+    local ok = (f ~= nil) and f:write(data)
+    ok = (f ~= nil) and f:close() and ok
+
+    if (not ok or not os.rename(tempFileName, CostsFileName)) then
+        os.remove(tempFileName)
+    end
+
+    haveNewCcCosts = false
+end
+
+ReadCcCosts()
+
+local function SetCcCost(ccIdx, wallMs, peakRssKb)
+    local signature = compileCommands[ccIdx].entrySignature
+    local oldCost = CcCosts[signature]
+
+    if (oldCost ~= nil) then
+        PeakRssKbSum, PeakRssKbCount = PeakRssKbSum - oldCost.peakRssKb, PeakRssKbCount - 1
+    end
+
+    CcCosts[signature] = { wallMs=wallMs, peakRssKb=peakRssKb }
+    PeakRssKbSum, PeakRssKbCount = PeakRssKbSum + peakRssKb, PeakRssKbCount + 1
+    haveNewCcCosts = true
+end
+
+-- Returns the value of the field <key> (given in kB) of "/proc/<pid>/status" in KiB, or 0
+-- if it is not available (for example, because the process has exited).
+local function GetProcStatusKb(pid, key)
+    local f = io.open(format("/proc/%s/status", tostring(pid)))
+    if (f == nil) then
+        return 0
+    end
+
+    local str = f:read("*a") or ""
+    f:close()
+    return tonumber(str:match("\n"..key..":%s*(%d+) kB")) or 0
+end
+
+-- With -M: the peak RSS in KiB assumed for a compile command if none is recorded for any.
+-- This is the case on a first run or after the cache directory was wiped, so it must not
+-- underestimate: each child is assumed to use its share of the budget, but at least 3 GiB.
+local DefaultExpectedRssKb = (memoryBudgetKb ~= nil) and
+    math.max(memoryBudgetKb / usedConcurrency, 3 * 2^20) or nil
+
+-- With -M: interval in milliseconds at which the budget is re-checked while fewer children
+-- than allowed are running (see Controller:setupConcurrency()).
+local MemoryBudgetRecheckMs = 250
+
+-- With -M: returns the peak RSS expected for compile command #<ccIdx>. If none is
+-- recorded, this is the average of the recorded ones (or DefaultExpectedRssKb).
+local function GetExpectedRssKb(ccIdx)
+    local cost = CcCosts[compileCommands[ccIdx].entrySignature]
+    if (cost ~= nil) then
+        return cost.peakRssKb
+    end
+
+    return (PeakRssKbCount > 0) and PeakRssKbSum / PeakRssKbCount or DefaultExpectedRssKb
+end
+
+-- Total physical memory in KiB, or nil if unknown.
+local PhysicalMemoryKb = (function()
+    local f = io.open("/proc/meminfo")
+    if (f ~= nil) then
+        local str = f:read("*a") or ""
+        f:close()
+        return tonumber(str:match("^MemTotal:%s*(%d+) kB"))
+    end
+end)()
+
+-- A compile command is considered to be high-memory if the peak RSS recorded for it
+-- exceeds its share of physical memory at the used concurrency. At most half the children
+-- (but at least one) process such compile commands at the same time.
+-- NOTE: with -M, the memory budget is used instead of this heuristic.
+local HighMemoryRssKb = (PhysicalMemoryKb ~= nil and memoryBudgetKb == nil) and
+    PhysicalMemoryKb / usedConcurrency or math.huge
+local HighMemoryChildCap = math.max(1, math.floor(usedConcurrency / 2))
+
+local function IsHighMemoryCc(ccIdx)
+    local cost = CcCosts[compileCommands[ccIdx].entrySignature]
+    return (cost ~= nil and cost.peakRssKb > HighMemoryRssKb)
+end
+
+-- Returns the sequence <ccIdxs> ordered by descending recorded wall time, so that
+-- expensive compile commands are not left running alone at the end. Compile commands
+-- without a recorded cost are assumed to take the average time. In command mode, <ccIdxs>
+-- itself is reordered, otherwise a new table is returned.
+local function GetDispatchOrder(ccIdxs)
+    if (incrementalMode ~= nil) then
+        -- Stopping early relies on processing in compile command order.
+        return ccIdxs
+    end
+
+    local order = commandMode and ccIdxs or util.copySequence(ccIdxs)
+    local wallMsOf = {}
+    local knownCount, knownSum = 0, 0
+
+    for _, ccIdx in ipairs(order) do
+        local cost = CcCosts[compileCommands[ccIdx].entrySignature]
+        if (cost ~= nil) then
+            wallMsOf[ccIdx] = cost.wallMs
+            knownCount, knownSum = knownCount + 1, knownSum + cost.wallMs
+        end
+    end
+
+    if (knownCount == 0) then
+        return order
+    end
+
+    local defaultWallMs = knownSum / knownCount
+
+    for _, ccIdx in ipairs(order) do
+        wallMsOf[ccIdx] = wallMsOf[ccIdx] or defaultWallMs
+    end
+
+    table.sort(order, function(a, b)
+        return (wallMsOf[a] > wallMsOf[b] or (wallMsOf[a] == wallMsOf[b] and a < b))
+    end)
+
+    return order
+end
+
+local function SetCcIdxsFor()
     -- [<absolute file name>] = { sIdx1 [, sIdx2, ...] }  (selected CC indexes)
     local ccIdxsFor = {}
 
@@ -534,6 +931,8 @@ do
     selectionInfo.ccIdxsFor = ccIdxsFor
 end
 
+SetCcIdxsFor()
+
 ----------
 
 local Connection = class
@@ -649,6 +1048,34 @@ local function ExecuteAsync(fileName, args)
     end
 end
 
+-- Like Execute(), but does not wait for the program to finish. Returns a function that
+-- returns nil while the program is still running and its exit code (like Execute())
+-- afterwards. It must be called until it returns non-nil.
+local function ExecuteInBackground(fileName, args)
+    local pipePair = PipePair()
+    local whoami, pid = posix.fork()
+    local conn = pipePair:getConnection(whoami)
+
+    if (whoami == "child") then
+        posix.freopen("/dev/null", "r", ffi.C.stdin)
+        posix.freopen("/dev/null", "w", ffi.C.stdout)
+        posix.freopen("/dev/null", "rw", ffi.C.stderr)
+
+        -- NOTE: the write end of the pipe is retained across exec(). The parent sees it
+        --  being closed once the program has finished.
+        posix.exec(fileName, args)
+    else
+        return function()
+            if (#posix.poll({events=POLL.IN, conn.r.fd}, 0) == 0) then
+                return nil
+            end
+
+            conn:close()
+            return WaitForChild(pid)
+        end
+    end
+end
+
 local function GetPchInputFiles()
     local luaPath = getEnv("LUA_PATH", "Lua path")
     -- KEEPINSYNC with dev/app.sh.in
@@ -664,6 +1091,11 @@ if (Execute("/bin/mkdir", {"-p", CacheDirectory}) ~= 0) then
     errorInfoAndExit("Failed creating cache directory %s.", CacheDirectory)
 end
 
+if (resultCacheDirectory ~= nil and
+        Execute("/bin/mkdir", {"-p", resultCacheDirectory}) ~= 0) then
+    errorInfoAndExit("Failed creating result cache directory %s.", resultCacheDirectory)
+end
+
 ---------- Command mode / Machine interface ----------
 
 local MI = {
@@ -690,12 +1122,128 @@ MI.State = class
         return {
             clientPidFifo = posix.Fd(fifoFd),
             clientInotifier = inotifier,
+            -- Sequence of requests that are responded to once the compile commands they
+            -- are waiting for are processed. See MI.HandleDeferredRequests().
+            deferredRequests = {},
+            -- Sequence of MI.OutputQueue instances that have data not written yet.
+            outputQueues = {},
+            -- Start of a request whose remainder has not been read yet.
+            partialRequest = "",
+            -- Holds the serialized formatted diagnostic sets of the processed compile
+            -- commands, so that they are not kept in memory for the lifetime of the server.
+            -- Handles into it are the values of Controller's 'miFormattedDiagSets'.
+            diagSetLog = StringLog(),
         }
     end,
 }
 
 local mi = commandMode and MI.State() or nil
 
+-- Loads the formatted diagnostic set for <handle> from mi.diagSetLog.
+function MI.LoadFormattedDiagSet(handle)
+    return diagnostics_util.FormattedDiagSet_Deserialize(
+        mi.diagSetLog:read(handle), not plainMode)
+end
+
+-- The data to be sent to a client over its FIFO. It is written without blocking, as far as
+-- the client keeps reading. The remainder is written when poll() reports that the FIFO is
+-- writable (see MI.GetPendingOutputFds()), so that slow clients do not hold up anything.
+MI.OutputQueue = class
+{
+    function(fifo)
+        return {
+            fifo = fifo,
+            chunks = {},
+            isFinished = false,
+        }
+    end,
+
+    -- Appends <str> to the data to be sent and writes what can be written right away.
+    push = function(self, str)
+        assert(not self.isFinished)
+        local chunks = self.chunks
+        chunks[#chunks + 1] = str
+        self:flush()
+    end,
+
+    -- Marks the data as complete: the FIFO is closed once all of it has been written.
+    finish = function(self)
+        self.isFinished = true
+        self:flush()
+    end,
+
+    isDone = function(self)
+        return (self.fifo == nil)
+    end,
+
+    getRawFd = function(self)
+        return self.fifo.fd
+    end,
+
+    flush = function(self)
+        if (self.fifo == nil) then
+            return
+        end
+
+        local chunks = self.chunks
+
+        while (#chunks > 0) do
+            local bytesWritten = self.fifo:writeNonblocking(chunks[1])
+
+            if (bytesWritten == nil) then
+                miInfo("Client closed its FIFO before reading all results.")
+                break
+            elseif (bytesWritten < #chunks[1]) then
+                chunks[1] = chunks[1]:sub(bytesWritten + 1)
+                return
+            end
+
+            table.remove(chunks, 1)
+        end
+
+        if (#chunks == 0 and not self.isFinished) then
+            return
+        end
+
+        self.fifo:close()
+        self.fifo = nil
+    end,
+}
+
+-- Returns an output queue for the client FIFO <fifo>, registered to be flushed by
+-- MI.FlushOutputQueues().
+function MI.NewOutputQueue(fifo)
+    local queue = MI.OutputQueue(fifo)
+    mi.outputQueues[#mi.outputQueues + 1] = queue
+    return queue
+end
+
+-- Returns the sequence of file descriptors of client FIFOs that are waiting to be written to.
+function MI.GetPendingOutputFds()
+    local fds = {}
+
+    for _, queue in ipairs(mi.outputQueues) do
+        if (not queue:isDone() and #queue.chunks > 0) then
+            fds[#fds + 1] = queue:getRawFd()
+        end
+    end
+
+    return fds
+end
+
+function MI.FlushOutputQueues()
+    local queues = {}
+
+    for _, queue in ipairs(mi.outputQueues) do
+        queue:flush()
+        if (not queue:isDone()) then
+            queues[#queues + 1] = queue
+        end
+    end
+
+    mi.outputQueues = queues
+end
+
 local FormattedDiagSetPrinter  -- "forward-declare"
 
 function MI.GetRealNameFor(fileName)
@@ -737,25 +1285,29 @@ function MI.HandleCommand_Diags(args, control, prioritizeCcFunc)
     end
 
     local printer = FormattedDiagSetPrinter()
-    local haveUnprocessed = false
+    local unprocessedCcIdxs = {}
     local tab = {}
 
     for _, ccIdx in ipairs(idxsForCc) do
-        local fDiagSet = control.miFormattedDiagSets[ccIdx]
-        if (fDiagSet == nil) then
+        local handle = control.miFormattedDiagSets[ccIdx]
+        if (handle == nil) then
             -- Compile command not yet processed, so:
             prioritizeCcFunc(ccIdx)
-            haveUnprocessed = true
+            unprocessedCcIdxs[#unprocessedCcIdxs + 1] = ccIdx
         else
+            local fDiagSet = MI.LoadFormattedDiagSet(handle)
             tab[#tab + 1] = printer:emulatePrint(keepColors, fDiagSet, ccIdx)
         end
     end
 
-    if (haveUnprocessed) then
+    if (#unprocessedCcIdxs > 0) then
         table.insert(tab, 1, "INFO: one or more compile commands not yet processed.")
     end
 
-    return table.concat(tab, '\n')    
+    -- NOTE: the third return value makes the response be deferred until the compile
+    --  commands are processed, if the request came from a client waiting for it.
+    return table.concat(tab, '\n'), nil,
+        (#unprocessedCcIdxs > 0) and unprocessedCcIdxs or nil
 end
 
 function MI.FileIsCompileCommandTU(fileName)
@@ -804,12 +1356,17 @@ function MI.HandleCommand_FileInfo(args, control, ccInclusionGraphs)
     local includingTUCount = 0
     local includingTUFiles = {}
     local haveFile = {}  -- [<fileName>] = {nil|true}
+    local isIncludingCc = {}  -- [<ccIdx>] = {nil|true}
+
+    for _, ccIdx in ipairs(CcReverseDeps:getCcIdxs({ FileNames:getId(realName) })) do
+        isIncludingCc[ccIdx] = true
+    end
 
     for ccIdx = 1, #compileCommands do
         local incGraph = ccInclusionGraphs[ccIdx]
         if (incGraph == nil) then
             haveUnhandled = true
-        elseif (incGraph:getNode(realName) ~= nil) then
+        elseif (isIncludingCc[ccIdx]) then
             includingTUCount = includingTUCount + 1
             -- Uniquify by file name.
             local fileName = compileCommands[ccIdx].file
@@ -832,6 +1389,145 @@ function MI.HandleCommand_FileInfo(args, control, ccInclusionGraphs)
     end
 end
 
+-- Does any of the global symbol pages <pageIdxs> have a symbol with name id <nameId> and a
+-- use matching any of <useFlags>?
+function MI.PagesHaveSymbolUse(pageIdxs, nameId, useFlags)
+    local pages = SymIndex.globalPageArray
+
+    for _, pageIdx in ipairs(pageIdxs) do
+        local page = pages[pageIdx]
+
+        for i = 0, symbol_index.EntriesPerPage - 1 do
+            if (page[i].intFlags == 0) then
+                -- Unused entry: the remaining ones on the page are unused, too.
+                break
+            end
+
+            local _, entryNameId = symbol_index.unpackIntFlags(page[i].intFlags)
+            local _, entryUseFlags = symbol_index.unpackExtFlags(page[i].extFlags)
+
+            if (entryNameId == nameId and bit.band(entryUseFlags, useFlags) ~= 0) then
+                return true
+            end
+        end
+    end
+
+    return false
+end
+
+function MI.HandleCommand_Symbol(args)
+    local UseFlagsForSubCommand = {
+        -- Unique and sorted list of names of CC files whose main file defines a symbol with
+        -- the passed name.
+        ["defining-tu-files"] = SymUse.Definition,
+        -- Likewise, but for a declaration, definition or reference.
+        ["using-tu-files"] = bit.bor(SymUse.Declaration, SymUse.Definition, SymUse.Reference),
+    }
+
+    local subCommand = args[1]
+
+    if (SymIndex == nil) then
+        return nil, "symbol index not enabled (option -S)"
+    elseif (subCommand == nil) then
+        return nil, "missing sub-command"
+    elseif (UseFlagsForSubCommand[subCommand] == nil) then
+        return nil, "unknown sub-command"
+    elseif (args[2] == nil) then
+        return nil, "missing symbol name"
+    elseif (args[3] ~= nil) then
+        return nil, "extraneous arguments provided"
+    end
+
+    local nameId = SymbolNames:getId(args[2])
+    if (nameId == nil) then
+        -- No compile command has a symbol with that name.
+        return ""
+    end
+
+    local useFlags = UseFlagsForSubCommand[subCommand]
+    local tuFiles = {}
+    local haveFile = {}  -- [<fileName>] = {nil|true}
+
+    for ccIdx = 1, #compileCommands do
+        local pageIdxs = CcSymbolPages[ccIdx]
+
+        if (pageIdxs ~= nil and MI.PagesHaveSymbolUse(pageIdxs, nameId, useFlags)) then
+            -- Uniquify by file name.
+            local fileName = compileCommands[ccIdx].file
+            if (not haveFile[fileName]) then
+                tuFiles[#tuFiles + 1] = fileName
+                haveFile[fileName] = true
+            end
+        end
+    end
+
+    table.sort(tuFiles)
+    return table.concat(tuFiles, '\n')
+end
+
+-- Returns the <fraction>-th quantile of the ascending sequence <values> (nearest rank).
+function MI.GetQuantile(values, fraction)
+    return values[math.max(1, math.ceil(fraction * #values))]
+end
+
+function MI.HandleCommand_Timings(args)
+    local DefaultTuCount = 10
+
+    local tuCount = (args[1] ~= nil) and tonumber(args[1]) or DefaultTuCount
+    if (tuCount == nil or tuCount < 1 or tuCount ~= math.floor(tuCount)) then
+        return nil, "argument must be a positive integral number"
+    end
+
+    local phaseValues, totals = {}, {}
+    for i = 1, #PhaseNames do
+        phaseValues[i] = {}
+    end
+
+    for ccIdx, phaseUs in pairs(CcPhaseTimes) do
+        local totalUs = 0
+        for i = 1, #PhaseNames do
+            -- NOTE: the parent phases are missing for compile commands whose diagnostics
+            --  are yet to be printed.
+            local us = phaseUs[i]
+            if (us ~= nil) then
+                local values = phaseValues[i]
+                values[#values + 1] = us
+                totalUs = totalUs + us
+            end
+        end
+        totals[#totals + 1] = { ccIdx, totalUs }
+    end
+
+    -- Output:
+    --  'phase <name> <p50> <p95> <max>' for each phase, then
+    --  'tu <total> <file>' for each of the up to <tuCount> slowest compile commands,
+    -- with durations in milliseconds.
+    local lines = {}
+
+    for i, name in ipairs(PhaseNames) do
+        local values = phaseValues[i]
+        table.sort(values)
+
+        if (#values > 0) then
+            lines[#lines + 1] = format("phase %s %.3f %.3f %.3f", name,
+                                       MI.GetQuantile(values, 0.5) / 1e3,
+                                       MI.GetQuantile(values, 0.95) / 1e3,
+                                       values[#values] / 1e3)
+        end
+    end
+
+    table.sort(totals, function(a, b)
+        return (a[2] > b[2] or a[2] == b[2] and a[1] < b[1])
+    end)
+
+    for i = 1, math.min(tuCount, #totals) do
+        local ccIdx, totalUs = totals[i][1], totals[i][2]
+        lines[#lines + 1] = format("tu %.3f %s", totalUs / 1e3, compileCommands[ccIdx].file)
+    end
+
+    return table.concat(lines, '\n')
+end
+
 function MI.DoHandleClientRequest(command, args, crTab)
     if (command == "-C") then
         -- NOTE: arguments are completely ignored.
@@ -840,11 +1536,55 @@ function MI.DoHandleClientRequest(command, args, crTab)
         return MI.HandleCommand_Diags(args, crTab[1], crTab[3])
     elseif (command == "fileinfo") then
         return MI.HandleCommand_FileInfo(args, crTab[1], crTab[2])
+    elseif (command == "symbol") then
+        return MI.HandleCommand_Symbol(args)
+    elseif (command == "timings") then
+        return MI.HandleCommand_Timings(args)
     end
 
     return nil, "unrecognized command"
 end
 
+function MI.SendResponse(queue, result, errorMsg)
+    local output = {
+        -- Success status (3 bytes).
+        (errorMsg ~= nil) and "rER" or "rOK",
+        -- Result text.
+        (errorMsg ~= nil) and errorMsg or result,
+        -- Newline.
+        '\n',
+    }
+
+    queue:push(table.concat(output))
+    queue:finish()
+end
+
+-- Responds to the deferred requests whose compile commands have all been processed by now,
+-- or to all of them if <respondToAll> is true. The latter is for when no more compile
+-- commands are going to be processed in the current run.
+function MI.HandleDeferredRequests(crTab, respondToAll)
+    local miFormattedDiagSets = crTab[1].miFormattedDiagSets
+    local stillDeferred = {}
+
+    for _, request in ipairs(mi.deferredRequests) do
+        local isReady = true
+
+        for _, ccIdx in ipairs(request.ccIdxs) do
+            isReady = isReady and (miFormattedDiagSets[ccIdx] ~= nil)
+        end
+
+        if (isReady or respondToAll) then
+            local result, errorMsg = MI.DoHandleClientRequest(
+                request.command, util.copySequence(request.args), crTab)
+            MI.SendResponse(request.queue, result, errorMsg)
+        else
+            stillDeferred[#stillDeferred + 1] = request
+        end
+    end
+
+    mi.deferredRequests = stillDeferred
+end
+
 function MI.GetOutputFifo(clientId, errorSuffix)
     local returnFifoName = format("%s/wcc-client-%s.fifo", TempDirectory, clientId)
 
@@ -896,27 +1636,24 @@ function MI.HandleClientRequest(request, crTab)
     end
 
     local fifo = (not isAnonRequest) and MI.GetOutputFifo(clientId, errorSuffix) or nil
-    if (fifo ~= nil) then
+    local queue = (fifo ~= nil) and MI.NewOutputQueue(fifo) or nil
+    if (queue ~= nil) then
         -- Send an acknowledgement of the request receival (3 bytes).
-        fifo:writePipe("ACK")
+        queue:push("ACK")
     end
 
     -- Do the actual work for the request.
-    local result, errorMsg = MI.DoHandleClientRequest(command, args, crTab)
+    local argsCopy = util.copySequence(args)
+    local result, errorMsg, waitCcIdxs = MI.DoHandleClientRequest(command, args, crTab)
     assert(result == nil or type(result) == "string")
 
-    if (fifo ~= nil) then
-        local output = {
-            -- Success status (3 bytes).
-            (errorMsg ~= nil) and "rER" or "rOK",
-            -- Result text.
-            (errorMsg ~= nil) and errorMsg or result,
-            -- Newline.
-            '\n',
+    if (queue ~= nil and waitCcIdxs ~= nil) then
+        local requests = mi.deferredRequests
+        requests[#requests + 1] = {
+            queue = queue, command = command, args = argsCopy, ccIdxs = waitCcIdxs
         }
-
-        fifo:writePipe(table.concat(output))
-        fifo:close()
+    elseif (queue ~= nil) then
+        MI.SendResponse(queue, result, errorMsg)
     end
 end
 
@@ -941,23 +1678,27 @@ function MI.HandleClientRequests(crTab)
 
     local ChunkSize = 4096
 
+    -- Handle all requests that have arrived, one after another. (Each of them is quick,
+    -- since computations are only ever waited for by deferring the response.)
     while (true) do
-        local requests = fifo:readNonblocking(ChunkSize)
+        local chunk = fifo:readNonblocking(ChunkSize)
 
-        if (pipeIsEmpty(requests)) then
+        if (pipeIsEmpty(chunk)) then
             break
         end
 
-        if (#requests == ChunkSize) then
-            -- Bail out: the tail might straddle a message.
-            errorInfoAndExit("Client request FIFO overflow.")
-        end
+        -- NOTE: a request may straddle two chunks.
+        local requests = mi.partialRequest..chunk
+        local lastNewlinePos = requests:match(".*()\n")
 
-        if (requests:sub(-1) ~= "\n") then
-            miInfo("Client request FIFO: possible message loss.")
+        mi.partialRequest = requests:sub((lastNewlinePos or 0) + 1)
+
+        if (#mi.partialRequest > ChunkSize) then
+            miInfo("Client request FIFO: discarding overlong request.")
+            mi.partialRequest = ""
         end
 
-        for request in requests:gmatch("(.-)\n") do
+        for request in requests:sub(1, lastNewlinePos or 0):gmatch("(.-)\n") do
             MI.HandleClientRequest(request, crTab)
         end
     end
@@ -977,29 +1718,56 @@ local function resolveClangBinary(name)
     return realName
 end
 
-compile_commands_util.obtainSystemIncludes(
-    -- NOTE: here, the real name of the binary is required because it is matched in the
-    --  output of the program invocation.
-    resolveClangBinary("clang"),
-    usedConcurrency, compileCommands, CacheDirectory,
-    {
-        errorInfo = errorInfo,
-        errorInfoAndExit = errorInfoAndExit,
-        ExecuteAsync = ExecuteAsync,
-        info = info,
-    }
-)
+-- NOTE: the real name of the binary is required because it is matched in the output of the
+--  program invocation in PrepareCompileCommands().
+local ClangBinaryName = resolveClangBinary("clang")
+
+-- <cmds>: sequence of compile commands, modified in-place.
+-- Returns a function that blocks until the compile command with the given index into
+-- <cmds> (or all of them, if passed nil) has been prepared.
+local function PrepareCompileCommands(cmds)
+    return compile_commands_util.obtainSystemIncludes(
+        ClangBinaryName,
+        usedConcurrency, cmds, CacheDirectory,
+        {
+            errorInfo = errorInfo,
+            errorInfoAndExit = errorInfoAndExit,
+            ExecuteAsync = ExecuteAsync,
+            info = info,
+        }
+    )
+end
+
+-- NOTE: compile commands whose preparation results are cached can be processed right
+--  away; for the others, we only wait right before they are handed to a child.
+--  See Controller:spawnChild().
+local WaitForPreparedCompileCommand = PrepareCompileCommands(compileCommands)
 
 ---------- Automatic precompiled headers ----------
 
+-- [<PCH file basename>] = <absolute PCH file name>, for the PCH files in use.
+local UsedPchFileNames = {}
+
+local function AttachPchFileName(cmd)
+    local pchArgs = cmd.pchArguments
+    assert(cmd.pchFileName == nil)
+
+    if (type(pchArgs) == "table") then
+        cmd.pchFileName = UsedPchFileNames[pchArgs[#pchArgs]]
+    end
+
+    return (cmd.pchFileName ~= nil)
+end
+
+-- Minimum number of compile commands that a PCH file is generated for.
+local PchCountThreshold =
+    usedConcurrency >= 16 and usedConcurrency or
+    -- lower bound: we do not want too many PCH configurations on disk.
+    8 + math.floor(usedConcurrency / 2)
+
 if (autoPch ~= nil) then
     -- First, determine which PCH configurations to use.
 
-    local countThreshold =
-        usedConcurrency >= 16 and usedConcurrency or
-        -- lower bound: we do not want too many PCH configurations on disk.
-        8 + math.floor(usedConcurrency / 2)
-
     local unsupportedCount = 0
     -- { [0] = <unique count>, [<PCH file basename>] = <count> }
     local pchFileCounts = { [0] = 0 }
@@ -1026,7 +1794,7 @@ if (autoPch ~= nil) then
 
             -- Deliberate: if the *new* count is *one greater* than the threshold,
             -- use the PCH configuration.
-            if (oldCount == countThreshold) then
+            if (oldCount == PchCountThreshold) then
                 usedPchArgs[#usedPchArgs + 1] = pchArgs
                 -- Tentatively use. We may still disable usage if PCH generation fails.
                 isPchFileUsed[fn] = true
@@ -1169,16 +1937,15 @@ did not successfully pass test usage with an empty C++ source file.", fn)
 
     local pchEnabledCcCount = 0
 
-    for i, cmd in ipairs(compileCommands) do
-        local pchArgs = cmd.pchArguments
-        assert(cmd.pchFileName == nil)
+    for fn, isUsed in pairs(isPchFileUsed) do
+        if (isUsed) then
+            UsedPchFileNames[fn] = pchDir..'/'..fn
+        end
+    end
 
-        if (type(pchArgs) == "table") then
-            local fn = pchArgs[#pchArgs]
-            if (isPchFileUsed[fn]) then
-                cmd.pchFileName = pchDir..'/'..fn
-                pchEnabledCcCount = pchEnabledCcCount + 1
-            end
+    for _, cmd in ipairs(compileCommands) do
+        if (AttachPchFileName(cmd)) then
+            pchEnabledCcCount = pchEnabledCcCount + 1
         end
     end
 
@@ -1286,29 +2053,330 @@ local function InclusionGraph_ProcessTU(graph, tu)
     return graph
 end
 
+-- Returns the sequence of real names of the directories passed with '-isystem' in <args>.
+-- (This includes the implicit ones, see PrepareCompileCommands().)
+local function GetSystemIncludeDirs(args)
+    local dirs = {}
+
+    for i, arg in ipairs(args) do
+        local dir = (arg == "-isystem") and args[i + 1] or arg:match("^%-isystem(.+)$")
+        local realDir = (dir ~= nil) and posix.realpath(dir) or nil
+
+        if (realDir ~= nil) then
+            dirs[#dirs + 1] = (realDir:sub(-1) == '/') and realDir or realDir..'/'
+        end
+    end
+
+    return dirs
+end
+
+-- Builds the inclusion graph of compile command <cmd> like InclusionGraph_ProcessTU(), but
+-- from running only the preprocessor: with '-H', Clang prints each included file, preceded
+-- by as many dots as its nesting depth. This is considerably cheaper than a parse, even one
+-- that skips function bodies.
+--
+-- Returns nil if the invocation failed, for example due to a missing header.
+local function InclusionGraph_Preprocess(graph, cmd)
+    local args = util.copySequence(cmd.arguments)
+    local extraArgs = { "-E", "-H", "-w", "-o", "/dev/null" }
+
+    for _, extraArg in ipairs(extraArgs) do
+        args[#args + 1] = extraArg
+    end
+
+    local output = ExecuteAsync(ClangBinaryName, args)()
+    if (output == nil) then
+        return nil
+    end
+
+    local systemDirs = GetSystemIncludeDirs(cmd.arguments)
+    local isSystemHeader = function(realName)
+        for _, dir in ipairs(systemDirs) do
+            if (realName:sub(1, #dir) == dir) then
+                return true
+            end
+        end
+        return false
+    end
+
+    local mainRealName = posix.realpath(cmd.file)
+    if (mainRealName == nil) then
+        return nil
+    end
+
+    -- [<depth>] = <real name of the file last seen at that depth, or false if it is a system
+    --  header>
+    local fileAtDepth = { [0] = mainRealName }
+
+    for line in output:gmatch("[^\n]+") do
+        local dots, fileName = line:match("^(%.+) (.+)$")
+        local depth = (dots ~= nil) and #dots or nil
+        -- NOTE: other lines are not of interest, like the ones after "Multiple include
+        --  guards may be useful for:".
+        if (depth ~= nil) then
+            local fromRealName = fileAtDepth[depth - 1]
+            local toRealName = posix.realpath(fileName)
+
+            if (fromRealName == nil or toRealName == nil) then
+                -- Unexpected output. Let the caller parse instead.
+                return nil
+            end
+
+            -- NOTE: like with InclusionGraph_ProcessTU(), system headers are left out (and
+            --  hence everything that is included from them).
+            local isSystem = (fromRealName == false or isSystemHeader(toRealName))
+            fileAtDepth[depth] = (not isSystem) and toRealName or false
+
+            if (not isSystem) then
+                -- KEEPINSYNC 'GlobalInclusionGraphRelation'.
+                graph:addInclusion(toRealName, fromRealName)
+            end
+        end
+    end
+
+    return graph
+end
+
+-- Accumulates the uses of symbols in the main file of compile command #<ccIdx>.
+local SymbolInfoCollector = class
+{
+    function(ccIdx)
+        return {
+            ccIdx = ccIdx,
+            usrIds = {},
+            -- [<USR id>] = ...
+            nameIdOf = {}, useFlagsOf = {}, kindOf = {},
+        }
+    end,
+
+    -- <ref>: the cursor declaring the symbol with USR <usr>.
+    -- <useFlag>: one of the values of 'SymUse'.
+    add = function(self, usr, ref, useFlag)
+        local usrId = (usr ~= "") and SymbolNames:intern(usr) or nil
+
+        if (usrId == nil) then
+            -- TODO: inform the user if the symbol name table is full?
+            return
+        end
+
+        if (self.useFlagsOf[usrId] == nil) then
+            local nameId = SymbolNames:intern(ref:name() or "")
+            if (nameId == nil) then
+                return
+            end
+
+            self.usrIds[#self.usrIds + 1] = usrId
+            self.nameIdOf[usrId] = nameId
+            self.useFlagsOf[usrId] = 0
+            self.kindOf[usrId] = tonumber(ref:kindnum())
+        end
+
+        self.useFlagsOf[usrId] = bit.bor(self.useFlagsOf[usrId], useFlag)
+    end,
+
+    -- Returns a sequence of { <intFlags>, <extFlags> } pairs (see symbol_index.lua), one
+    -- for each symbol added.
+    getSymbolInfos = function(self)
+        local symbolInfos = {}
+
+        for i, usrId in ipairs(self.usrIds) do
+            symbolInfos[i] = {
+                symbol_index.packIntFlags(usrId, self.nameIdOf[usrId]),
+                symbol_index.packExtFlags(self.ccIdx, self.useFlagsOf[usrId],
+                                          self.kindOf[usrId]),
+            }
+        end
+
+        return symbolInfos
+    end,
+}
+
+-- Returns a sequence of { <intFlags>, <extFlags> } pairs (see symbol_index.lua), one for
+-- each symbol declared, defined or referenced in the main file of <tu>.
+local function GetSymbolInfos(tu, ccIdx)
+    local collector = SymbolInfoCollector(ccIdx)
+
+    local handleCursor = function(cur)
+        local ref = cur:referenced()
+        local usr = (ref ~= nil) and ref:USR() or ""
+
+        local useFlag =
+            (cur ~= ref) and SymUse.Reference or
+            cur:isDefinition() and SymUse.Definition or
+            SymUse.Declaration
+
+        collector:add(usr, ref, useFlag)
+    end
+
+    -- NOTE: only descend into top-level cursors from the main file so that we do not
+    --  traverse the (typically much larger) ASTs of the included headers.
+    local topLevelCursors = tu:cursor():find(nil, nil, 1)
+
+    for i = 0, #topLevelCursors - 1 do
+        local topCur = topLevelCursors.cursors[i]
+
+        if (topCur:isFromMainFile()) then
+            handleCursor(topCur)
+
+            local descendants = topCur:collect()
+            for j = 0, #descendants - 1 do
+                handleCursor(descendants.cursors[j])
+            end
+        end
+    end
+
+    return collector:getSymbolInfos()
+end
+
 local MOVE_OR_DELETE = bit.bor(IN.MOVE_SELF, IN.DELETE_SELF)
 local WATCH_FLAGS = bit.bor(IN.CLOSE_WRITE, MOVE_OR_DELETE)
 
 ---------- Main ----------
 
-local function DoProcessCompileCommand(cmd, parseOptions)
+-- Returns the arguments to parse compile command <cmd> with, or nil and an error message
+-- if its file does not exist.
+local function GetParseArgs(cmd)
     local fileExists, msg = exists(cmd.file)
     if (not fileExists) then
         return nil, msg
     end
 
     local args = util.copySequence(cmd.arguments)
+    -- NOTE: a project PCH also contains the standard library headers. See option -A.
+    local pchFileName = cmd.projectPchFileName or cmd.pchFileName
 
     -- TODO: catch a possible error at this stage.
-    if (cmd.pchFileName ~= nil) then
+    if (pchFileName ~= nil) then
         table.insert(args, 1, "-include-pch")
-        table.insert(args, 2, cmd.pchFileName)
+        table.insert(args, 2, pchFileName)
     end
 
-    local index = cl.createIndex(true, false)
+    return args
+end
+
+-- <index>: optional. If nil, a new index is created for the compile command.
+local function DoProcessCompileCommand(cmd, parseOptions, index)
+    local args, msg = GetParseArgs(cmd)
+    if (args == nil) then
+        return nil, msg
+    end
+
+    index = index or cl.createIndex(true, false)
     return index:parse("", args, parseOptions)
 end
 
+---------- Single-pass indexing (option -I) ----------
+
+-- State of the running IndexCompileCommand(), accessed by the indexer callbacks.
+local IndexerState
+
+local function AddIndexedSymbol(loc, usr, ref, useFlag)
+    local collector = IndexerState.symbolCollector
+
+    if (collector ~= nil and loc ~= nil and loc:isFromMainFile()) then
+        collector:add(usr or "", ref, useFlag)
+    end
+end
+
+-- NOTE: created once, since the FFI callbacks are anchored permanently.
+local IndexerCallbacks
+
+local function GetIndexerCallbacks()
+    if (IndexerCallbacks == nil) then
+        IndexerCallbacks = cl.IndexerCallbacks{
+            ppIncludedFile = function(incFileInfo)
+                local hashLoc = incFileInfo.hashLoc
+
+                -- NOTE: system headers never include user files, so skip their inclusions
+                --  early. (See InclusionGraph_ProcessTU().)
+                if (hashLoc == nil or hashLoc:isInSystemHeader()) then
+                    return
+                end
+
+                -- NOTE: with "-include", the '#include' is in the predefines buffer, which
+                --  has no file. Like with InclusionGraph_ProcessTU(), skip it.
+                local fromFile = hashLoc:fileSite()
+                local includedFile = incFileInfo.file
+
+                if (fromFile ~= nil and includedFile ~= nil) then
+                    local inclusions = IndexerState.inclusions
+                    inclusions[#inclusions + 1] = { fromFile, includedFile }
+                end
+            end,
+
+            indexDeclaration = function(declInfo)
+                local useFlag = declInfo.isDefinition and SymUse.Definition or
+                    SymUse.Declaration
+                AddIndexedSymbol(declInfo.loc, declInfo.entityInfo.USR,
+                                 declInfo.cursor, useFlag)
+            end,
+
+            indexEntityReference = function(refInfo)
+                local entityInfo = refInfo.referencedEntity
+                if (entityInfo ~= nil) then
+                    AddIndexedSymbol(refInfo.loc, entityInfo.USR,
+                                     entityInfo.cursor, SymUse.Reference)
+                end
+            end,
+        }
+    end
+
+    return IndexerCallbacks
+end
+
+-- Indexes compile command #<ccIdx> with one clang_indexSourceFile() invocation in
+-- <session>, which should be kept across compile commands so that the bodies of headers
+-- indexed before are skipped.
+--
+-- Returns the translation unit, the inclusion graph (like InclusionGraph_ProcessTU()) and
+-- the symbol infos (like GetSymbolInfos(), with -S). On failure, returns nil and the error
+-- code or message.
+local function IndexCompileCommand(ccIdx, parseOptions, session)
+    local args, msg = GetParseArgs(compileCommands[ccIdx])
+    if (args == nil) then
+        return nil, msg
+    end
+
+    IndexerState = {
+        inclusions = {},  -- sequence of { <File of includer>, <File of included file> }
+        symbolCollector = (SymIndex ~= nil) and SymbolInfoCollector(ccIdx) or nil,
+    }
+
+    local tu, errorCode = session:indexSourceFile(
+        GetIndexerCallbacks(), {"SkipParsedBodiesInSession"}, "", args, parseOptions)
+    local state = IndexerState
+    IndexerState = nil
+
+    if (tu == nil) then
+        return nil, errorCode
+    end
+
+    local graph = InclusionGraph()
+    -- [<real name of the included file>] = <is it a system header?>
+    local isSystemHeader = {}
+
+    for _, inclusion in ipairs(state.inclusions) do
+        local fromFile, includedFile = inclusion[1], inclusion[2]
+        local toRealName = checkAndGetRealName(includedFile)
+
+        if (isSystemHeader[toRealName] == nil) then
+            -- NOTE: the File passed to the callback cannot tell, lacking a translation unit.
+            local tuFile = tu:file(includedFile:name())
+            isSystemHeader[toRealName] = (tuFile ~= nil and tuFile:isSystemHeader())
+        end
+
+        if (not isSystemHeader[toRealName]) then
+            -- KEEPINSYNC 'GlobalInclusionGraphRelation'.
+            graph:addInclusion(toRealName, checkAndGetRealName(fromFile))
+        end
+    end
+
+    local symbolInfos = (state.symbolCollector ~= nil) and
+        state.symbolCollector:getSymbolInfos() or nil
+
+    return tu, errorCode, graph, symbolInfos
+end
+
 local function info_underline(fmt, ...)
     local text = format(fmt, ...)
     local func = printGraphMode and errprintf or printf
@@ -1317,12 +2385,261 @@ local function info_underline(fmt, ...)
          colorize(": "..text, Col.Uline..Col.White))
 end
 
-local function ProcessCompileCommand(ccIndex, parseOptions)
+-- Translation units kept resident by a worker (option -T), for the most recently
+-- processed compile commands.
+local TUCache = class
+{
+    function(capacity)
+        checktype(capacity, 1, "number", 2)
+
+        return {
+            capacity = capacity,
+            tus = {},  -- [<ccIdx>] = TranslationUnit_t
+            ccIdxs = {},  -- sequence of keys of 'tus', most recently used last
+        }
+    end,
+
+    -- Remove the translation unit for compile command #<ccIdx> from the cache and
+    -- return it, or nil if there is none.
+    take = function(self, ccIdx)
+        local tu = self.tus[ccIdx]
+
+        if (tu ~= nil) then
+            self.tus[ccIdx] = nil
+
+            for i, idx in ipairs(self.ccIdxs) do
+                if (idx == ccIdx) then
+                    table.remove(self.ccIdxs, i)
+                    break
+                end
+            end
+        end
+
+        return tu
+    end,
+
+    put = function(self, ccIdx, tu)
+        assert(self.tus[ccIdx] == nil)
+
+        self.tus[ccIdx] = tu
+        self.ccIdxs[#self.ccIdxs + 1] = ccIdx
+
+        if (#self.ccIdxs > self.capacity) then
+            local evictedCcIdx = table.remove(self.ccIdxs, 1)
+            self.tus[evictedCcIdx] = nil
+        end
+    end,
+}
+
+-- Options that the results of a compile command depend on, besides the compile command
+-- itself. Stored results obtained with different ones are not used.
+local ResultOptionFlags = bit.bor(plainMode and 1 or 0, printAllDiags and 2 or 0,
+                                  indexSymbols and 4 or 0, useIndexer and 8 or 0)
+
+-- Identifies a compile command across runs.
+local function GetCcSignature(cmd)
+    return table.concat({ cmd.file, cmd.directory, cmd.pchFileName or "",
+                          table.concat(cmd.arguments, '\0') }, '\0')
+end
+
+-- With -k: the cache of compile command results, validated by file contents. Its
+-- signatures identify the libclang version and the relevant options, too.
+local CcResultCache = (resultCacheDirectory ~= nil) and ResultCache(resultCacheDirectory) or nil
+
+-- NOTE: the compile command's file and directory names are absolute, as are the file names
+--  that the stored results refer to. Entries are hence only found for a checkout at the
+--  same path as the one that populated the cache.
+local function GetResultCacheSignature(cmd, parseOptions)
+    return table.concat({ cl.clangVersion(), tostring(ResultOptionFlags),
+                          table.concat(parseOptions, ','), GetCcSignature(cmd) }, '\0')
+end
+
+-- Returns the formatted diagnostic set, the inclusion graph and the symbol infos (with -S)
+-- of compile command #<ccIdx> from the result cache, or nil if there is no valid entry.
+local function LookupCachedResults(ccIdx, signature)
+    local diagsStr, graphStr, symbols = CcResultCache:lookup(signature)
+    if (diagsStr == nil) then
+        return nil
+    end
+
+    local ok, fDiagSet, graph = pcall(function()
+        return diagnostics_util.FormattedDiagSet_Deserialize(diagsStr, not plainMode),
+            inclusion_graph.Deserialize(graphStr)
+    end)
+
+    if (not ok) then
+        return nil
+    end
+
+    local symbolInfos = nil
+
+    if (SymIndex ~= nil) then
+        symbolInfos = {}
+
+        for _, symbol in ipairs(symbols) do
+            local usrId, nameId = SymbolNames:intern(symbol[1]), SymbolNames:intern(symbol[2])
+
+            if (usrId ~= nil and nameId ~= nil) then
+                symbolInfos[#symbolInfos + 1] = {
+                    symbol_index.packIntFlags(usrId, nameId),
+                    symbol_index.packExtFlags(ccIdx, symbol[3], symbol[4]),
+                }
+            end
+        end
+    end
+
+    return fDiagSet, graph, symbolInfos
+end
+
+local function StoreCachedResults(ccIdx, signature, fDiagSet, graph, symbolInfos, startTime)
+    local mainFileName = compileCommands[ccIdx].file
+    local fileNames = { mainFileName }
+
+    for _, fileName in graph:iFileNames() do
+        if (fileName ~= mainFileName) then
+            fileNames[#fileNames + 1] = fileName
+        end
+    end
+
+    local symbols = {}
+
+    for i, symbolInfo in ipairs(symbolInfos or {}) do
+        local usrId, nameId = symbol_index.unpackIntFlags(symbolInfo[1])
+        local _, useFlags, cursorKind = symbol_index.unpackExtFlags(symbolInfo[2])
+        symbols[i] = { SymbolNames:getString(usrId), SymbolNames:getString(nameId),
+                       useFlags, cursorKind }
+    end
+
+    CcResultCache:store(signature, fileNames, fDiagSet:serialize(), graph:serialize(),
+                        symbols, startTime)
+end
+
+local function GetMonotonicSeconds()
+    local ts = posix.clock_gettime()
+    return tonumber(ts.sec) + tonumber(ts.nsec) / 1e9
+end
+
+-- Resets the peak resident set size of this process to the current one.
+-- NOTE: Linux-specific (see "/proc/[pid]/clear_refs" in "man 5 proc"). On failure, the
+--  peak includes the usage before the call.
+local function ResetPeakRss()
+    local f = io.open("/proc/self/clear_refs", "w")
+    if (f ~= nil) then
+        f:write("5")
+        f:close()
+    end
+end
+
+-- Returns the peak resident set size of this process in KiB, or 0 if unknown.
+local function GetPeakRssKb()
+    return GetProcStatusKb("self", "VmHWM")
+end
+
+-- Returns a cost table as stored into CcCosts for processing that started at <startTime>
+-- (as returned by GetMonotonicSeconds()), after a call to ResetPeakRss().
+-- <isFullParse>: whether the compile command was parsed from scratch. Only then is the
+--  cost representative of processing it (see SetCcCost()): results from the result cache
+--  (-k), inclusion graphs from the preprocessor (-g) and reparses of cached translation
+--  units (-T) are far cheaper.
+local function GetCost(startTime, phaseUs, isFullParse)
+    return {
+        wallMs = math.floor(1000 * (GetMonotonicSeconds() - startTime) + 0.5),
+        peakRssKb = GetPeakRssKb(),
+        phaseUs = phaseUs,
+        isFullParse = isFullParse,
+    }
+end
+
+-- Adds the time elapsed since <startTime> (as returned by GetMonotonicSeconds()) to
+-- <phaseUs>[Phase[<phaseName>]] and returns the current time, for timing the next phase.
+local function AddPhaseTime(phaseUs, phaseName, startTime)
+    local currentTime = GetMonotonicSeconds()
+    local idx = Phase[phaseName]
+    phaseUs[idx] = (phaseUs[idx] or 0) + math.floor(1e6 * (currentTime - startTime) + 0.5)
+    return currentTime
+end
+
+-- <index>, <tuCache>, <indexSession>: optional. The latter is only used with -I.
+-- Returns the formatted diagnostic set, the inclusion graph, the symbol infos (with -S) and
+-- the cost (see GetCost()), which includes the durations of the child phases.
+local function ProcessCompileCommand(ccIndex, parseOptions, index, tuCache, indexSession)
+    local costStartTime = GetMonotonicSeconds()
+    ResetPeakRss()
+
+    local phaseUs = {}
+    for i = 1, #ChildPhases do
+        phaseUs[i] = 0
+    end
+    local phaseStartTime = costStartTime
+
+    local cacheSignature = (CcResultCache ~= nil) and
+        GetResultCacheSignature(compileCommands[ccIndex], parseOptions) or nil
+
+    if (cacheSignature ~= nil) then
+        local fDiagSet, graph, symbolInfos = LookupCachedResults(ccIndex, cacheSignature)
+        phaseStartTime = AddPhaseTime(phaseUs, "cache", phaseStartTime)
+
+        if (fDiagSet ~= nil) then
+            return fDiagSet, graph, symbolInfos, GetCost(costStartTime, phaseUs, false)
+        end
+    end
+
+    local startTime = os.time()
+
+    if (printGraphMode ~= nil) then
+        -- Only the inclusion graph is of interest, so try to get by without a parse.
+        local inclusionGraph = InclusionGraph_Preprocess(
+            InclusionGraph(), compileCommands[ccIndex])
+        phaseStartTime = AddPhaseTime(phaseUs, "graph", phaseStartTime)
+
+        if (inclusionGraph ~= nil) then
+            local formattedDiagSet = diagnostics_util.FormattedDiagSet(not plainMode)
+
+            if (cacheSignature ~= nil) then
+                StoreCachedResults(ccIndex, cacheSignature, formattedDiagSet, inclusionGraph,
+                                   nil, startTime)
+                AddPhaseTime(phaseUs, "cache", phaseStartTime)
+            end
+
+            return formattedDiagSet, inclusionGraph, nil,
+                GetCost(costStartTime, phaseUs, false)
+        end
+
+        -- NOTE: otherwise, the parse below provides the diagnostics that tell why.
+    end
+
     local tu, errorCodeOrString
     local formattedDiagSet
+    -- With -I, obtained by the indexing pass (but not when a cached TU was reparsed).
+    local inclusionGraph, symbolInfos
+
+    if (tuCache ~= nil) then
+        tu = tuCache:take(ccIndex)
+
+        if (tu ~= nil) then
+            -- NOTE: on failure, fall back to parsing anew below.
+            tu = tu:reparse()
+        end
+    end
+
+    local isFullParse = (tu == nil)
+
+    if (tu == nil and useIndexer) then
+        local session = indexSession or (index or cl.createIndex(true, false)):createSession()
+        tu, errorCodeOrString, inclusionGraph, symbolInfos =
+            IndexCompileCommand(ccIndex, parseOptions, session)
+    elseif (tu == nil) then
+        tu, errorCodeOrString = DoProcessCompileCommand(
+            compileCommands[ccIndex], parseOptions, index)
+    end
+
+    if (tu ~= nil) then
+        -- The same files and referenced declarations recur in the inclusion callbacks and
+        -- the symbol indexing below.
+        tu:memoizeStrings()
+    end
 
-    tu, errorCodeOrString = DoProcessCompileCommand(
-        compileCommands[ccIndex], parseOptions)
+    phaseStartTime = AddPhaseTime(phaseUs, "parse", phaseStartTime)
 
     if (tu == nil) then
         formattedDiagSet = diagnostics_util.FormattedDiagSet(not plainMode)
@@ -1336,16 +2653,49 @@ local function ProcessCompileCommand(ccIndex, parseOptions)
             tu:diagnosticSet(), not plainMode, printAllDiags)
     end
 
-    local inclusionGraph = (tu ~= nil) and
-        InclusionGraph_ProcessTU(InclusionGraph(), tu) or
-        InclusionGraph()
+    phaseStartTime = AddPhaseTime(phaseUs, "diags", phaseStartTime)
 
-    -- Make LuaJIT release libclang-allocated TU memory.
+    if (inclusionGraph == nil) then
+        inclusionGraph = (tu ~= nil) and
+            InclusionGraph_ProcessTU(InclusionGraph(), tu) or
+            InclusionGraph()
+    end
+
+    if (tu ~= nil) then
+        local cmd = compileCommands[ccIndex]
+
+        for _, fileName in ipairs(cmd.projectPchDeps or {}) do
+            -- The files from a PCH are not reported as inclusions, but the compile command
+            -- depends on them nevertheless.
+            inclusionGraph:addInclusion(fileName, cmd.file)
+        end
+    end
+
+    phaseStartTime = AddPhaseTime(phaseUs, "graph", phaseStartTime)
+
+    if (symbolInfos == nil and SymIndex ~= nil and tu ~= nil) then
+        symbolInfos = GetSymbolInfos(tu, ccIndex)
+    end
+
+    phaseStartTime = AddPhaseTime(phaseUs, "symbols", phaseStartTime)
+
+    if (cacheSignature ~= nil and tu ~= nil) then
+        StoreCachedResults(ccIndex, cacheSignature, formattedDiagSet, inclusionGraph,
+                           symbolInfos, startTime)
+        AddPhaseTime(phaseUs, "cache", phaseStartTime)
+    end
+
+    if (tuCache ~= nil and tu ~= nil) then
+        tuCache:put(ccIndex, tu)
+    end
+
+    -- Make LuaJIT release libclang-allocated TU memory (that is not kept in the cache).
     tu = nil
     collectgarbage()
 
     assert(formattedDiagSet ~= nil and inclusionGraph ~= nil)
-    return formattedDiagSet, inclusionGraph
+    return formattedDiagSet, inclusionGraph, symbolInfos,
+        GetCost(costStartTime, phaseUs, isFullParse)
 end
 
 local OnDemandParser = class
@@ -1360,6 +2710,8 @@ local OnDemandParser = class
 
             formattedDiagSets = {},
             inclusionGraphs = {},
+            symbolInfos = {},
+            costs = {},
         }
     end,
 
@@ -1374,18 +2726,19 @@ local OnDemandParser = class
         local tus, errorCodes = self.tus, self.errorCodes
 
         if (self.formattedDiagSets[i] == nil) then
-            self.formattedDiagSets[i], self.inclusionGraphs[i] =
-                ProcessCompileCommand(self.ccIndexes[i], self.parseOptions)
+            self.formattedDiagSets[i], self.inclusionGraphs[i], self.symbolInfos[i],
+                self.costs[i] = ProcessCompileCommand(self.ccIndexes[i], self.parseOptions)
         end
 
-        return self.formattedDiagSets[i], self.inclusionGraphs[i]
+        return self.formattedDiagSets[i], self.inclusionGraphs[i], self.symbolInfos[i],
+            self.costs[i]
     end,
 
     iterate = function(self)
         local next = function(_, i)
             i = i+1
             if (i <= self:getCount()) then
-                -- NOTE: four return values.
+                -- NOTE: six return values.
                 return i, self.ccIndexes[i], self:getResults(i)
             end
         end
@@ -1412,7 +2765,7 @@ local function PrintInclusionGraphAsGraphvizDot(graph)
     graph:printAsGraphvizDot(title, reverse, commonPrefix, edgeCountLimit, printf)
 end
 
-local function GetNewCcIndexes(ccInclusionGraphs, eventFileNames,
+local function GetNewCcIndexes(ccInclusionGraphs, notifier, eventFileNames,
                                processedCommandCount, oldCcIdxs)
     assert(processedCommandCount <= #oldCcIdxs)
 
@@ -1429,32 +2782,30 @@ local function GetNewCcIndexes(ccInclusionGraphs, eventFileNames,
         end
     end
 
-    local isCompileCommandAffected = function(ccIdx)
-        local incGraph = ccInclusionGraphs[ccIdx]
-        if (incGraph == nil) then
-            assert(commandMode)
-            return false
-        end
-
-        for i = 1, #eventFileNames do
-            if (incGraph:getNode(eventFileNames[i]) ~= nil) then
-                return true
-            end
-        end
+    -- 1. compile commands affected by the files on which we had a watch event. Excluded are
+    --  those that were last handed to a child after the last event for each such file they
+    --  depend on: it happened while processing and their results are current already.
+    local affectedIndexes = {}
+    local isCompileCommandAffected = {}
 
-        return false
-    end
+    for _, fileName in ipairs(eventFileNames) do
+        -- Files not in the table are not in any inclusion graph either.
+        local fileId = FileNames:getId(fileName)
 
-    local indexes, affectedIndexes = {}, {}
+        for _, ccIdx in ipairs(fileId ~= nil and CcReverseDeps:getCcIdxs({fileId}) or {}) do
+            assert(ccIdx <= ccEndIdx and ccInclusionGraphs[ccIdx] ~= nil)
 
-    -- 1. compile commands affected by the files on which we had a watch event.
-    for ccIdx = 1, ccEndIdx do
-        if (isCompileCommandAffected(ccIdx)) then
-            affectedIndexes[#affectedIndexes + 1] = ccIdx
-            indexes[#indexes + 1] = ccIdx
+            if (not isCompileCommandAffected[ccIdx] and
+                    notifier:hadEventSince(fileName, CcDispatchEventRounds[ccIdx] or 0)) then
+                affectedIndexes[#affectedIndexes + 1] = ccIdx
+                isCompileCommandAffected[ccIdx] = true
+            end
         end
     end
 
+    table.sort(affectedIndexes)
+    local indexes = util.copySequence(affectedIndexes)
+
     -- 2. compile commands left over if we stopped early in incremental mode or due to a
     --  detected file change. (Also see NOTE STOPPED_EARLY.)
     if (processedCommandCount < #oldCcIdxs) then
@@ -1490,7 +2841,7 @@ local function GetNewCcIndexes(ccInclusionGraphs, eventFileNames,
         local cmNewIndexes = util.copySequence(affectedIndexes)
 
         for _, ccIdx in ipairs(newIndexes) do
-            if (not isCompileCommandAffected(ccIdx)) then
+            if (not isCompileCommandAffected[ccIdx]) then
                 cmNewIndexes[#cmNewIndexes + 1] = ccIdx
             end
         end
@@ -1518,11 +2869,6 @@ local function getFileOrdinalText(cmd, i)
         or ""
 end
 
-local function getNormalizedDiag(diagStr)
-    -- TODO: inform user about the number of different sites that the diagnostics came from.
-    return diagStr:gsub("In file included from [^\n]*\n", "")
-end
-
 local function getSeverityString(count, severity, color)
     return count > 0 and pluralize(count, severity, 's', Col.Bold..color) or nil
 end
@@ -1604,12 +2950,15 @@ FormattedDiagSetPrinter = class
         local IsTrackedSeverity = { fatal=true, error=true, warning=true }
 
         for i, fDiag in ipairs(fDiags) do
-            local str = fDiag:getString(not plainMode)
-            local normStr = getNormalizedDiag(str)
-
-            if (printAllDiags or not self.seenDiags[normStr]) then
-                newSeenDiags[#newSeenDiags + 1] = normStr
-                toPrint[#toPrint+1] = format("%s%s", (i == 1) and "" or "\n", str)
+            -- NOTE: a diagnostic is only formatted if it is printed.
+            -- TODO: inform user about the number of different sites that the diagnostics
+            --  came from.
+            local key = hashString(fDiag:getKey())
+
+            if (printAllDiags or not self.seenDiags[key]) then
+                newSeenDiags[#newSeenDiags + 1] = key
+                toPrint[#toPrint+1] = format("%s%s", (i == 1) and "" or "\n",
+                                             fDiag:getString(not plainMode))
             else
                 local severity = fDiag:getSeverity()
                 local severityTag = IsTrackedSeverity[severity]
@@ -1704,12 +3053,28 @@ local DoneHeader_t = class
 {
     "char magic[4];"..
     "uint32_t diagsStrLength;"..
-    "uint32_t graphStrLength;",
-
-    __new = function(ct, length1, length2)
+    "uint32_t graphStrLength;"..
+    -- With -S: the range of pages of the child's local symbol page array that it has
+    -- stored the compile command's symbols into.
+    "uint32_t symPageStart;"..
+    "uint32_t symPageCount;"..
+    -- With -S: whether the symbols were dropped since the local symbol page array of the
+    -- child was exhausted.
+    "uint32_t symbolsDropped;"..
+    -- The cost of processing the compile command, see GetCost().
+    "uint32_t wallMs;"..
+    "uint32_t peakRssKb;"..
+    "uint32_t isFullParse;"..
+    -- The durations of the child phases in microseconds, see ChildPhases.
+    "uint32_t phaseUs[6];",
+
+    __new = function(ct, length1, length2, symPageStart, symPageCount, symbolsDropped, cost)
         -- NOTE: 'magic' deliberately not zero-terminated. See
         -- http://lua-users.org/lists/lua-l/2011-01/msg01457.html
-        return ffi.new(ct, "Done", length1, length2)
+        return ffi.new(ct, "Done", length1, length2, symPageStart or 0, symPageCount or 0,
+                       symbolsDropped and 1 or 0,
+                       cost and cost.wallMs or 0, cost and cost.peakRssKb or 0,
+                       (cost and cost.isFullParse) and 1 or 0, cost and cost.phaseUs or {})
     end,
 
     deserialize = function(self)
@@ -1717,34 +3082,242 @@ local DoneHeader_t = class
             magic = ffi.string(self.magic, 4),
             diagsStrLength = tonumber(self.diagsStrLength),
             graphStrLength = tonumber(self.graphStrLength),
+            symPageStart = tonumber(self.symPageStart),
+            symPageCount = tonumber(self.symPageCount),
+            symbolsDropped = (self.symbolsDropped ~= 0),
+            wallMs = tonumber(self.wallMs),
+            peakRssKb = tonumber(self.peakRssKb),
+            isFullParse = (self.isFullParse ~= 0),
+            phaseUs = self:getPhaseTimes_(),
         }
     end,
-}
 
-local ChildMarker = {
-    isChild = function()
-        return true
+-- private:
+    getPhaseTimes_ = function(self)
+        local phaseUs = {}
+        for i = 1, #ChildPhases do
+            phaseUs[i] = tonumber(self.phaseUs[i - 1])
+        end
+        return phaseUs
     end,
 }
 
-local ParentMarker = {
-    isChild = function()
-        return false
-    end,
-}
+assert(ffi.sizeof(DoneHeader_t(0, 0).phaseUs) == 4 * #ChildPhases)
 
--- Monitors all files that directly named by any compile command or reached by #include,
--- as well as the compile_commands.json file itself.
-local Notifier = class
-{
-    function()
-        local inotifier = inotify.init()
-        local compileCommandsWd = inotifier:add_watch(compileCommandsFile, WATCH_FLAGS)
+-- <symbolInfos>: nil, or as returned by GetSymbolInfos(). In the latter case, they are
+--  stored into the local symbol pages of the connection and only the page range is sent.
+-- <cost>: see GetCost().
+local function SendResults(connection, fDiagSet, incGraph, symbolInfos, cost)
+    local startTime = GetMonotonicSeconds()
+    local fDiagsStr = fDiagSet:serialize()
+    local graphStr = incGraph:serialize(FileNames)
+    local symPageStart, symPageCount
+    local symbolsDropped = false
 
-        return {
+    if (cost ~= nil) then
+        AddPhaseTime(cost.phaseUs, "serialize", startTime)
+    end
+
+    if (symbolInfos ~= nil) then
+        symPageStart, symPageCount = SymIndex:storeLocal(
+            connection.localPageArrayIdx, symbolInfos)
+        -- NOTE: the parent informs the user, see Controller:setupConcurrency().
+        symbolsDropped = (symPageStart == nil)
+    end
+
+    local header = DoneHeader_t(#fDiagsStr, #graphStr, symPageStart, symPageCount,
+                                symbolsDropped, cost)
+    connection.w:write(header)
+    connection.w:write(fDiagsStr)
+    connection.w:write(graphStr)
+end
+
+local JobHeader_t = class
+{
+    "char magic[4];"..
+    "uint32_t ccIdx;",
+
+    __new = function(ct, ccIdx)
+        -- NOTE: 'magic' deliberately not zero-terminated, see DoneHeader_t.
+        return ffi.new(ct, "Job!", ccIdx)
+    end,
+
+    deserialize = function(self)
+        return {
+            magic = ffi.string(self.magic, 4),
+            ccIdx = tonumber(self.ccIdx),
+        }
+    end,
+}
+
+-- Main loop of a worker process of a WorkerPool: process compile commands as they are
+-- handed to us and send back the results, until the parent closes its end of the pipe.
+local function RunWorker(connection, parseOptions)
+    local index = cl.createIndex(true, false)
+    -- NOTE: kept across compile commands so that headers are indexed only once. See -I.
+    local indexSession = useIndexer and index:createSession() or nil
+    local jobHeader = JobHeader_t(0)
+    local tuCache = nil
+
+    if (tuCacheSize ~= nil) then
+        tuCache = TUCache(tuCacheSize)
+
+        parseOptions = util.copySequence(parseOptions)
+        parseOptions[#parseOptions + 1] = "PrecompiledPreamble"
+        parseOptions[#parseOptions + 1] = "CacheCompletionResults"
+    end
+
+    while (true) do
+        local _, bytesRead = connection.r:readInto(jobHeader, true)
+        if (bytesRead == 0) then
+            os.exit(0)
+        end
+
+        -- NOTE: writes to a pipe of at most PIPE_BUF bytes are atomic.
+        assert(bytesRead == ffi.sizeof(jobHeader))
+        local job = jobHeader:deserialize()
+        assert(job.magic == "Job!")
+
+        local fDiagSet, incGraph, symbolInfos, cost = ProcessCompileCommand(
+            job.ccIdx, parseOptions, index, tuCache, indexSession)
+        SendResults(connection, fDiagSet, incGraph, symbolInfos, cost)
+    end
+end
+
+-- A set of processes forked once and reused for all compile commands (option -W).
+-- Compared to forking a child for each compile command, this saves the fork() itself, the
+-- subsequent copy-on-write page faults and the creation of a new CXIndex.
+local WorkerPool = class
+{
+    function(workerCount, parseOptions)
+        checktype(workerCount, 1, "number", 2)
+        checktype(parseOptions, 2, "table", 2)
+
+        -- Sequence of Connection instances, indexed by worker index.
+        local connections = {}
+        -- Stack of indexes of workers that do not have a compile command to process.
+        local idleWorkers = {}
+
+        for i = 1, workerCount do
+            local pipes = PipePair()
+            local whoami, childPid = posix.fork()
+            local connection = pipes:getConnection(whoami, childPid)
+            connection.localPageArrayIdx = i
+
+            if (whoami == "child") then
+                -- Do not keep the pipes to our siblings open: they need to see EOF as soon
+                -- as the parent closes its ends.
+                for _, conn in ipairs(connections) do
+                    conn:close()
+                end
+
+                RunWorker(connection, parseOptions)
+                assert(false)
+            end
+
+            connection.workerIndex = i
+            connections[i] = connection
+            idleWorkers[i] = i
+        end
+
+        return {
+            connections = connections,
+            idleWorkers = idleWorkers,
+            -- [<ccIdx>] = <index of the worker that the compile command was last handed to>
+            lastWorkerFor = {},
+        }
+    end,
+
+    getIdleCount = function(self)
+        return #self.idleWorkers
+    end,
+
+    -- Hand compile command #<ccIdx> to an idle worker and return the Connection to it.
+    -- Prefer the worker that processed it last, which may have its translation unit cached.
+    dispatch = function(self, ccIdx)
+        local idleWorkers = self.idleWorkers
+        assert(#idleWorkers > 0, "no idle worker")
+
+        local ii = #idleWorkers
+
+        for i, workerIdx in ipairs(idleWorkers) do
+            if (workerIdx == self.lastWorkerFor[ccIdx]) then
+                ii = i
+                break
+            end
+        end
+
+        local workerIdx = table.remove(idleWorkers, ii)
+        self.lastWorkerFor[ccIdx] = workerIdx
+
+        local connection = self.connections[workerIdx]
+        connection.w:write(JobHeader_t(ccIdx))
+        return connection
+    end,
+
+    release = function(self, connection)
+        local workerIdx = connection.workerIndex
+        assert(self.connections[workerIdx] == connection)
+        self.idleWorkers[#self.idleWorkers + 1] = workerIdx
+    end,
+
+    shutdown = function(self)
+        assert(self:getIdleCount() == #self.connections)
+
+        for _, conn in ipairs(self.connections) do
+            conn:close()
+        end
+
+        for _, conn in ipairs(self.connections) do
+            posix.waitpid(conn.childPid, 0)
+        end
+
+        self.connections = {}
+        self.idleWorkers = {}
+    end,
+}
+
+local ChildMarker = {
+    isChild = function()
+        return true
+    end,
+}
+
+local ParentMarker = {
+    isChild = function()
+        return false
+    end,
+}
+
+-- Monitors all files that directly named by any compile command or reached by #include,
+-- as well as the compile_commands.json file itself.
+--
+-- Events are collected into a pending set until they are taken. Each collection of a batch
+-- of events starts a new 'event round', and the last round in which each file had an
+-- event is recorded. This way, results can be checked against the modifications that
+-- happened after their compile command was handed to a child (see NOTE STALE_RESULT).
+local Notifier = class
+{
+    function()
+        local inotifier = inotify.init()
+        local compileCommandsWd = inotifier:add_watch(compileCommandsFile, WATCH_FLAGS)
+
+        return {
             inotifier = inotifier,
             fileNameWdMap = util.Bimap("string", "number"),
             compileCommandsWd = compileCommandsWd,
+            -- [<wd>] = true for watches on files that were replaced as compile_commands.json.
+            isFormerCompileCommandsWd = {},
+
+            eventRound = 0,
+            -- [<file name>] = <last event round in which the file had an event>
+            lastEventRoundOf = {},
+
+            -- Sequence of the names of the files other than compile_commands.json that had
+            -- events since the last takeEvents(), each named once.
+            pendingFileNames = {},
+            isPendingFileName = {},
+            havePendingCompileCommandsEvent = false,
         }
     end,
 
@@ -1778,14 +3351,68 @@ local Notifier = class
         return self.inotifier:getRawFd()
     end,
 
-    check_ = function(self)
+    getEventRound = function(self)
+        return self.eventRound
+    end,
+
+    -- Returns whether the file <fileName> had an event after event round <round>.
+    hadEventSince = function(self, fileName, round)
+        return ((self.lastEventRoundOf[fileName] or 0) > round)
+    end,
+
+    hasPendingEvents = function(self)
+        return (#self.pendingFileNames > 0 or self.havePendingCompileCommandsEvent)
+    end,
+
+    -- Waits for a batch of events and adds them to the pending ones. Returns whether there
+    -- were any events for compile_commands.json among them.
+    collectEvents = function(self)
         assert(self.inotifier ~= nil)
 
         local events = self.inotifier:waitForEvents()
+        local haveCompileCommandsEvent = false
+
+        self.eventRound = self.eventRound + 1
+
         for i = 1, #events do
-            self:checkEvent_(events[i])
+            if (self:checkEvent_(events[i])) then
+                haveCompileCommandsEvent = true
+            else
+                local fileName = self:getFileName(events[i])
+                self.lastEventRoundOf[fileName] = self.eventRound
+
+                if (not self.isPendingFileName[fileName]) then
+                    self.isPendingFileName[fileName] = true
+                    self.pendingFileNames[#self.pendingFileNames + 1] = fileName
+                end
+            end
+        end
+
+        self.havePendingCompileCommandsEvent =
+            self.havePendingCompileCommandsEvent or haveCompileCommandsEvent
+        return haveCompileCommandsEvent
+    end,
+
+    -- Waits for events unless some are pending already, and continues collecting them until
+    -- none arrive within the quiet period (option -D). Returns the sequence of names of the
+    -- watched files other than compile_commands.json that had events, each named once, and
+    -- whether there were any events for the latter. Afterwards, no events are pending.
+    takeEvents = function(self)
+        if (not self:hasPendingEvents()) then
+            self:collectEvents()
         end
-        return events
+
+        while (self.inotifier:hasEvents(QuietPeriodMs)) do
+            self:collectEvents()
+        end
+
+        local fileNames = self.pendingFileNames
+        local haveCompileCommandsEvent = self.havePendingCompileCommandsEvent
+
+        self.pendingFileNames, self.isPendingFileName = {}, {}
+        self.havePendingCompileCommandsEvent = false
+
+        return fileNames, haveCompileCommandsEvent
     end,
 
     close = function(self)
@@ -1793,18 +3420,45 @@ local Notifier = class
         self.inotifier = nil
     end,
 
+    -- Returns true if the event is for compile_commands.json (or a file it has been
+    -- replaced with), false otherwise.
     checkEvent_ = function(self, event)
+        if (self.isFormerCompileCommandsWd[event.wd]) then
+            return true
+        end
+
+        if (event.wd == self.compileCommandsWd) then
+            if (#selectionSpecs > 0) then
+                errprintf("Exiting: an event was generated for '%s'. "..
+                              "(Reloading not implemented with option -s.)",
+                          compileCommandsFile)
+                os.exit(ErrorCode.CompileCommandsJsonGeneratedEvent)
+            end
+
+            if (bit.band(event.mask, MOVE_OR_DELETE) ~= 0) then
+                -- The file was likely replaced by renaming a newly written one over it.
+                -- Watch whatever is now found under its name.
+                local ok, wd = pcall(self.inotifier.add_watch, self.inotifier,
+                                     compileCommandsFile, WATCH_FLAGS)
+                if (not ok) then
+                    errprintf("Exiting: '%s' was moved or deleted.", compileCommandsFile)
+                    os.exit(ErrorCode.WatchedFileMovedOrDeleted)
+                end
+
+                self.isFormerCompileCommandsWd[self.compileCommandsWd] = true
+                self.compileCommandsWd = wd
+            end
+
+            return true
+        end
+
         if (bit.band(event.mask, MOVE_OR_DELETE) ~= 0) then
             -- TODO: handle. Happens with e.g. 'git stash pop'.
             errprintf("Exiting: a watched file was moved or deleted. (Handling not implemented.)")
             os.exit(ErrorCode.WatchedFileMovedOrDeleted)
         end
 
-        if (event.wd == self.compileCommandsWd) then
-            errprintf("Exiting: an event was generated for '%s'. (Handling not implemented.)",
-                      compileCommandsFile)
-            os.exit(ErrorCode.CompileCommandsJsonGeneratedEvent)
-        end
+        return false
     end,
 }
 
@@ -1816,7 +3470,284 @@ local function HasMatchingDiag(fDiagSet, isSeverityRelevant)
     end
 end
 
-local INOTIFY_FD_MARKER = -math.huge
+-- Replaces the symbols of compile command #<ccIdx> in the global symbol pages with the
+-- ones a child has stored into its local pages.
+local function TakeOverSymbolPages(ccIdx, localPageArrayIdx, firstPageIdx, pageCount)
+    local oldPageIdxs = CcSymbolPages[ccIdx]
+    if (oldPageIdxs ~= nil) then
+        SymIndex:releaseGlobalPages(oldPageIdxs)
+    end
+
+    CcSymbolPages[ccIdx] = SymIndex:moveLocalPagesToGlobal(
+        localPageArrayIdx, firstPageIdx, pageCount)
+
+    if (CcSymbolPages[ccIdx] == nil) then
+        warnInfo("Symbol index is full, dropped the symbols of compile command #%d.", ccIdx)
+    end
+end
+
+---------- Snapshot (option -R) ----------
+
+-- Layout of a snapshot file (all integers are uint32_t):
+--  "WCCS" <version> <flags> <string count> <record count>
+--  <length of string i> for each string i
+--  <concatenated strings>
+--  for each record (that is, processed compile command):
+--   <id of signature string> <dispatch time> <diags length> <graph length> <symbol count>
+--   <serialized diags> <serialized graph, with file names as ids of strings>
+--   <id of USR string> <id of name string> <use flags> <cursor kind> for each symbol
+-- String ids are one-based indexes of the strings.
+local SnapshotMagic, SnapshotVersion = "WCCS", 2
+
+local SnapshotFileName = useSnapshot and GetDatabaseCacheFileName("snapshot") or nil
+
+-- The strings of a snapshot. Provides the part of the SharedStringTable interface that is
+-- used by inclusion graph (de)serialization.
+local SnapshotStrings = class
+{
+    function()
+        return {
+            strings = {},
+            idOf = {},  -- [<string>] = <id>
+        }
+    end,
+
+    intern = function(self, str)
+        local id = self.idOf[str]
+        if (id == nil) then
+            id = #self.strings + 1
+            self.strings[id] = str
+            self.idOf[str] = id
+        end
+        return id
+    end,
+
+    getString = function(self, id)
+        local str = self.strings[id]
+        check(str ~= nil, "invalid snapshot string id", 2)
+        return str
+    end,
+}
+
+local function WriteSnapshot(ccInclusionGraphs, miFormattedDiagSets)
+    local strings = SnapshotStrings()
+    local records = {}
+    local recordCount = 0
+
+    for ccIdx, cmd in ipairs(compileCommands) do
+        local graph, diagsHandle = ccInclusionGraphs[ccIdx], miFormattedDiagSets[ccIdx]
+        local dispatchTime = CcDispatchTimes[ccIdx]
+
+        if (graph ~= nil and diagsHandle ~= nil and dispatchTime ~= nil) then
+            local diagsStr = mi.diagSetLog:read(diagsHandle)
+            local graphStr = graph:serialize(strings)
+            local pageIdxs = CcSymbolPages[ccIdx]
+            local symbols = {}
+
+            for _, symbolInfo in ipairs(pageIdxs and SymIndex:readGlobal(pageIdxs) or {}) do
+                local usrId, nameId = symbol_index.unpackIntFlags(symbolInfo[1])
+                local _, useFlags, cursorKind = symbol_index.unpackExtFlags(symbolInfo[2])
+
+                symbols[#symbols + 1] = strings:intern(SymbolNames:getString(usrId))
+                symbols[#symbols + 1] = strings:intern(SymbolNames:getString(nameId))
+                symbols[#symbols + 1] = useFlags
+                symbols[#symbols + 1] = cursorKind
+            end
+
+            local header = { strings:intern(GetCcSignature(cmd)), dispatchTime,
+                             #diagsStr, #graphStr, #symbols / 4 }
+
+            records[#records + 1] = util.packUint32s(header)
+            records[#records + 1] = diagsStr
+            records[#records + 1] = graphStr
+            records[#records + 1] = util.packUint32s(symbols)
+            recordCount = recordCount + 1
+        end
+    end
+
+    local lengths = {}
+    for i, str in ipairs(strings.strings) do
+        lengths[i] = #str
+    end
+
+    local header = { SnapshotVersion, ResultOptionFlags, #strings.strings, recordCount }
+    local data = SnapshotMagic..util.packUint32s(header)..util.packUint32s(lengths)..
+        table.concat(strings.strings)..table.concat(records)
+
+    -- Write to a temporary file first so that a snapshot is never seen half-written.
+    local tempFileName = SnapshotFileName..".tmp"
+    local file = io.open(tempFileName, "wb")
+    local ok = (file ~= nil) and file:write(data)
+
+    if (file ~= nil) then
+        ok = file:close() and ok
+    end
+
+    if (not ok or not os.rename(tempFileName, SnapshotFileName)) then
+        warnInfo("Failed writing snapshot '%s'.", SnapshotFileName)
+    end
+end
+
+-- Returns nil if the snapshot was written with different options, or a table
+--  { strings = <SnapshotStrings>, records = { [<signature>] = <record>, ... } }.
+-- Raises an error if <data> is not a valid snapshot.
+local function ParseSnapshot(data)
+    check(data:sub(1, #SnapshotMagic) == SnapshotMagic, "wrong magic", 1)
+
+    local reader = util.BinaryReader(data:sub(#SnapshotMagic + 1))
+    if (reader:uint32() ~= SnapshotVersion or reader:uint32() ~= ResultOptionFlags) then
+        return nil
+    end
+
+    local stringCount = reader:uint32()
+    local recordCount = reader:uint32()
+    local lengths = reader:uint32s(stringCount)
+    local strings = SnapshotStrings()
+
+    for i = 1, stringCount do
+        check(strings:intern(reader:string(lengths[i - 1])) == i, "duplicate string", 1)
+    end
+
+    local records = {}
+
+    for _ = 1, recordCount do
+        local header = reader:uint32s(5)
+        local signature = strings:getString(header[0])
+        local dispatchTime = tonumber(header[1])
+        local diagsLength, graphLength, symbolCount =
+            tonumber(header[2]), tonumber(header[3]), tonumber(header[4])
+
+        records[signature] = {
+            dispatchTime = dispatchTime,
+            diagsStr = reader:string(diagsLength),
+            graphStr = reader:string(graphLength),
+            symbols = reader:uint32s(4 * symbolCount),
+            symbolCount = symbolCount,
+        }
+    end
+
+    check(reader:isAtEnd(), "trailing data", 1)
+
+    return {
+        strings = strings,
+        records = records,
+        reader_ = reader,  -- anchors the data pointed to by the records' 'symbols'
+    }
+end
+
+-- Stores the symbols of compile command #<ccIdx> from snapshot record <record>.
+local function RestoreSymbols(ccIdx, record, strings)
+    local symbolInfos = {}
+    local symbols = record.symbols
+
+    for i = 0, 4 * record.symbolCount - 1, 4 do
+        local usrId = SymbolNames:intern(strings:getString(symbols[i]))
+        local nameId = SymbolNames:intern(strings:getString(symbols[i + 1]))
+
+        if (usrId == nil or nameId == nil) then
+            return false
+        end
+
+        symbolInfos[#symbolInfos + 1] = {
+            symbol_index.packIntFlags(usrId, nameId),
+            symbol_index.packExtFlags(ccIdx, symbols[i + 2], symbols[i + 3]),
+        }
+    end
+
+    CcSymbolPages[ccIdx] = SymIndex:storeGlobal(symbolInfos)
+    return (CcSymbolPages[ccIdx] ~= nil)
+end
+
+-- Restores the results of the compile commands in the snapshot whose files have not been
+-- modified since they were processed into <ccInclusionGraphs> and <members> (to be taken
+-- over by the Controller). Returns the sequence of indexes of the remaining ones.
+local function RestoreSnapshot(ccInclusionGraphs, members)
+    local staleCcIdxs = range(#compileCommands)
+
+    local file = io.open(SnapshotFileName, "rb")
+    if (file == nil) then
+        return staleCcIdxs
+    end
+
+    local data = file:read("*a")
+    file:close()
+
+    local ok, snapshot = pcall(ParseSnapshot, data or "")
+    if (not ok) then
+        warnInfo("Ignoring invalid snapshot '%s': %s", SnapshotFileName, snapshot)
+        return staleCcIdxs
+    elseif (snapshot == nil) then
+        info("Ignoring snapshot written with different options.")
+        return staleCcIdxs
+    end
+
+    local mtimeOf = {}  -- [<file name>] = <modification time> or false
+
+    local isUnmodifiedSince = function(fileName, time)
+        if (mtimeOf[fileName] == nil) then
+            mtimeOf[fileName] = posix.getModificationTime(fileName) or false
+        end
+
+        local mtime = mtimeOf[fileName]
+        return (mtime ~= false and mtime < time)
+    end
+
+    local isFresh = function(cmd, record, graph)
+        if (not isUnmodifiedSince(cmd.file, record.dispatchTime) or
+                (cmd.pchFileName ~= nil and
+                     not isUnmodifiedSince(cmd.pchFileName, record.dispatchTime))) then
+            return false
+        end
+
+        for _, fileName in graph:iFileNames() do
+            if (not isUnmodifiedSince(fileName, record.dispatchTime)) then
+                return false
+            end
+        end
+
+        return true
+    end
+
+    staleCcIdxs = {}
+
+    for ccIdx, cmd in ipairs(compileCommands) do
+        local record = snapshot.records[GetCcSignature(cmd)]
+        local graph, fDiagSet
+
+        if (record ~= nil) then
+            local decodeOk
+            decodeOk, graph, fDiagSet = pcall(function()
+                return inclusion_graph.DeserializeFrozen(
+                        record.graphStr, FileNames, snapshot.strings),
+                    diagnostics_util.FormattedDiagSet_Deserialize(
+                        record.diagsStr, not plainMode)
+            end)
+
+            local restoreOk = decodeOk and isFresh(cmd, record, graph) and
+                (SymIndex == nil or RestoreSymbols(ccIdx, record, snapshot.strings))
+
+            if (not restoreOk) then
+                record = nil
+            end
+        end
+
+        if (record == nil) then
+            staleCcIdxs[#staleCcIdxs + 1] = ccIdx
+        else
+            ccInclusionGraphs[ccIdx] = graph
+            CcReverseDeps:setGraph(ccIdx, graph)
+            CcDispatchTimes[ccIdx] = record.dispatchTime
+            members.miFormattedDiagSets[ccIdx] = mi.diagSetLog:append(record.diagsStr)
+            members.notifier:addFilesFromGraph(graph)
+        end
+    end
+
+    miInfo("Restored the results of %s from snapshot.",
+           pluralize(#compileCommands - #staleCcIdxs, "compile command"))
+
+    return staleCcIdxs
+end
+
 
 local Controller = class
 {
@@ -1831,8 +3762,17 @@ local Controller = class
             -- Will be closed and nil'd in child.
             notifier = members.notifier or Notifier(),
 
-            -- Will be nil'd in child.
-            symbolIndex = SymbolIndex(usedConcurrency),
+            -- Stack of indexes of the local symbol page arrays (see 'SymIndex') that are not
+            -- used by a child. Only used when forking a child for each compile command.
+            freeLocalPageArrayIdxs = range(LocalPageArrayCount),
+
+            -- Number of compile commands being processed that are high-memory ones (see
+            -- IsHighMemoryCc()).
+            highMemoryChildCount = 0,
+
+            -- WorkerPool (with option -W) or nil. If present, no children are forked by us:
+            -- compile commands are dispatched to the workers instead.
+            workerPool = members.workerPool,
 
             --== Child will have:
             parser = nil,  -- OnDemandParser
@@ -1845,9 +3785,12 @@ local Controller = class
             readFdToConnIdx = nil,
             -- Contiguous sequence table as argument to posix.poll().
             pendingFds = nil,
+            -- Stack of indexes into self.connections[] of the children that were stopped
+            -- (with SIGSTOP) to make room for prioritized compile commands.
+            stoppedConnIdxs = {},
             -- FormattedDiagSetPrinter:
             printer = nil,
-            -- Will be filled only in command mode:
+            -- Will be filled only in command mode, with handles into mi.diagSetLog:
             miFormattedDiagSets = members.miFormattedDiagSets or {},
         }
     end,
@@ -1862,13 +3805,8 @@ local Controller = class
         return self.connection.w:write(obj)
     end,
 
-    sendToParent = function(self, fDiagSet, incGraph)
-        local fDiagsStr = fDiagSet:serialize()
-        local graphStr = incGraph:serialize()
-        local header = DoneHeader_t(#fDiagsStr, #graphStr)
-        self:send(header)
-        self:send(fDiagsStr)
-        self:send(graphStr)
+    sendToParent = function(self, fDiagSet, incGraph, symbolInfos, cost)
+        SendResults(self.connection, fDiagSet, incGraph, symbolInfos, cost)
     end,
 
     --== Parent only ==--
@@ -1900,12 +3838,24 @@ local Controller = class
         local conn, ccIdx = self:getConnectionAndCcIdx(connIdx)
         local readFd = conn.r.fd
 
-        conn:close()
+        if (self.workerPool ~= nil) then
+            self.workerPool:release(conn)
+        else
+            conn:close()
+            local freeIdxs = self.freeLocalPageArrayIdxs
+            freeIdxs[#freeIdxs + 1] = conn.localPageArrayIdx
+        end
 
         assert(self.readFdToConnIdx[readFd] == connIdx)
         self.readFdToConnIdx[readFd] = nil
 
-        posix.waitpid(conn.childPid, 0)
+        if (conn.isHighMemory) then
+            self.highMemoryChildCount = self.highMemoryChildCount - 1
+        end
+
+        if (self.workerPool == nil) then
+            posix.waitpid(conn.childPid, 0)
+        end
 
         self.connections[connIdx] = nil
 
@@ -1931,25 +3881,46 @@ local Controller = class
     spawnChild = function(self, ccIdx)
         assert(not self:is("child"))
 
-        local pipes = PipePair()
+        local connection
+
+        if (self.workerPool ~= nil) then
+            self.whoami = "parent"
+            connection = self.workerPool:dispatch(ccIdx)
+        else
+            WaitForPreparedCompileCommand(ccIdx)
+
+            local pipes = PipePair()
+            local localPageArrayIdx = table.remove(self.freeLocalPageArrayIdxs)
+            assert(localPageArrayIdx ~= nil)
 
-        local whoami, childPid = posix.fork()
-        self.whoami = whoami
+            local whoami, childPid = posix.fork()
+            self.whoami = whoami
 
-        local connection = pipes:getConnection(whoami, childPid)
+            connection = pipes:getConnection(whoami, childPid)
+            connection.localPageArrayIdx = localPageArrayIdx
 
-        if (self:is("child")) then
-            self.connection = connection
-            self.notifier:close()
-            self.notifier = nil
-            self.symbolIndex = nil
-            self.parser = OnDemandParser({ccIdx}, unpack(self.onDemandParserArgs, 2))
-            return ChildMarker
+            if (self:is("child")) then
+                self.connection = connection
+                self.notifier:close()
+                self.notifier = nil
+                self.parser = OnDemandParser({ccIdx}, unpack(self.onDemandParserArgs, 2))
+                return ChildMarker
+            end
         end
 
         -- Set up and/or update the child-tracking state in the parent.
 
         connection.compileCommandIndex = ccIdx
+        CcDispatchTimes[ccIdx] = os.time()
+        CcDispatchEventRounds[ccIdx] = self.notifier:getEventRound()
+
+        -- NOTE: remembered since the cost of the compile command is updated on completion.
+        connection.isHighMemory = IsHighMemoryCc(ccIdx)
+        connection.expectedRssKb = (memoryBudgetKb ~= nil) and GetExpectedRssKb(ccIdx) or nil
+
+        if (connection.isHighMemory) then
+            self.highMemoryChildCount = self.highMemoryChildCount + 1
+        end
 
         local connections = self.connections or {}
         local connIdx = #connections + 1
@@ -1969,6 +3940,89 @@ local Controller = class
         return ParentMarker
     end,
 
+    -- With -M: returns the projected memory usage of the running children in KiB. For each,
+    -- this is its current RSS, but at least the peak expected for its compile command.
+    getProjectedChildRssKb_ = function(self)
+        local sumKb = 0
+
+        for _, readFd in ipairs(self.pendingFds or {}) do
+            local conn = self:getConnectionAndCcIdx(self.readFdToConnIdx[readFd])
+            sumKb = sumKb + math.max(GetProcStatusKb(conn.childPid, "VmRSS"), conn.expectedRssKb)
+        end
+
+        return sumKb
+    end,
+
+    -- Returns the number of children that are processing a compile command and have not been
+    -- stopped.
+    getRunningChildCount_ = function(self)
+        return #(self.pendingFds or {}) - #self.stoppedConnIdxs
+    end,
+
+    -- Stops the child that was handed a compile command last among those running and
+    -- processing one for which <isPrioritized>[<ccIdx>] is not true. Its compile command is
+    -- continued once a slot becomes free (see resumeChildren_()). Returns false if there is
+    -- no such child, or if no further one could be started in its place.
+    stopChild_ = function(self, isPrioritized)
+        if (self.workerPool ~= nil or #self.freeLocalPageArrayIdxs == 0) then
+            return false
+        end
+
+        local isStopped = {}
+        for _, connIdx in ipairs(self.stoppedConnIdxs) do
+            isStopped[connIdx] = true
+        end
+
+        local victimConnIdx = nil
+
+        for _, readFd in ipairs(self.pendingFds or {}) do
+            local connIdx = self.readFdToConnIdx[readFd]
+            local _, ccIdx = self:getConnectionAndCcIdx(connIdx)
+
+            if (not isStopped[connIdx] and not isPrioritized[ccIdx] and
+                    (victimConnIdx == nil or connIdx > victimConnIdx)) then
+                victimConnIdx = connIdx
+            end
+        end
+
+        if (victimConnIdx == nil) then
+            return false
+        end
+
+        local conn, ccIdx = self:getConnectionAndCcIdx(victimConnIdx)
+        posix.kill(conn.childPid, posix.SIG.STOP)
+        self.stoppedConnIdxs[#self.stoppedConnIdxs + 1] = victimConnIdx
+        miInfo("Suspended processing of compile command %s.", getCcIdxString(ccIdx))
+
+        return true
+    end,
+
+    -- Resumes the child for connection <connIdx> if it is stopped.
+    resumeChild_ = function(self, connIdx)
+        local stoppedConnIdxs = self.stoppedConnIdxs
+
+        for i = 1, #stoppedConnIdxs do
+            if (stoppedConnIdxs[i] == connIdx) then
+                local conn, ccIdx = self:getConnectionAndCcIdx(connIdx)
+                posix.kill(conn.childPid, posix.SIG.CONT)
+                table.remove(stoppedConnIdxs, i)
+                miInfo("Resumed processing of compile command %s.", getCcIdxString(ccIdx))
+                return
+            end
+        end
+    end,
+
+    -- Resumes up to <count> stopped children, the one stopped last first. Returns the number
+    -- of slots (out of <count>) that are left.
+    resumeChildren_ = function(self, count)
+        while (count > 0 and #self.stoppedConnIdxs > 0) do
+            self:resumeChild_(self.stoppedConnIdxs[#self.stoppedConnIdxs])
+            count = count - 1
+        end
+
+        return count
+    end,
+
     isOutstanding = function(self, ccIdxToCheck)
         for _, readFd in ipairs(self.pendingFds) do
             local _, ccIdx = self:getConnectionAndCcIdx(self.readFdToConnIdx[readFd])
@@ -1980,8 +4034,10 @@ local Controller = class
         return false
     end,
 
-    -- TODO: watch inotify descriptor, too.
-    wait = function(self)
+    -- Returns the sequence of indexes of the connections that are ready, whether there are
+    -- events on watched files and whether there are client requests. If <timeoutMs> is
+    -- given, returns after that many milliseconds even if there is nothing ready.
+    wait = function(self, timeoutMs)
         assert(self:is("parent"))
 
         local pendingFds = self.pendingFds
@@ -1993,36 +4049,51 @@ local Controller = class
         pendingFds[#pendingFds + 1] = inotifyFd
         pendingFds[#pendingFds + 1] = clientInotifyFd
 
-        local pollfds = posix.poll(pendingFds)
+        -- In command mode, also wait for client FIFOs to become writable.
+        local outputFds = commandMode and MI.GetPendingOutputFds() or {}
+        outputFds.events = POLL.OUT
+
+        local pollfds = posix.pollMulti({pendingFds, outputFds}, timeoutMs)
 
         pendingFds[oldPendingFdCount + 2] = nil
         pendingFds[oldPendingFdCount + 1] = nil
 
         local connIdxs = {}
         local haveInotifyFd, haveClientRequest = false, false
+        local isOutputFd = {}
+
+        for _, fd in ipairs(outputFds) do
+            isOutputFd[fd] = true
+        end
 
         for i = 1, #pollfds do
+            local fd = pollfds[i].fd
+
             -- We should never get:
             --  - POLL.HUP: we (the parent) keep the write end of the 'child -> parent'
             --      connection open just so that the pipe is always connected.
             --  - POLL.NVAL: we should always pass valid pipe file descriptors to poll().
             --
             -- TODO: deal with possible POLL.ERR?
-            assert(pollfds[i].revents == POLL.IN)
+            assert(isOutputFd[fd] or pollfds[i].revents == POLL.IN)
 
-            local fd = pollfds[i].fd
-
-            if (fd == clientInotifyFd) then
+            if (isOutputFd[fd]) then
+                -- Writable, or POLL.ERR if the client has gone away: handled below.
+            elseif (fd == clientInotifyFd) then
                 haveClientRequest = true
+            elseif (fd == inotifyFd) then
+                haveInotifyFd = true
             else
-                local connIdx = (fd == inotifyFd) and INOTIFY_FD_MARKER or self.readFdToConnIdx[fd]
+                local connIdx = self.readFdToConnIdx[fd]
                 assert(connIdx ~= nil)
-
-                haveInotifyFd = haveInotifyFd or (fd == inotifyFd)
                 connIdxs[#connIdxs + 1] = connIdx
             end
         end
 
+        if (#outputFds > 0) then
+            MI.FlushOutputQueues()
+        end
+
         return connIdxs, haveInotifyFd, haveClientRequest
     end,
 
@@ -2040,6 +4111,22 @@ local Controller = class
         return ccIdxs
     end,
 
+    -- NOTE [STALE_RESULT]: the results of a compile command are stale if any file in its
+    --  inclusion graph <graph> had an event after the compile command was handed to a child.
+    --  (The child may or may not have seen the modification.)
+    isStaleResult_ = function(self, ccIdx, graph)
+        local dispatchRound = CcDispatchEventRounds[ccIdx]
+        assert(dispatchRound ~= nil)
+
+        for _, fileName in graph:iFileNames() do
+            if (self.notifier:hadEventSince(fileName, dispatchRound)) then
+                return true
+            end
+        end
+
+        return false
+    end,
+
     getCcIdxs = function(self)
         local ccIdxs = self.onDemandParserArgs[1]
         assert(type(ccIdxs) == "table")
@@ -2051,96 +4138,217 @@ local Controller = class
         local localConcurrency = math.min(usedConcurrency, #ccIdxs)
         local spawnCount = 0
 
-        -- Spawn the initial batch of children.
-        for ii = 1, localConcurrency do
-            spawnCount = spawnCount + 1
-            if (self:spawnChild(ccIdxs[ii]):isChild()) then
-                return ChildMarker, 0
+        -- The compile commands in the order in which they are handed to children. (In human
+        -- mode, printing still happens in the order of 'ccIdxs'.) The first 'ii - 1' ones
+        -- have been handed out.
+        local order = GetDispatchOrder(ccIdxs)
+        local ii = 1
+
+        -- Hands up to <count> compile commands to children: fewer if there are no more, if
+        -- all remaining ones are high-memory ones and as many as allowed are running, or if
+        -- none fits into the memory budget (with -M). Returns true in a child.
+        local spawnChildren = function(count)
+            while (count > 0 and ii <= #order) do
+                local isIdle = (#(self.pendingFds or {}) == 0)
+                local freeKb = (memoryBudgetKb ~= nil and not isIdle) and
+                    memoryBudgetKb - self:getProjectedChildRssKb_() or math.huge
+                local nextIdx = nil
+
+                for i = ii, #order do
+                    if ((self.highMemoryChildCount < HighMemoryChildCap or
+                             not IsHighMemoryCc(order[i])) and
+                            (freeKb == math.huge or GetExpectedRssKb(order[i]) <= freeKb)) then
+                        nextIdx = i
+                        break
+                    end
+                end
+
+                if (nextIdx == nil) then
+                    break
+                end
+
+                local ccIdx = table.remove(order, nextIdx)
+                table.insert(order, ii, ccIdx)
+                ii = ii + 1
+                spawnCount = spawnCount + 1
+                count = count - 1
+
+                if (self:spawnChild(ccIdx):isChild()) then
+                    return true
+                end
             end
+
+            return false
+        end
+
+        -- Spawn the initial batch of children.
+        if (spawnChildren(localConcurrency)) then
+            return ChildMarker, 0
         end
 
         assert(self.printer == nil)
         self.printer = FormattedDiagSetPrinter()
 
-        local ii = localConcurrency + 1
-
         local firstUnprocessedIdx = 1
         local formattedDiagSets = {}  -- in command mode, only used for control flow
+        local receivedGraphs = {}  -- only used in human mode
 
         local lastCcIdxToPrint = math.huge
-        local hadInotifyFd = false
+        local hadCompileCommandsEvent = false
+        -- Number of compile commands handed out again because their results were stale.
+        local requeueCount = 0
+
+        -- [<ccIdx>] = true for compile commands that a client asked for. They are handed
+        -- out before all others, if need be by stopping a child (see below).
+        local isPrioritized = {}
 
         local prioritizeCcFunc = function(ccIdxToBump)
-            -- TODO: wait for the compile command to process, only then send the result.
-            for i = ii, #ccIdxs do
-                if (ccIdxs[i] == ccIdxToBump) then
+            isPrioritized[ccIdxToBump] = true
+
+            for i = ii, #order do
+                if (order[i] == ccIdxToBump) then
                     -- NOTE: this makes 'ccIdxs' non-monotonic when i > ii.
-                    table.remove(ccIdxs, i)
-                    table.insert(ccIdxs, ii, ccIdxToBump)
+                    table.remove(order, i)
+                    table.insert(order, ii, ccIdxToBump)
                     miInfo("Prioritized compile command %s.", getCcIdxString(ccIdxToBump))
                     return
                 end
             end
 
             -- A prioritize request must be for a compile command that is to be processed,
-            -- but has not yet been.
+            -- but has not yet been. If its child has been stopped, let it continue.
             assert(self:isOutstanding(ccIdxToBump))
+
+            for _, connIdx in ipairs(util.copySequence(self.stoppedConnIdxs)) do
+                local _, ccIdx = self:getConnectionAndCcIdx(connIdx)
+                if (ccIdx == ccIdxToBump) then
+                    self:resumeChild_(connIdx)
+                end
+            end
         end
 
         repeat
-            local connIdxs, haveInotifyFd, haveClientRequest = self:wait()
-            local spawnNewChildren = not haveInotifyFd and (lastCcIdxToPrint == math.huge)
+            -- With -M, re-check the memory budget periodically while fewer children than
+            -- allowed are running, so that compile commands held back by it are handed out
+            -- once the current RSS of the running ones permits, not only when one finishes.
+            local recheckBudget = (memoryBudgetKb ~= nil and lastCcIdxToPrint == math.huge and
+                                   ii <= #order and
+                                   self:getRunningChildCount_() < localConcurrency)
+            local connIdxs, haveInotifyFd, haveClientRequest =
+                self:wait(recheckBudget and MemoryBudgetRecheckMs or nil)
+
+            -- On modification of watched files, keep going: only the results of compile
+            -- commands depending on the modified files are discarded on arrival (see NOTE
+            -- STALE_RESULT), so that parsing work in flight for the others is not lost.
+            if (haveInotifyFd and self.notifier:collectEvents()) then
+                -- If compile_commands.json has been modified, stop printing.
+                -- Continue handling the outstanding connections, though.
+                lastCcIdxToPrint = 0
+                hadCompileCommandsEvent = true
+            end
+
+            local spawnNewChildren = (lastCcIdxToPrint == math.huge)
             local newChildCount = #connIdxs
 
-            hadInotifyFd = hadInotifyFd or haveInotifyFd
+            -- NOTE: a child may have been stopped after writing part of its data.
+            for _, connIdx in ipairs(connIdxs) do
+                self:resumeChild_(connIdx)
+            end
+
+            -- To retain the requested concurrency, replace the children that we were
+            -- informed are ready, resuming stopped ones first. (With a worker pool, a
+            -- worker is handed its next compile command once it has been released below.)
+            local freeCount = self:resumeChildren_(
+                localConcurrency - (self:getRunningChildCount_() - newChildCount))
 
-            -- To retain the requested concurrency, spawn as many new children as we were
-            -- informed are ready.
-            while (spawnNewChildren and newChildCount > 0 and ii <= #ccIdxs) do
-                spawnCount = spawnCount + 1
-                if (self:spawnChild(ccIdxs[ii]):isChild()) then
+            if (self.workerPool == nil and spawnNewChildren) then
+                if (spawnChildren(freeCount)) then
                     return ChildMarker, 0
                 end
-
-                newChildCount = newChildCount - 1
-                ii = ii + 1
+            elseif (recheckBudget and spawnNewChildren and #connIdxs == 0) then
+                -- With a worker pool, idle workers are otherwise only handed a compile
+                -- command when another one is released below.
+                spawnChildren(freeCount)
             end
 
             -- Now, for each ready child, receive and handle the data it sent.
             for _, connIdx in ipairs(connIdxs) do
-                if (connIdx == INOTIFY_FD_MARKER) then
-                    -- If any watched file has been modified, stop printing.
-                    -- Continue handling the outstanding connections, though.
-                    lastCcIdxToPrint = 0
-                    goto nextIteration
-                end
-
+                local mergeStartTime = GetMonotonicSeconds()
                 local doneMsg = self:receiveData(connIdx, DoneHeader_t(0, 0)):deserialize()
                 assert(doneMsg.magic == "Done")
 
+                do
+                    local _, ccIdx = self:getConnectionAndCcIdx(connIdx)
+                    if (doneMsg.isFullParse) then
+                        SetCcCost(ccIdx, doneMsg.wallMs, doneMsg.peakRssKb)
+                    end
+                    CcPhaseTimes[ccIdx] = doneMsg.phaseUs
+                end
+
                 local serializedDiags = self:receiveString(connIdx, doneMsg.diagsStrLength)
                 local serializedGraph = self:receiveString(connIdx, doneMsg.graphStrLength)
 
+                if (SymIndex ~= nil) then
+                    -- NOTE: do this before the local page array can be handed to another
+                    --  child by closeConnection().
+                    local conn, ccIdx = self:getConnectionAndCcIdx(connIdx)
+                    TakeOverSymbolPages(ccIdx, conn.localPageArrayIdx,
+                                        doneMsg.symPageStart, doneMsg.symPageCount)
+
+                    if (doneMsg.symbolsDropped) then
+                        warnInfo("Local symbol pages of worker exhausted, dropped the "..
+                                 "symbols of compile command #%d.", ccIdx)
+                    end
+                end
+
                 -- NOTE: may introduce holes in the (integer) key sequence of
                 -- self.connections[].
                 local ccIdx = self:closeConnection(connIdx)
 
+                if (self.workerPool ~= nil and spawnNewChildren and
+                        lastCcIdxToPrint == math.huge) then
+                    -- Keep the just-released worker busy while we handle its results.
+                    spawnChildren(1)
+                end
+
                 local fDiagSet = diagnostics_util.FormattedDiagSet_Deserialize(
                     serializedDiags, not plainMode)
                 assert(fDiagSet ~= nil)
 
+                local graph = inclusion_graph.DeserializeFrozen(serializedGraph, FileNames)
+
+                if (self:isStaleResult_(ccIdx, graph)) then
+                    -- Hand the compile command out again next. (If no more are handed out
+                    -- in this run, it is left unprocessed like the others not handed out.)
+                    table.insert(order, ii, ccIdx)
+                    requeueCount = requeueCount + 1
+                    goto nextIteration
+                end
+
                 formattedDiagSets[ccIdx] = fDiagSet;
 
-                -- TODO: immediately add files to the include graph here? (We are already
-                --  effectively doing this in command mode, but not otherwise. In human mode
-                --  we depend on 'ccInclusionGraphs' being a hole-less sequence: SEQ_REAP.)
-                ccInclusionGraphs[ccIdx] = inclusion_graph.Deserialize(serializedGraph)
+                if (commandMode) then
+                    ccInclusionGraphs[ccIdx] = graph
+                    CcReverseDeps:setGraph(ccIdx, graph)
+                    AddPhaseTime(CcPhaseTimes[ccIdx], "merge", mergeStartTime)
+                else
+                    -- In human mode, we depend on 'ccInclusionGraphs' being a hole-less
+                    -- sequence (SEQ_REAP). Since compile commands are not necessarily handed
+                    -- out in order (see GetDispatchOrder()), the graph is only stored once
+                    -- the diagnostics are printed below.
+                    receivedGraphs[ccIdx] = graph
+                    AddPhaseTime(CcPhaseTimes[ccIdx], "merge", mergeStartTime)
+                end
 
                 if (commandMode) then
-                    self.miFormattedDiagSets[ccIdx] = fDiagSet
+                    self.miFormattedDiagSets[ccIdx] = mi.diagSetLog:append(serializedDiags)
                     self.notifier:addFilesFromGraph(ccInclusionGraphs[ccIdx])
                     -- Print diagnostic set immediately on arrival.
+                    local printStartTime = GetMonotonicSeconds()
                     self.printer:print(errprintf, fDiagSet, ccIdx)
+                    AddPhaseTime(CcPhaseTimes[ccIdx], "print", printStartTime)
+                    -- Respond to clients that were waiting for it.
+                    MI.HandleDeferredRequests({self, ccInclusionGraphs, prioritizeCcFunc}, false)
                 elseif (incrementalMode ~= nil) then
                     if (HasMatchingDiag(formattedDiagSets[ccIdx], incrementalMode)) then
                         -- We are in incremental mode and have detected a diagnostic severity
@@ -2155,7 +4363,17 @@ local Controller = class
                     end
                 end
 
-                ::nextIteration::
+                ::nextIteration::
+            end
+
+            freeCount = self:resumeChildren_(localConcurrency - self:getRunningChildCount_())
+
+            if (spawnNewChildren and lastCcIdxToPrint == math.huge) then
+                -- Hand out compile commands that had to wait for high-memory ones to finish,
+                -- or for memory to be freed (with -M).
+                if (spawnChildren(freeCount)) then
+                    return ChildMarker, 0
+                end
             end
 
             -- In human mode, print diagnostic sets in compile command order.
@@ -2163,15 +4381,21 @@ local Controller = class
             -- which is returned later.
             for idx = firstUnprocessedIdx, #ccIdxs do
                 local ccIdx = ccIdxs[idx]
-                local fDiagSet = formattedDiagSets[ccIdx]
-                formattedDiagSets[ccIdx] = nil
+                local fDiagSet, graph = formattedDiagSets[ccIdx], receivedGraphs[ccIdx]
+                formattedDiagSets[ccIdx], receivedGraphs[ccIdx] = nil, nil
 
                 if (fDiagSet == nil) then
                     break
                 elseif (ccIdx <= lastCcIdxToPrint) then
                     if (not commandMode) then
+                        local mergeStartTime = GetMonotonicSeconds()
+                        ccInclusionGraphs[ccIdx] = graph
+                        CcReverseDeps:setGraph(ccIdx, ccInclusionGraphs[ccIdx])
                         self.notifier:addFilesFromGraph(ccInclusionGraphs[ccIdx])
+                        local printStartTime = AddPhaseTime(
+                            CcPhaseTimes[ccIdx], "merge", mergeStartTime)
                         self.printer:print(errprintf, fDiagSet, ccIdx)
+                        AddPhaseTime(CcPhaseTimes[ccIdx], "print", printStartTime)
                     end
                     firstUnprocessedIdx = firstUnprocessedIdx + 1
                 end
@@ -2180,14 +4404,35 @@ local Controller = class
             if (haveClientRequest) then
                 -- Handle client requests that arrived in between processing child results.
                 MI.HandleClientRequests{self, ccInclusionGraphs, prioritizeCcFunc}
+
+                -- Hand out prioritized compile commands right away. If there is no free slot,
+                -- stop a child processing a non-prioritized one instead of waiting for it.
+                -- NOTE: this bypasses the limits on high-memory compile commands and -M.
+                while (lastCcIdxToPrint == math.huge and ii <= #order and
+                           isPrioritized[order[ii]] and
+                           (self:getRunningChildCount_() < localConcurrency or
+                                self:stopChild_(isPrioritized))) do
+                    local ccIdx = order[ii]
+                    ii = ii + 1
+                    spawnCount = spawnCount + 1
+
+                    if (self:spawnChild(ccIdx):isChild()) then
+                        return ChildMarker, 0
+                    end
+                end
             end
         until (not self:haveActiveChildren())
 
+        if (commandMode) then
+            -- Respond to waiting clients with what is there after all.
+            MI.HandleDeferredRequests({self, ccInclusionGraphs, function() end}, true)
+        end
+
         self.printer:printTrailingInfo()
 
-        local earlyStopReason = hadInotifyFd or incrementalMode
-        assert(not earlyStopReason and spawnCount == #ccIdxs or
-                   earlyStopReason and spawnCount <= #ccIdxs)
+        local earlyStopReason = hadCompileCommandsEvent or incrementalMode
+        assert(not earlyStopReason and spawnCount == #ccIdxs + requeueCount or
+                   earlyStopReason and spawnCount <= #ccIdxs + requeueCount)
 
         return ParentMarker, firstUnprocessedIdx - 1
     end,
@@ -2202,11 +4447,11 @@ local Controller = class
 
         local iterationCount = 0
 
-        for i, ccIndex, fDiagSet, incGraph in self.parser:iterate() do
+        for i, ccIndex, fDiagSet, incGraph, symbolInfos, cost in self.parser:iterate() do
             iterationCount = iterationCount + 1
             assert((i == 1) == (iterationCount == 1))
 
-            self:sendToParent(fDiagSet, incGraph)
+            self:sendToParent(fDiagSet, incGraph, symbolInfos, cost)
         end
 
         assert(iterationCount == 1)
@@ -2247,20 +4492,558 @@ local function GetGlobalInclusionGraph(compileCommandCount, ccInclusionGraphs)
     return globalGraph
 end
 
+-- Moves the values of table <tab> from the old to the new compile command indexes given by
+-- <newIdxOf> (see ReloadCompileCommands()), in place. Values for removed compile commands
+-- are dropped.
+local function RemapCcTable(tab, newIdxOf)
+    local values = {}
+    for oldIdx, newIdx in pairs(newIdxOf) do
+        values[newIdx] = tab[oldIdx]
+    end
+
+    for ccIdx in pairs(tab) do
+        tab[ccIdx] = nil
+    end
+    for ccIdx, value in pairs(values) do
+        tab[ccIdx] = value
+    end
+end
+
+-- Re-reads the compilation database after a change to it. Entries that are unchanged
+-- (compared by GetEntrySignature()) retain their results. They are put first, keeping
+-- their relative order, followed by the added or modified entries, which are prepared
+-- like at startup.
+--
+-- On success, returns:
+--  1. the ascending sequence of the new indexes of the added or modified entries,
+--  2. [<old index>] = <new index> for each unchanged entry.
+-- On failure (for example, if the file is being written), returns nil.
+local function ReloadCompileCommands(ccInclusionGraphs, miFormattedDiagSets)
+    local newCmds, errorMessage =
+        compile_commands_reader.read_compile_commands(compileCommandsFile)
+
+    if (newCmds == nil or #newCmds == 0) then
+        warnInfo("Failed reloading '%s': %s", compileCommandsFile,
+                 (newCmds == nil) and errorMessage or "zero entries")
+        return nil
+    end
+
+    -- [<signature>] = <sequence of old indexes with that signature, descending>
+    local oldIdxsFor = {}
+    for oldIdx = #compileCommands, 1, -1 do
+        local signature = compileCommands[oldIdx].entrySignature
+        oldIdxsFor[signature] = oldIdxsFor[signature] or {}
+        table.insert(oldIdxsFor[signature], oldIdx)
+    end
+
+    local keptOldIdxs = {}
+    local dbIdxOfOld = {}  -- [<old index>] = <index in the new database>
+    local addedCmds, addedDbIdxs = {}, {}
+
+    for dbIdx, cmd in ipairs(newCmds) do
+        cmd.entrySignature = GetEntrySignature(cmd)
+        local oldIdxs = oldIdxsFor[cmd.entrySignature]
+        local oldIdx = (oldIdxs ~= nil) and table.remove(oldIdxs) or nil
+
+        if (oldIdx ~= nil) then
+            keptOldIdxs[#keptOldIdxs + 1] = oldIdx
+            dbIdxOfOld[oldIdx] = dbIdx
+        else
+            addedCmds[#addedCmds + 1] = cmd
+            addedDbIdxs[#addedCmds] = dbIdx
+        end
+    end
+
+    table.sort(keptOldIdxs)
+
+    -- The indexes passed to WaitForPreparedCompileCommand() are about to change.
+    WaitForPreparedCompileCommand()
+
+    if (#addedCmds > 0) then
+        PrepareCompileCommands(addedCmds)()
+        for _, cmd in ipairs(addedCmds) do
+            AttachPchFileName(cmd)
+        end
+    end
+
+    -- Set up the new sequence of compile commands.
+
+    local newCompileCommands = {}
+    local newIdxOf = {}
+    local indexMap = {}
+
+    for _, oldIdx in ipairs(keptOldIdxs) do
+        local newIdx = #newCompileCommands + 1
+        newCompileCommands[newIdx] = compileCommands[oldIdx]
+        newIdxOf[oldIdx] = newIdx
+        indexMap[newIdx] = dbIdxOfOld[oldIdx]
+    end
+
+    local addedCcIdxs = {}
+
+    for i, cmd in ipairs(addedCmds) do
+        local newIdx = #newCompileCommands + 1
+        newCompileCommands[newIdx] = cmd
+        indexMap[newIdx] = addedDbIdxs[i]
+        addedCcIdxs[#addedCcIdxs + 1] = newIdx
+    end
+
+    local removedCount = #compileCommands - #keptOldIdxs
+
+    -- Move the per-compile command state over.
+
+    for oldIdx, pageIdxs in pairs(CcSymbolPages) do
+        if (newIdxOf[oldIdx] == nil) then
+            SymIndex:releaseGlobalPages(pageIdxs)
+        end
+    end
+
+    RemapCcTable(ccInclusionGraphs, newIdxOf)
+    RemapCcTable(miFormattedDiagSets, newIdxOf)
+    RemapCcTable(CcSymbolPages, newIdxOf)
+    RemapCcTable(CcDispatchTimes, newIdxOf)
+    RemapCcTable(CcDispatchEventRounds, newIdxOf)
+    RemapCcTable(CcPhaseTimes, newIdxOf)
+
+    CcReverseDeps = inclusion_graph.ReverseDependencyIndex(#newCompileCommands)
+    for ccIdx, graph in pairs(ccInclusionGraphs) do
+        CcReverseDeps:setGraph(ccIdx, graph)
+    end
+
+    compileCommands = newCompileCommands
+    ccFileCounts = getCompileCommandFileCounts()
+
+    local isContiguous = true
+    for i = 2, #indexMap do
+        isContiguous = isContiguous and (indexMap[i] == indexMap[i - 1] + 1)
+    end
+
+    selectionInfo.indexMap = indexMap
+    selectionInfo.originalCcCount = #newCmds
+    selectionInfo.isContiguous = isContiguous
+    SetCcIdxsFor()
+
+    info("Reloaded '%s': %s added or modified, %d removed.", compileCommandsFile,
+         pluralize(#addedCcIdxs, "compile command"), removedCount)
+
+    return addedCcIdxs, newIdxOf
+end
+
 ------------------------------
 
-local function Poll(spec)
-    local isReady = {}
-    local pollfds = posix.poll(spec)
+-- <outputSpec>: optional table as passed to posix.poll(), for file descriptors for which
+--  any event is accepted.
+local function Poll(spec, outputSpec)
+    local isReady, isInputFd = {}, {}
+    local pollfds = posix.pollMulti({spec, outputSpec or {}})
+
+    for _, fd in ipairs(spec) do
+        isInputFd[fd] = true
+    end
 
     for _, event in ipairs(pollfds) do
-        assert(event.revents == POLL.IN)  -- TODO: handle POLL.ERR?
+        -- TODO: handle POLL.ERR?
+        assert(not isInputFd[event.fd] or event.revents == POLL.IN)
         isReady[event.fd] = true
     end
 
     return isReady
 end
 
+---------- Project precompiled headers (option -A) ----------
+
+-- Headers modified within this many seconds are not put into a project PCH.
+local StableHeaderAge = 3600
+
+-- Identifies the set of compile commands sharing a project PCH: all options are the same.
+local function GetPchGroupSignature(cmd)
+    local args = util.copySequence(cmd.arguments)
+    table.remove(args, cmd.fileNameIdx)
+    return table.concat({ cmd.directory, table.concat(args, '\0') }, '\0')
+end
+
+-- Returns the sequence of headers to put into a project PCH for the compile commands
+-- <ccIdxs> and the sequence of indexes of those compile commands that include all of them,
+-- or nil if there are no suitable headers.
+local function SelectProjectPchHeaders(ccIdxs, ccInclusionGraphs, isMainFile)
+    -- [<file name>] = <number of compile commands including it>
+    local includeCounts = {}
+    local candidates = {}
+
+    for _, ccIdx in ipairs(ccIdxs) do
+        for _, fileName in ccInclusionGraphs[ccIdx]:iFileNames() do
+            if (not isMainFile[fileName]) then
+                local count = includeCounts[fileName]
+                if (count == nil) then
+                    candidates[#candidates + 1] = fileName
+                end
+                includeCounts[fileName] = (count or 0) + 1
+            end
+        end
+    end
+
+    table.sort(candidates, function(a, b)
+        local countA, countB = includeCounts[a], includeCounts[b]
+        return (countA > countB or (countA == countB and a < b))
+    end)
+
+    local stableTime = os.time() - StableHeaderAge
+    local headers, usingCcIdxs = {}, ccIdxs
+
+    for _, fileName in ipairs(candidates) do
+        if (#headers == projectPchHeaderCount or
+                includeCounts[fileName] < PchCountThreshold) then
+            break
+        end
+
+        local mtime = posix.getModificationTime(fileName)
+
+        if (mtime ~= nil and mtime <= stableTime) then
+            -- Greedily narrow down the compile commands to those including all headers.
+            local newUsingCcIdxs = {}
+
+            for _, ccIdx in ipairs(usingCcIdxs) do
+                if (ccInclusionGraphs[ccIdx]:getNode(fileName) ~= nil) then
+                    newUsingCcIdxs[#newUsingCcIdxs + 1] = ccIdx
+                end
+            end
+
+            if (#newUsingCcIdxs >= PchCountThreshold) then
+                headers[#headers + 1] = fileName
+                usingCcIdxs = newUsingCcIdxs
+            end
+        end
+    end
+
+    if (#headers == 0) then
+        return nil
+    end
+
+    return headers, usingCcIdxs
+end
+
+-- Returns the sequence of <headers> and all files that they include, directly or
+-- indirectly, according to the "isIncludedBy" inclusion graph <graph>.
+local function GetIncludedFiles(graph, headers)
+    -- [<file name>] = <sequence of names of the files it includes>
+    local includesOf = {}
+
+    for _, fileName in graph:iFileNames() do
+        for _, includerName in graph:getNode(fileName):iEdges() do
+            includesOf[includerName] = includesOf[includerName] or {}
+            table.insert(includesOf[includerName], fileName)
+        end
+    end
+
+    local files, isSeen = {}, {}
+
+    local function visit(fileName)
+        if (not isSeen[fileName]) then
+            isSeen[fileName] = true
+            files[#files + 1] = fileName
+
+            for _, includedName in ipairs(includesOf[fileName] or {}) do
+                visit(includedName)
+            end
+        end
+    end
+
+    for _, header in ipairs(headers) do
+        visit(header)
+    end
+
+    return files
+end
+
+-- A PCH containing the standard library headers and a selection of project headers,
+-- shared by compile commands with identical options.
+local ProjectPch = class
+{
+    function(groupSignature, headers, depFiles, cmds)
+        local baseName = CacheDirectory.."/project-"..hashString(groupSignature)
+        local isDepFile = {}
+
+        for _, fileName in ipairs(depFiles) do
+            isDepFile[fileName] = true
+        end
+
+        return {
+            headers = headers,
+            -- Sequence of the non-system files that go into the PCH.
+            depFiles = depFiles,
+            isDepFile = isDepFile,
+            -- The compile commands that the PCH is for. They all include each header.
+            cmds = cmds,
+
+            sourceFileName = baseName..".hpp",
+            fileName = baseName..".pch",
+            isAttached = false,
+
+            -- While building: see ExecuteInBackground().
+            build_ = nil,
+            buildStartTime_ = nil,
+        }
+    end,
+
+    -- Returns true if the PCH file exists and is newer than all files that went into it.
+    isUpToDate = function(self)
+        local pchTime = posix.getModificationTime(self.fileName)
+        local f = io.open(self.sourceFileName)
+
+        if (pchTime == nil or f == nil) then
+            return false
+        end
+
+        local sourceText = f:read("*a")
+        f:close()
+
+        if (sourceText ~= self:getSourceText_()) then
+            return false
+        end
+
+        local fileNames = { resolveClangBinary("clang++"), self.cmds[1].pchFileName }
+
+        for _, fileName in ipairs(self.depFiles) do
+            fileNames[#fileNames + 1] = fileName
+        end
+
+        for _, fileName in ipairs(fileNames) do
+            local mtime = posix.getModificationTime(fileName)
+            if (mtime == nil or mtime >= pchTime) then
+                return false
+            end
+        end
+
+        return true
+    end,
+
+    isBuilding = function(self)
+        return (self.build_ ~= nil)
+    end,
+
+    startBuild = function(self)
+        assert(not self:isBuilding())
+
+        local f = io.open(self.sourceFileName, "w")
+        local ok = (f ~= nil) and f:write(self:getSourceText_())
+        ok = (f ~= nil) and f:close() and ok
+
+        if (not ok) then
+            warnInfo("Project PCH: failed writing '%s'.", self.sourceFileName)
+            return
+        end
+
+        -- Build with the options of the compile commands, replacing the source file.
+        local cmd = self.cmds[1]
+        local args = { "-x", "c++-header" }
+
+        for i, arg in ipairs(cmd.arguments) do
+            args[#args + 1] = (i == cmd.fileNameIdx) and self.sourceFileName or arg
+        end
+
+        -- NOTE: build into a temporary file, so that compile commands running concurrently
+        --  still see the old one.
+        args[#args + 1] = "-o"
+        args[#args + 1] = self:getTempFileName_()
+
+        self.buildStartTime_ = os.time()
+        self.build_ = ExecuteInBackground(resolveClangBinary("clang++"), args)
+    end,
+
+    -- Returns true if a build has finished successfully since the last call, and the PCH
+    -- is thus ready to be attached. A build that failed is not repeated until one of the
+    -- files going into the PCH is modified.
+    checkBuild = function(self)
+        if (not self:isBuilding()) then
+            return false
+        end
+
+        local exitCode = self.build_()
+        if (exitCode == nil) then
+            return false
+        end
+
+        self.build_ = nil
+        local tempFileName = self:getTempFileName_()
+
+        if (exitCode ~= 0) then
+            os.remove(tempFileName)
+            if (opts.v) then
+                warnInfo("Project PCH: generation of %s failed.", self.fileName)
+            end
+            return false
+        end
+
+        for _, fileName in ipairs(self.depFiles) do
+            local mtime = posix.getModificationTime(fileName)
+
+            if (mtime == nil or mtime >= self.buildStartTime_) then
+                -- Possibly modified during the build.
+                os.remove(tempFileName)
+                self:startBuild()
+                return false
+            end
+        end
+
+        if (not os.rename(tempFileName, self.fileName)) then
+            os.remove(tempFileName)
+            return false
+        end
+
+        return true
+    end,
+
+    attach = function(self)
+        for _, cmd in ipairs(self.cmds) do
+            cmd.projectPchFileName = self.fileName
+            cmd.projectPchDeps = self.depFiles
+        end
+
+        self.isAttached = true
+    end,
+
+    detach = function(self)
+        for _, cmd in ipairs(self.cmds) do
+            cmd.projectPchFileName = nil
+            cmd.projectPchDeps = nil
+        end
+
+        self.isAttached = false
+    end,
+
+-- private:
+    getSourceText_ = function(self)
+        local lines = { format('#include "%s"', (GetPchInputFiles())) }
+
+        for _, header in ipairs(self.headers) do
+            lines[#lines + 1] = format('#include "%s"', header)
+        end
+
+        return table.concat(lines, '\n')..'\n'
+    end,
+
+    getTempFileName_ = function(self)
+        return self.fileName..".tmp"..tostring(ffi.C.getpid())
+    end,
+}
+
+-- [<group signature>] = <ProjectPch>, or false if the group has no suitable headers.
+-- Each group of PCH-enabled compile commands with identical options is considered once,
+-- as soon as all of its compile commands have an inclusion graph.
+--
+-- NOTE: compile commands added by a reload of the compilation database do not join a
+--  group that has already been considered.
+local ProjectPchs = {}
+
+-- Sets up the project PCHs for groups not considered so far, starting the build of those
+-- that are not up to date. Returns true if any one was attached to compile commands.
+local function UpdateProjectPchs(ccInclusionGraphs)
+    local isMainFile = {}
+    -- [<group signature>] = <sequence of compile command indexes>
+    local groupCcIdxs, groupSignatures = {}, {}
+
+    for ccIdx, cmd in ipairs(compileCommands) do
+        isMainFile[cmd.file] = true
+
+        if (cmd.pchFileName ~= nil) then
+            local signature = GetPchGroupSignature(cmd)
+
+            if (ProjectPchs[signature] == nil) then
+                if (groupCcIdxs[signature] == nil) then
+                    groupCcIdxs[signature] = {}
+                    groupSignatures[#groupSignatures + 1] = signature
+                end
+
+                table.insert(groupCcIdxs[signature], ccIdx)
+            end
+        end
+    end
+
+    local attachedCount, buildCount = 0, 0
+
+    for _, signature in ipairs(groupSignatures) do
+        local ccIdxs = groupCcIdxs[signature]
+        local haveAllGraphs = (#ccIdxs >= PchCountThreshold)
+
+        for _, ccIdx in ipairs(ccIdxs) do
+            haveAllGraphs = haveAllGraphs and (ccInclusionGraphs[ccIdx] ~= nil)
+        end
+
+        if (haveAllGraphs) then
+            local headers, usingCcIdxs =
+                SelectProjectPchHeaders(ccIdxs, ccInclusionGraphs, isMainFile)
+            ProjectPchs[signature] = false
+
+            if (headers ~= nil) then
+                local cmds = {}
+                for _, ccIdx in ipairs(usingCcIdxs) do
+                    cmds[#cmds + 1] = compileCommands[ccIdx]
+                end
+
+                local depFiles = GetIncludedFiles(ccInclusionGraphs[usingCcIdxs[1]], headers)
+                local pch = ProjectPch(signature, headers, depFiles, cmds)
+                ProjectPchs[signature] = pch
+
+                if (pch:isUpToDate()) then
+                    pch:attach()
+                    attachedCount = attachedCount + #cmds
+                else
+                    pch:startBuild()
+                    buildCount = buildCount + (pch:isBuilding() and 1 or 0)
+                end
+            end
+        end
+    end
+
+    if (attachedCount > 0) then
+        info("Project PCH: enabled %s.", pluralize(attachedCount, "compile command"))
+    end
+
+    if (buildCount > 0) then
+        info("Project PCH: building %s in the background.", pluralize(buildCount, "PCH file"))
+    end
+
+    return (attachedCount > 0)
+end
+
+-- Detaches the project PCHs that any of <eventFileNames> go into and starts rebuilding
+-- them. Attaches the ones whose build has finished.
+-- Returns true if the PCH usage of any compile command has changed.
+local function HandleProjectPchs(eventFileNames)
+    local haveChanged = false
+    local attachedCount = 0
+
+    for _, pch in pairs(ProjectPchs) do
+        if (pch) then
+            local isAffected = false
+
+            for _, fileName in ipairs(eventFileNames) do
+                isAffected = isAffected or (pch.isDepFile[fileName] == true)
+            end
+
+            if (isAffected) then
+                haveChanged = haveChanged or pch.isAttached
+                pch:detach()
+
+                -- NOTE: a build in progress is restarted once it finishes. See checkBuild().
+                if (not pch:isBuilding()) then
+                    pch:startBuild()
+                end
+            elseif (pch:checkBuild()) then
+                pch:attach()
+                haveChanged = true
+                attachedCount = attachedCount + #pch.cmds
+            end
+        end
+    end
+
+    if (attachedCount > 0) then
+        info("Project PCH: enabled %s.", pluralize(attachedCount, "compile command"))
+    end
+
+    return haveChanged
+end
+
 local function main()
     PrintInitialInfo()
     SetSigintHandler()
@@ -2271,15 +5054,33 @@ local function main()
     local ccInclusionGraphs = {}
 
     local parserOpts = printGraphMode and {"SkipFunctionBodies", "Incomplete"} or {}
-    local control = Controller({}, range(#compileCommands), parserOpts)
+
+    if (useWorkerPool) then
+        -- The workers use their copy of the compile commands.
+        WaitForPreparedCompileCommand()
+    end
+
+    -- NOTE: fork the workers before anything that they should not inherit is set up.
+    local workerPool = useWorkerPool and WorkerPool(usedConcurrency, parserOpts) or nil
+    local initialMembers = { workerPool=workerPool }
+    local initialCcIdxs = range(#compileCommands)
+
+    if (useSnapshot) then
+        initialMembers.notifier = Notifier()
+        initialMembers.miFormattedDiagSets = {}
+        initialCcIdxs = RestoreSnapshot(ccInclusionGraphs, initialMembers)
+    end
+
+    local control = Controller(initialMembers, initialCcIdxs, parserOpts)
 
     repeat
         -- Print current diagnostics.
         -- TODO: think about handling case when files change more properly.
-        -- TODO: in particular, moves and deletions. (Have common logic with compile_commands.json change?)
-        -- Later: handle special case of a change of compile_commands.json, too.
+        -- TODO: in particular, moves and deletions.
 
-        local processedCommandCount = control:printDiagnostics(ccInclusionGraphs)
+        -- NOTE: with a snapshot, all compile commands may have been restored.
+        local processedCommandCount = (#control:getCcIdxs() > 0) and
+            control:printDiagnostics(ccInclusionGraphs) or 0
         local notifier
 
         -- TODO: move to separate application
@@ -2290,7 +5091,14 @@ local function main()
             -- #include errors!
         end
 
+        -- With -A: whether the compile commands have changed by attaching a project PCH.
+        local haveAttachedPch = false
+
         if (not exitImmediately) then
+            if (projectPchHeaderCount ~= nil) then
+                haveAttachedPch = UpdateProjectPchs(ccInclusionGraphs)
+            end
+
             notifier = control:getNotifier()
             info("Watching %d files.", notifier:getWatchedFileCount())
         end
@@ -2309,17 +5117,36 @@ local function main()
                        os.difftime(os.time(), startTime))
         printf("")
 
+        if (useSnapshot) then
+            WriteSnapshot(ccInclusionGraphs, control.miFormattedDiagSets)
+        end
+
+        -- Finish the preparation of compile commands not processed yet (for example, due
+        -- to an early stop), storing its results for the next startup.
+        WaitForPreparedCompileCommand()
+        -- Store the costs for the scheduling of the next invocation.
+        WriteCcCosts()
+
         if (exitImmediately) then
             break
         end
 
-        if (commandMode) then
+        if (commandMode and not notifier:hasPendingEvents()) then
             local fileInotifyFd = notifier:getRawFd()
             local clientInotifyFd = mi.clientInotifier:getRawFd()
 
             repeat
-                -- Wait for either changes to files or client requests.
-                local isReady = Poll({events=POLL.IN, fileInotifyFd, clientInotifyFd})
+                -- Wait for either changes to files or client requests, and write pending
+                -- results to clients while doing that.
+                local outputFds = MI.GetPendingOutputFds()
+                outputFds.events = POLL.OUT
+
+                local isReady = Poll({events=POLL.IN, fileInotifyFd, clientInotifyFd},
+                                     outputFds)
+
+                if (#outputFds > 0) then
+                    MI.FlushOutputQueues()
+                end
 
                 if (isReady[clientInotifyFd]) then
                     MI.HandleClientRequests{control, ccInclusionGraphs, function(_)
@@ -2331,23 +5158,62 @@ local function main()
         end
 
         -- Wait for and react to changes to watched files. In command mode, the waiting part
-        -- has already been accomplished (see above).
-        local events = notifier:check_()
-        local eventFileNames = {}
-        for _, event in ipairs(events) do
-            eventFileNames[#eventFileNames + 1] = notifier:getFileName(event)
+        -- has already been accomplished (see above). Events that arrived while processing
+        -- are taken, too.
+        local eventFileNames, haveCompileCommandsEvent = notifier:takeEvents()
+
+        local addedCcIdxs, newIdxOf = nil, nil
+        local restartWorkerPool = haveAttachedPch
+
+        if (haveCompileCommandsEvent) then
+            addedCcIdxs, newIdxOf = ReloadCompileCommands(
+                ccInclusionGraphs, control.miFormattedDiagSets)
+        end
+
+        if (newIdxOf ~= nil) then
+            -- Carry over the state of the previous run to the new indexes.
+            local keptCcIdxs, keptProcessedCount = {}, 0
+
+            for i, oldIdx in ipairs(currentCcIdxs) do
+                if (newIdxOf[oldIdx] ~= nil) then
+                    keptCcIdxs[#keptCcIdxs + 1] = newIdxOf[oldIdx]
+                    keptProcessedCount = keptProcessedCount + (i <= processedCommandCount and 1 or 0)
+                end
+            end
+
+            currentCcIdxs, processedCommandCount = keptCcIdxs, keptProcessedCount
+            restartWorkerPool = true
+        end
+
+        if (projectPchHeaderCount ~= nil) then
+            -- NOTE: compile commands that were using a detached PCH depend on the modified
+            --  file, and are thus re-processed below.
+            restartWorkerPool = HandleProjectPchs(eventFileNames) or restartWorkerPool
+        end
+
+        if (restartWorkerPool and workerPool ~= nil) then
+            -- The workers have a copy of the compile commands taken when they were forked.
+            -- NOTE: the new ones inherit the file descriptors we have open by now.
+            workerPool:shutdown()
+            workerPool = WorkerPool(usedConcurrency, parserOpts)
         end
 
         -- Determine the set of compile commands to re-process.
         local newCcIdxs, affectedCcIdxs, earlyStopCount = GetNewCcIndexes(
-            ccInclusionGraphs, eventFileNames,
+            ccInclusionGraphs, notifier, eventFileNames,
             processedCommandCount, currentCcIdxs)
 
+        for _, ccIdx in ipairs(addedCcIdxs or {}) do
+            -- NOTE: these are greater than any other index, preserving the sort order.
+            newCcIdxs[#newCcIdxs + 1] = ccIdx
+        end
+
         local getFileStr = function(i)
             return colorize(eventFileNames[i], Col.Bold..Col.White)
         end
 
         local modifiedFilesStr =
+            (#eventFileNames == 0) and colorize(compileCommandsFile, Col.Bold..Col.White) or
             (#eventFileNames == 1) and getFileStr(1) or
             (#eventFileNames == 2) and format("%s and %s", getFileStr(1), getFileStr(2)) or
             format("%s and %d more files", getFileStr(1), #eventFileNames - 1)
@@ -2372,6 +5238,8 @@ local function main()
             notifier = notifier,
 
             miFormattedDiagSets = filter(control.miFormattedDiagSets),
+
+            workerPool = workerPool,
         }
 
         for _, ccIdx in ipairs(affectedCcIdxs) do
@@ -2379,6 +5247,11 @@ local function main()
             membersTakenOver.miFormattedDiagSets[ccIdx] = nil
         end
 
+        if (commandMode) then
+            -- Drop the diagnostics that have been superseded, if they take up much space.
+            mi.diagSetLog:compact(membersTakenOver.miFormattedDiagSets)
+        end
+
         startTime = os.time()
 
         -- Ensure that the memory obtained for the symbol index is munmap()'d.
@@ -2387,6 +5260,10 @@ local function main()
 
         control = Controller(membersTakenOver, newCcIdxs, parserOpts)
     until (false)
+
+    if (workerPool ~= nil) then
+        workerPool:shutdown()
+    end
 end
 
 main()
@@ -176,11 +176,10 @@ if [ $block == yes ]; then
         exit 101
     fi
 
-    # Read the success status of the request, waiting for a bit longer.
-    #
-    # TODO: elaborate timing expectations/requirements (e.g. it may be OK for the server to
-    #  delay a computation until the respective compile command has been processed).
-    read -rs -N 3 -u ${resultFd} -t 10.0 res
+    # Read the success status of the request, waiting for a bit longer. (The server delays
+    # the response to a 'diags' request until the respective compile commands have been
+    # processed, which it does right away.)
+    read -rs -N 3 -u ${resultFd} -t 60.0 res
 
     if [ $? -gt 128 ]; then
         exitWithTimeout